@@ -0,0 +1,134 @@
+#pragma once
+
+//Minimal benchmark harness shared by the programs in bench/
+//Each case is calibrated until one sample takes at least minTime, then
+//sampled several times; results are collected as JSON so runs can be
+//compared across releases.
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+namespace Bench {
+
+//Keeps the compiler from discarding a computed value
+template<class T>
+inline void doNotOptimize(const T& value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+inline Json::Value header(const std::string& benchmark) {
+	Json::Value root;
+
+	root["benchmark"] = benchmark;
+	root["timestamp"] = static_cast<Json::Int64>(std::time(nullptr));
+#ifdef VERSION_HASH
+	root["version"] = VERSION_HASH;
+#endif
+#ifdef NDEBUG
+	root["build"] = "release";
+#else
+	root["build"] = "debug";
+#endif
+
+	return root;
+}
+
+class Runner {
+public:
+	Runner(const std::string& benchmark, int argc, char* argv[])
+		:	root(header(benchmark))
+		,	minTime{0.1}
+		,	samples{5} {
+
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+
+			if( (arg == "--filter") && (i+1 < argc) ) {
+				filter = argv[++i];
+			}
+			else if( (arg == "--min-time") && (i+1 < argc) ) {
+				minTime = std::stod(argv[++i]);
+			}
+			else if( (arg == "--samples") && (i+1 < argc) ) {
+				samples = std::max(1, std::stoi(argv[++i]));
+			}
+			else {
+				throw std::runtime_error("Usage: " + std::string{argv[0]}
+					+ " [--filter <substring>] [--min-time <seconds>] [--samples <n>]");
+			}
+		}
+
+		root["results"] = Json::arrayValue;
+	}
+
+	//fn performs one operation; items is how many units (LEDs, bytes,
+	//messages) one operation processes
+	template<class F>
+	void run(const std::string& name, F fn, uint64_t items = 1) {
+		if(!filter.empty() && (name.find(filter) == std::string::npos)) {
+			return;
+		}
+
+		uint64_t iterations = 1;
+		while(time(fn, iterations) < minTime) {
+			iterations *= 2;
+		}
+
+		std::vector<double> perOp;
+		for(int i = 0; i < samples; ++i) {
+			perOp.push_back(1e9*time(fn, iterations)/iterations);
+		}
+		std::sort(perOp.begin(), perOp.end());
+
+		double median = perOp[perOp.size()/2];
+
+		Json::Value result;
+		result["name"] = name;
+		result["iterations"] = static_cast<Json::UInt64>(iterations);
+		result["samples"] = samples;
+		result["ns_per_op"] = median;
+		result["min_ns_per_op"] = perOp.front();
+		result["max_ns_per_op"] = perOp.back();
+		result["items_per_op"] = static_cast<Json::UInt64>(items);
+		result["items_per_second"] = 1e9*items/median;
+
+		root["results"].append(result);
+
+		std::cerr << name << ": " << median << " ns/op" << std::endl;
+	}
+
+	Json::Value& getRoot() {
+		return root;
+	}
+
+	void write(std::ostream& out) const {
+		out << Json::StyledWriter().write(root);
+	}
+
+private:
+	template<class F>
+	static double time(F& fn, uint64_t iterations) {
+		auto start = std::chrono::steady_clock::now();
+
+		for(uint64_t i = 0; i < iterations; ++i) {
+			fn();
+		}
+
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	Json::Value root;
+	std::string filter;
+	double minTime;
+	int samples;
+};
+
+} //namespace Bench
@@ -0,0 +1,154 @@
+//Microbenchmarks for the color, packet, send pipeline and framing primitives
+//Usage: Microbench [--filter <substring>] [--min-time <seconds>] [--samples <n>]
+//Writes JSON results to stdout, progress to stderr
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.hpp"
+
+#include "CloudServer.hpp"
+#include "Color.hpp"
+#include "DatagramPool.hpp"
+#include "MpscQueue.hpp"
+#include "Packet.hpp"
+
+using Bench::doNotOptimize;
+
+static std::vector<Color> rainbow(size_t count) {
+	std::vector<Color> leds;
+	leds.reserve(count);
+
+	for(size_t i = 0; i < count; ++i) {
+		leds.push_back(Color::HSV(i*256/count, 255, 200));
+	}
+
+	return leds;
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		Bench::Runner runner{"Microbench", argc, argv};
+
+		const size_t LED_COUNTS[] = {30, 300, 3000, 30000};
+
+		//Color
+		{
+			uint8_t hue = 0;
+			runner.run("Color::HSV", [&hue]() {
+				doNotOptimize(Color::HSV(hue++, 200, 180));
+			});
+		}
+
+		{
+			auto colors = rainbow(256);
+			size_t i = 0;
+
+			runner.run("Color::getHue", [&]() {
+				doNotOptimize(colors[i++ & 0xFF].getHue());
+			});
+			runner.run("Color::getSat", [&]() {
+				doNotOptimize(colors[i++ & 0xFF].getSat());
+			});
+			runner.run("Color::getVal", [&]() {
+				doNotOptimize(colors[i++ & 0xFF].getVal());
+			});
+
+			runner.run("Color::gammaCorrect", [&]() {
+				Color c = colors[i++ & 0xFF];
+				c.gammaCorrect(2.2);
+				doNotOptimize(c);
+			});
+
+			Color white{255, 255, 255};
+			runner.run("Color::filter", [&]() {
+				doNotOptimize(colors[i++ & 0xFF].filter(white, 0.25));
+			});
+		}
+
+		//Packet
+		for(auto count : LED_COUNTS) {
+			auto leds = rainbow(count);
+
+			runner.run("Packet::UpdateColor/" + std::to_string(count), [&leds]() {
+				doNotOptimize(Packet::UpdateColor(0, leds));
+			}, count);
+		}
+
+		for(auto count : LED_COUNTS) {
+			auto packet = Packet::UpdateColor(0, rainbow(count));
+
+			runner.run("Packet::asDatagram/" + std::to_string(count), [&packet]() {
+				doNotOptimize(packet.asDatagram());
+			}, count);
+		}
+
+		for(auto count : LED_COUNTS) {
+			auto datagram = Packet::UpdateColor(0, rainbow(count)).asDatagram();
+
+			runner.run("Packet::Packet(vector)/" + std::to_string(count), [&datagram]() {
+				doNotOptimize(Packet{datagram});
+			}, count);
+		}
+
+		for(auto count : LED_COUNTS) {
+			auto leds = rainbow(count);
+			std::vector<uint8_t> out(Packet::updateColorSize(count));
+
+			runner.run("Packet::writeUpdateColor/" + std::to_string(count), [&]() {
+				Packet::writeUpdateColor(0, leds, out.data());
+				doNotOptimize(out);
+			}, count);
+		}
+
+		//Send pipeline: buffer from the pool through the queue and back
+		{
+			DatagramPool pool{64};
+			MpscQueue<DatagramPool::Datagram> queue;
+
+			runner.run("DatagramPool::acquire+release", [&pool]() {
+				auto datagram = pool.acquire();
+				doNotOptimize(datagram);
+				pool.release(datagram);
+			});
+
+			runner.run("MpscQueue::push+pop", [&]() {
+				auto datagram = pool.acquire();
+				queue.push(datagram);
+				pool.release(queue.pop());
+			});
+		}
+
+		//Cloud framing, a typical v2 directive as sent by the Lambda
+		{
+			const std::string directive = "{\"header\":{\"namespace\":\"Alexa.ConnectedHome.Control\","
+				"\"name\":\"SetColorRequest\",\"payloadVersion\":\"2\",\"messageId\":"
+				"\"8f2b3c4d-0000-4a1b-9c2d-1234567890ab\"},\"payload\":{\"accessToken\":\"token\","
+				"\"appliance\":{\"applianceId\":\"Living Room:Lamp\",\"additionalApplianceDetails\":{}},"
+				"\"color\":{\"hue\":120.0,\"saturation\":0.75,\"brightness\":0.5}}}\r\n\r\n";
+			const size_t MESSAGES = 16;
+
+			std::string stream;
+			for(size_t i = 0; i < MESSAGES; ++i) {
+				stream += directive;
+			}
+
+			runner.run("CloudServer::parseMessage", [&stream]() {
+				std::string buffer = stream, msg;
+
+				while(CloudServer::parseMessage(buffer, msg)) {
+					doNotOptimize(msg);
+				}
+			}, MESSAGES);
+		}
+
+		runner.write(std::cout);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
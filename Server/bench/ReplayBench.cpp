@@ -0,0 +1,377 @@
+//Replays recorded cloud directives through AlexaHub::processCloudMsg
+//against a synthetic topology and reports throughput, latency
+//percentiles and heap allocations per request.
+//Usage: ReplayBench [options], see printUsage()
+//
+//A recording holds directives framed as on the wire, each terminated by
+//\r\n\r\n. Appliance ids that are not in the synthetic topology are mapped
+//onto its lights, so traffic recorded on any installation can be replayed.
+//Without --input a synthetic mix of discovery, SetColor, SetPercentage,
+//TurnOn and TurnOff is generated.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bench.hpp"
+#include "../tools/CloudClient.hpp"
+
+#include "AlexaHub.hpp"
+#include "CloudServer.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+
+//Heap allocations made by the current thread
+static thread_local uint64_t allocations;
+
+void* operator new(size_t size) {
+	++allocations;
+
+	if(auto ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+struct Options {
+	std::string input, writeMix;
+	size_t lights = 100, lightsPerNode = 4, leds = 30;
+	size_t threads = 1, requests = 20000, warmup = 1000, mixSize = 1000;
+	bool keepIds = false;
+};
+
+static void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--input <file>\tRecorded directives, \\r\\n\\r\\n framed\n"
+		<< "\t--write-mix <file>\tWrite the generated mix in recording format and exit\n"
+		<< "\t--lights <n>\tLights in the synthetic topology (100)\n"
+		<< "\t--lights-per-node <n>\t(4)\n"
+		<< "\t--leds <n>\tLEDs per light (30)\n"
+		<< "\t--threads <n>\tThreads calling processCloudMsg (1)\n"
+		<< "\t--requests <n>\tRequests per thread (20000)\n"
+		<< "\t--warmup <n>\tUntimed requests before the run (1000)\n"
+		<< "\t--mix-size <n>\tDirectives in the generated mix (1000)\n"
+		<< "\t--keep-ids\tDo not map unknown appliance ids onto synthetic lights\n"
+		<< "\t--log-level <level>\t(warning)\n";
+}
+
+static std::string lightId(size_t index, size_t lightsPerNode) {
+	return "node-" + std::to_string(index/lightsPerNode) + ":light-"
+		+ std::to_string(index%lightsPerNode);
+}
+
+static std::vector<std::string> generateMix(const Options& options) {
+	std::mt19937 rng{1};
+	std::uniform_int_distribution<size_t> pickLight(0, options.lights - 1);
+	std::uniform_int_distribution<int> percent(0, 99);
+
+	std::vector<std::string> mix;
+
+	for(size_t i = 0; i < options.mixSize; ++i) {
+		auto light = pickLight(rng);
+
+		//One in twenty commands addresses a whole node
+		std::string id = (percent(rng) < 5)
+			? "group:node-" + std::to_string(light/options.lightsPerNode)
+			: lightId(light, options.lightsPerNode);
+
+		int kind = percent(rng);
+
+		if(kind < 1) {
+			mix.push_back(CloudClient::directive("DiscoverAppliancesRequest", id));
+		}
+		else if(kind < 41) {
+			Json::Value color;
+			color["color"]["hue"] = percent(rng)*3.6;
+			color["color"]["saturation"] = percent(rng)/100.;
+			color["color"]["brightness"] = percent(rng)/100.;
+
+			mix.push_back(CloudClient::directive("SetColorRequest", id, color));
+		}
+		else if(kind < 61) {
+			Json::Value percentage;
+			percentage["percentageState"]["value"] = percent(rng);
+
+			mix.push_back(CloudClient::directive("SetPercentageRequest", id, percentage));
+		}
+		else if(kind < 81) {
+			mix.push_back(CloudClient::directive("TurnOnRequest", id));
+		}
+		else {
+			mix.push_back(CloudClient::directive("TurnOffRequest", id));
+		}
+	}
+
+	return mix;
+}
+
+static std::vector<std::string> loadRecording(const Options& options) {
+	std::ifstream file(options.input, std::ios::binary);
+	if(!file) {
+		throw std::runtime_error("Unable to open " + options.input);
+	}
+
+	std::string buffer{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+	std::vector<std::string> messages;
+	std::string msg;
+
+	while(CloudServer::parseMessage(buffer, msg)) {
+		messages.push_back(msg);
+	}
+
+	if(messages.empty()) {
+		throw std::runtime_error("No \\r\\n\\r\\n framed directives in " + options.input);
+	}
+
+	return messages;
+}
+
+//Points recorded appliance ids at lights of the synthetic topology
+static void remapIds(std::vector<std::string>& messages, const Options& options) {
+	//Node groups only exist for nodes with several lights
+	auto groupNodes = (options.lightsPerNode > 1) ? options.lights/options.lightsPerNode : 0;
+
+	auto remap = [&options, groupNodes](Json::Value& id) {
+		if(!id.isString()) {
+			return;
+		}
+
+		auto hash = std::hash<std::string>()(id.asString());
+
+		if( (id.asString().compare(0, 6, "group:") == 0) && (groupNodes > 0) ) {
+			id = "group:node-" + std::to_string(hash % groupNodes);
+		}
+		else {
+			id = lightId(hash % options.lights, options.lightsPerNode);
+		}
+	};
+
+	for(auto& msg : messages) {
+		Json::Value root;
+		Json::Reader reader;
+
+		if(reader.parse(msg, root) && root.isObject()) {
+			if(root.isMember("directive")) {
+				remap(root["directive"]["endpoint"]["endpointId"]);
+			}
+			else if(root["payload"].isMember("appliance")) {
+				remap(root["payload"]["appliance"]["applianceId"]);
+			}
+
+			msg = Json::FastWriter().write(root);
+		}
+	}
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+	Options options;
+
+	for(int i = 1; i < argc; ++i) {
+		std::string arg{argv[i]};
+		bool hasValue = (i+1 < argc);
+
+		if( (arg == "--input") && hasValue ) {
+			options.input = argv[++i];
+		}
+		else if( (arg == "--write-mix") && hasValue ) {
+			options.writeMix = argv[++i];
+		}
+		else if( (arg == "--lights") && hasValue ) {
+			options.lights = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if( (arg == "--lights-per-node") && hasValue ) {
+			options.lightsPerNode = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if( (arg == "--leds") && hasValue ) {
+			options.leds = std::stoul(argv[++i]);
+		}
+		else if( (arg == "--threads") && hasValue ) {
+			options.threads = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if( (arg == "--requests") && hasValue ) {
+			options.requests = std::stoul(argv[++i]);
+		}
+		else if( (arg == "--warmup") && hasValue ) {
+			options.warmup = std::stoul(argv[++i]);
+		}
+		else if( (arg == "--mix-size") && hasValue ) {
+			options.mixSize = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if(arg == "--keep-ids") {
+			options.keepIds = true;
+		}
+		else if( (arg == "--log-level") && hasValue ) {
+			Log::setLevel(Log::parseLevel(argv[++i]));
+		}
+		else {
+			throw std::runtime_error("Unknown option " + arg);
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char* argv[]) {
+	Log::setLevel(Log::Level::Warning);
+
+	Options options;
+	try {
+		options = parseOptions(argc, argv);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		auto messages = options.input.empty() ? generateMix(options) : loadRecording(options);
+
+		if(!options.writeMix.empty()) {
+			std::ofstream out(options.writeMix, std::ios::binary);
+			for(const auto& msg : messages) {
+				out << msg << "\r\n\r\n";
+			}
+
+			std::cerr << "Wrote " << messages.size() << " directives to " << options.writeMix
+				<< std::endl;
+			return 0;
+		}
+
+		if(!options.input.empty() && !options.keepIds) {
+			remapIds(messages, options);
+		}
+
+		//Frames go to a local sink, never onto the network
+		boost::asio::io_service sinkService;
+		boost::asio::ip::udp::socket sink{sinkService,
+			boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0)};
+
+		AlexaHub::Config config;
+		config.lightPort = sink.local_endpoint().port();
+		config.serverPort = 0;
+		config.metricsPort = 0;
+		config.discoveryAddress = boost::asio::ip::address_v4::loopback();
+
+		AlexaHub hub{config};
+
+		//Nodes live on 127.1.0.0/16, which the loopback interface answers for
+		for(size_t first = 0, node = 0; first < options.lights; first += options.lightsPerNode, ++node) {
+			std::vector<std::pair<std::string, uint16_t>> lights;
+
+			for(size_t i = first; (i < first + options.lightsPerNode) && (i < options.lights); ++i) {
+				lights.emplace_back("light-" + std::to_string(i - first), options.leds);
+			}
+
+			hub.getLightHub().addNode(boost::asio::ip::address_v4((127u << 24) | (1u << 16)
+				| (node + 1)), "node-" + std::to_string(node), lights);
+		}
+
+		for(size_t i = 0; i < options.warmup; ++i) {
+			hub.processCloudMsg(messages[i % messages.size()]);
+		}
+
+		Metrics::Histogram latency;
+		std::atomic<uint64_t> totalAllocations{0}, responseBytes{0};
+		std::promise<void> start;
+		std::shared_future<void> started = start.get_future();
+		std::vector<std::thread> threads;
+
+		for(size_t t = 0; t < options.threads; ++t) {
+			threads.emplace_back([&, t]() {
+				started.wait();
+
+				uint64_t allocated = allocations, bytes = 0;
+
+				for(size_t i = 0; i < options.requests; ++i) {
+					const auto& msg = messages[(t*options.requests/options.threads + i)
+						% messages.size()];
+
+					auto begin = std::chrono::steady_clock::now();
+					auto response = hub.processCloudMsg(msg);
+					auto end = std::chrono::steady_clock::now();
+
+					latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+						end - begin).count());
+					bytes += response.size();
+				}
+
+				totalAllocations += allocations - allocated;
+				responseBytes += bytes;
+			});
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+		start.set_value();
+
+		for(auto& thread : threads) {
+			thread.join();
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()
+			- begin).count();
+		uint64_t total = latency.count();
+
+		auto root = Bench::header("ReplayBench");
+		root["config"]["input"] = options.input.empty() ? "generated" : options.input;
+		root["config"]["directives"] = static_cast<Json::UInt64>(messages.size());
+		root["config"]["lights"] = static_cast<Json::UInt64>(options.lights);
+		root["config"]["lights_per_node"] = static_cast<Json::UInt64>(options.lightsPerNode);
+		root["config"]["leds"] = static_cast<Json::UInt64>(options.leds);
+		root["config"]["threads"] = static_cast<Json::UInt64>(options.threads);
+
+		root["requests"] = static_cast<Json::UInt64>(total);
+		root["seconds"] = seconds;
+		root["requests_per_second"] = total/seconds;
+		root["allocations_per_request"] = (total == 0) ? 0. : double(totalAllocations)/total;
+		root["response_bytes_per_request"] = (total == 0) ? 0. : double(responseBytes)/total;
+
+		auto& ns = root["latency_ns"];
+		ns["mean"] = (total == 0) ? 0. : double(latency.sum())/total;
+		ns["p50"] = static_cast<Json::UInt64>(latency.percentile(0.5));
+		ns["p90"] = static_cast<Json::UInt64>(latency.percentile(0.9));
+		ns["p99"] = static_cast<Json::UInt64>(latency.percentile(0.99));
+		ns["p999"] = static_cast<Json::UInt64>(latency.percentile(0.999));
+		ns["max"] = static_cast<Json::UInt64>(latency.max());
+
+		std::cout << Json::StyledWriter().write(root);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,36 +1,86 @@
 #include "AlexaHub.hpp"
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 
 using namespace boost::asio;
 
-AlexaHub::AlexaHub()
-	:	hub{PORT}
-	,	server{ioService, SERVER_PORT, [this](const std::string& msg) {
-			try {
-				auto response = processCloudMsg(msg);
+static Trace::Stage parseStage{"alexa.parse"};
+static Trace::Stage lookupStage{"alexa.lookup"};
+static Trace::Stage bufferStage{"light.buffer"};
+static Trace::Stage serializeStage{"alexa.serialize"};
+
+static Metrics::Counter& parseFailures = Metrics::counter("alexahub_parse_failures_total",
+	"Messages that could not be parsed", "source=\"cloud\"");
+
+//Directive names are untrusted input, only known ones get their own series
+static const char* const KNOWN_DIRECTIVES[] = {"ReportState", "DiscoverAppliancesRequest",
+	"SetColorRequest", "SetPercentageRequest", "TurnOnRequest", "TurnOffRequest"};
+static const size_t KNOWN_DIRECTIVE_COUNT = std::extent<decltype(KNOWN_DIRECTIVES)>::value;
+
+static Metrics::Counter& requestCounter(const std::string& command) {
+	//Resolved once, Metrics::counter() locks the registry; the last is "other"
+	static const auto counters = []() {
+		std::array<Metrics::Counter*, KNOWN_DIRECTIVE_COUNT + 1> counters;
+
+		for(size_t i = 0; i <= KNOWN_DIRECTIVE_COUNT; ++i) {
+			std::string label = (i < KNOWN_DIRECTIVE_COUNT) ? KNOWN_DIRECTIVES[i] : "other";
+
+			counters[i] = &Metrics::counter("alexahub_requests_total", "Cloud directives received",
+				"directive=\"" + label + "\"");
+		}
 
-				std::cout << "\n" << response << std::endl;
+		return counters;
+	}();
 
-				return response;
+	auto known = std::find(std::begin(KNOWN_DIRECTIVES), std::end(KNOWN_DIRECTIVES), command);
+
+	return *counters[known - std::begin(KNOWN_DIRECTIVES)];
+}
+
+AlexaHub::AlexaHub()
+	:	AlexaHub(Config{}) {
+}
+
+AlexaHub::AlexaHub(const Config& config)
+	:	hub{config.lightPort, 1000, config.discoveryAddress, config.lightShards}
+	,	server{ioService, config.serverPort, [this](const std::string& msg) {
+			try {
+				return processCloudMsg(msg);
 			}
 			catch(const std::exception& e) {
-				std::cout << "[Error] AlexaHub::processCloudMsg: " << e.what() << std::endl;
+				LOG_ERROR("AlexaHub::processCloudMsg: " << e.what());
 
 				return std::string{};
 			}
-		}}
+		}, config.maxCloudConnections}
 	,	ioWork{std::make_unique<io_service::work>(ioService)}
-	,	updateTimer{ioService, std::chrono::milliseconds(1000), [this]() {
-			for(const auto& node : hub) {
-				//std::cout << node.second.name << "\n";
+	,	signals{ioService, SIGINT, SIGTERM}
+	,	loopMonitor{ioService, "cloud"} {
 
-				for(const auto& light : node.second.lights) {
-					//std::cout << "\t" << light->getName() << "\n";
-				}
-			}
-			//std::cout << std::endl;
-	}} {
+	if(!config.stateFile.empty()) {
+		hub.loadState(config.stateFile);
+	}
+
+	if(config.metricsPort != 0) {
+		metricsServer = std::make_unique<MetricsServer>(ioService, ip::address_v4::loopback(),
+			config.metricsPort);
+	}
+
+	signals.async_wait([this](const boost::system::error_code& ec, int signal) {
+		if(!ec) {
+			LOG_INFO("AlexaHub: Caught signal " << signal << ", shutting down");
+
+			ioService.stop();
+		}
+	});
 }
 
 AlexaHub::~AlexaHub() {
@@ -38,71 +88,212 @@ AlexaHub::~AlexaHub() {
 }
 
 void AlexaHub::run() {
-	ioService.run();
+	loopMonitor.run();
+}
+
+LightHub& AlexaHub::getLightHub() {
+	return hub;
 }
 
 std::vector<std::shared_ptr<Light>> AlexaHub::getLights() const {
-	std::vector<std::shared_ptr<Light>> lights;
+	return hub.getTopology()->lights;
+}
+
+void AlexaHub::loadGroups(const std::string& path) {
+	std::ifstream file(path);
+	if(!file) {
+		throw std::runtime_error("AlexaHub::loadGroups: Unable to open " + path);
+	}
+
+	Json::Value root;
+	Json::Reader reader;
+	if(!reader.parse(file, root) || !root.isObject()) {
+		throw std::runtime_error("AlexaHub::loadGroups: Expected an object of group name to "
+			"light id arrays in " + path);
+	}
+
+	for(const auto& name : root.getMemberNames()) {
+		std::vector<std::string> members;
+
+		for(const auto& id : root[name]) {
+			members.push_back(id.asString());
+		}
+
+		configuredGroups[name] = members;
+	}
+
+	//Forces a rebuild that includes them
+	groupTable.store(std::make_shared<const GroupTable>());
+
+	LOG_INFO("AlexaHub::loadGroups: Loaded " << configuredGroups.size() << " groups from " << path);
+}
+
+std::shared_ptr<const AlexaHub::GroupTable> AlexaHub::getGroupTable() const {
+	auto topology = hub.getTopology();
+	auto table = groupTable.load();
+
+	if(table->topology != topology) {
+		table = buildGroupTable(std::move(topology));
+		groupTable.store(table);
+	}
+
+	return table;
+}
+
+std::shared_ptr<const AlexaHub::GroupTable> AlexaHub::buildGroupTable(
+	std::shared_ptr<const Topology> topology) const {
+	auto table = std::make_shared<GroupTable>();
+	table->topology = topology;
+
+	auto addGroup = [this, &table](const std::string& name, std::vector<std::shared_ptr<Light>> lights) {
+		if(lights.empty()) {
+			return;
+		}
+
+		//Appliance ids may only contain alphanumerics and _-=#;:?@&
+		std::string id = GROUP_PREFIX + name;
+		std::replace_if(id.begin() + GROUP_PREFIX.size(), id.end(), [](char c) {
+			return !std::isalnum(static_cast<unsigned char>(c))
+				&& (std::string{"_-=#;:?@&"}.find(c) == std::string::npos);
+		}, '_');
+
+		//Earlier groups keep their id, a later one with the same id is suffixed
+		auto unique = id;
+		for(int n = 2; table->indexById.count(unique) != 0; ++n) {
+			unique = id + "_" + std::to_string(n);
+		}
+
+		if(unique != id) {
+			LOG_WARNING("AlexaHub::buildGroupTable: Group id " << id << " of " << name
+				<< " is taken, using " << unique);
+		}
+
+		table->indexById.emplace(unique, table->groups.size());
+		table->groups.push_back({unique, name, std::move(lights)});
+	};
+
+	for(const auto& group : configuredGroups) {
+		std::vector<std::shared_ptr<Light>> lights;
+
+		for(const auto& id : group.second) {
+			auto light = topology->lightsById.find(id);
+
+			if(light != topology->lightsById.end()) {
+				lights.push_back(light->second);
+			}
+		}
+
+		addGroup(group.first, std::move(lights));
+	}
+
+	//Every node with several lights is treated as a room
+	for(const auto& node : topology->nodes) {
+		if(node.second.lights.size() > 1) {
+			addGroup(node.second.name, node.second.lights);
+		}
+	}
+
+	if(topology->lights.size() > 1) {
+		addGroup(ALL_LIGHTS_GROUP, topology->lights);
+	}
+
+	return table;
+}
 
-	for(auto& node : hub) {
-		for(const auto& light : node.second.lights) {
-			lights.push_back(light);
+std::vector<std::shared_ptr<Light>> AlexaHub::getTargets(const std::string& id) const {
+	if(id.compare(0, GROUP_PREFIX.size(), GROUP_PREFIX) == 0) {
+		auto table = getGroupTable();
+
+		auto group = table->indexById.find(id);
+		if(group == table->indexById.end()) {
+			return {};
 		}
+
+		return table->groups[group->second].lights;
 	}
 
-	return lights;
+	auto light = getLightById(id);
+	if(light) {
+		return {light};
+	}
+	else {
+		return {};
+	}
 }
 
 std::shared_ptr<Light> AlexaHub::getLightById(const std::string& id) const {
-	auto lights = getLights();
+	auto topology = hub.getTopology();
 
-	auto itr = std::find_if(lights.begin(), lights.end(), [&id](const auto& l) {
-		return id == l->getFullName();
-	});
+	auto itr = topology->lightsById.find(id);
 
-	if(itr == lights.end()) {
+	if(itr == topology->lightsById.end()) {
 		return {};
 	}
 	else {
-		return *itr;
+		return itr->second;
 	}
 }
 
 std::string AlexaHub::processCloudMsg(const std::string& msg) {
-	std::cout << "[Info] Received Cloud Message:\n" << msg << "\n";
+	LOG_DEBUG("AlexaHub::processCloudMsg: Received cloud message:\n" << msg);
 
 	Json::Value root = msg;
-	Json::Reader reader;
-	reader.parse(msg, root);
+	{
+		Trace::Span span{parseStage};
+
+		Json::Reader reader;
+		if(!reader.parse(msg, root)) {
+			parseFailures.inc();
+		}
+	}
 	
-	std::string nspace = root["header"]["namespace"].asString();
-	std::string command = root["header"]["name"].asString();
+	//Smart Home API v3 directives are wrapped in a "directive" object
+	const auto& header = root.isMember("directive") ? root["directive"]["header"] : root["header"];
+
+	std::string nspace = header["namespace"].asString();
+	std::string command = header["name"].asString();
+
+	requestCounter(command).inc();
 
 	Json::Value response;
 	std::string responseStr;
 	
-	if(nspace == "Alexa.ConnectedHome.Control") {
-		auto deviceName = root["payload"]["appliance"]["applianceId"].asString();
-		auto device = getLightById(deviceName);
-		
+	if( (nspace == "Alexa") && (command == "ReportState") ) {
+		const auto& directive = root["directive"];
+		std::shared_ptr<Light> device;
+		{
+			Trace::Span span{lookupStage};
+			device = getLightById(directive["endpoint"]["endpointId"].asString());
+		}
+
 		if(device) {
+			response = processReportState(device, directive);
+		}
+	}
+	else if(nspace == "Alexa.ConnectedHome.Control") {
+		//Either a single light or every member of a group
+		std::vector<std::shared_ptr<Light>> devices;
+		{
+			Trace::Span span{lookupStage};
+			devices = getTargets(root["payload"]["appliance"]["applianceId"].asString());
+		}
+		
+		if(!devices.empty()) {
 			if(command == "SetColorRequest") {
-				const auto hsb = root["payload"]["color"];
-				auto c = Color::HSV(255.f*hsb["hue"].asDouble()/360.f,
-					255.f*hsb["saturation"].asDouble(),
-					255.f*hsb["brightness"].asDouble());
+				const auto& hsb = root["payload"]["color"];
 
-					response = processSetColor(device, c);
+				response = processSetColor(devices, hsb["hue"].asDouble(),
+					hsb["saturation"].asDouble(), hsb["brightness"].asDouble());
 			}
 			else if(command == "SetPercentageRequest") {
-				response = processSetPercentage(device,
+				response = processSetPercentage(devices,
 					root["payload"]["percentageState"]["value"].asDouble());
 			}
 			else if(command == "TurnOnRequest") {
-				response = processTurnOn(device);
+				response = processTurnOn(devices);
 			}
 			else if(command == "TurnOffRequest") {
-				response = processTurnOff(device);
+				response = processTurnOff(devices);
 			}
 		}
 	}
@@ -112,16 +303,15 @@ std::string AlexaHub::processCloudMsg(const std::string& msg) {
 		}
 	}
 
-	if(response.isMember("header")) {
+	if(response.isObject()) {
+		Trace::Span span{serializeStage};
 		responseStr = Json::FastWriter().write(response);
 
-		std::cout << responseStr << "\n";
+		LOG_DEBUG("AlexaHub::processCloudMsg: Response:\n" << responseStr);
 	}
 	else {
-		std::cout << "\t[Error] Empty response!\n";
+		LOG_WARNING("AlexaHub::processCloudMsg: Empty response to " << nspace << "/" << command);
 	}
-	
-	std::cout << std::endl;
 
 	return responseStr;
 }
@@ -131,22 +321,22 @@ Json::Value AlexaHub::processDiscover() {
 
 	Json::Value devices{Json::arrayValue};
 
-	auto lights = getLights();
-	for(auto& light : lights) {
+	auto appliance = [](const std::string& id, const std::string& name,
+		const std::string& description, const std::string& model, bool reachable) {
 		Json::Value device;
 
 		auto types = Json::Value{Json::arrayValue};
 		types.append("LIGHT");
 		device["applianceTypes"] = types;
 
-		device["applianceId"] = light->getFullName();
+		device["applianceId"] = id;
 		device["manufacturerName"] = "ICEE";
-		device["modelName"] = "ICEE - SmartLight";
+		device["modelName"] = model;
 		device["version"] = "0.1";
 
-		device["friendlyName"] = light->getName();
-		device["friendlyDescription"] = light->getName() + " connected via AlexaHub by ICEE";
-		device["isReachable"] = true;
+		device["friendlyName"] = name;
+		device["friendlyDescription"] = description;
+		device["isReachable"] = reachable;
 		
 		auto actions = Json::Value{Json::arrayValue};
 		actions.append("setColor");
@@ -157,7 +347,24 @@ Json::Value AlexaHub::processDiscover() {
 
 		device["additionalApplianceDetails"] = Json::objectValue;
 
-		devices.append(device);
+		return device;
+	};
+
+	auto lights = getLights();
+	for(auto& light : lights) {
+		devices.append(appliance(light->getFullName(), light->getName(),
+			light->getName() + " connected via AlexaHub by ICEE", "ICEE - SmartLight",
+			light->isReachable()));
+	}
+
+	for(const auto& group : getGroupTable()->groups) {
+		//A group is usable as long as any of its lights is
+		bool reachable = std::any_of(group.lights.begin(), group.lights.end(),
+			[](const std::shared_ptr<Light>& light) { return light->isReachable(); });
+
+		devices.append(appliance(group.id, group.name, group.name + " (" +
+			std::to_string(group.lights.size()) + " lights) connected via AlexaHub by ICEE",
+			"ICEE - SmartLight Group", reachable));
 	}
 
 	response["header"]["messageId"] = "0000-0000-0000-0000";
@@ -169,8 +376,40 @@ Json::Value AlexaHub::processDiscover() {
 	return response;
 }
 
-Json::Value AlexaHub::processSetColor(std::shared_ptr<Light>& device, const Color& c) {
-	device->getBuffer().setAll(c);
+void AlexaHub::applyStates(const std::vector<std::shared_ptr<Light>>& devices,
+	const std::function<LightState(LightState)>& transform) {
+	
+	//Update every light first, then transmit all frames as one batch
+	{
+		Trace::Span span{bufferStage};
+
+		for(auto& device : devices) {
+			device->updateState(transform);
+		}
+	}
+
+	hub.update(devices);
+}
+
+Json::Value AlexaHub::processSetColor(const std::vector<std::shared_ptr<Light>>& devices,
+	double hue, double saturation, double brightness) {
+
+	//Clamped like processSetPercentage, out of range values must not wrap
+	LightState state{true, static_cast<uint16_t>(std::lround(std::max(0., std::min(359., hue)))),
+		static_cast<uint8_t>(std::lround(255.*std::max(0., std::min(1., saturation)))),
+		static_cast<uint8_t>(std::lround(100.*std::max(0., std::min(1., brightness))))};
+
+	//Same color for every light, so convert it only once
+	auto color = state.toColor();
+	{
+		Trace::Span span{bufferStage};
+
+		for(auto& device : devices) {
+			device->setState(state, color);
+		}
+	}
+
+	hub.update(devices);
 
 	Json::Value response;
 
@@ -179,18 +418,25 @@ Json::Value AlexaHub::processSetColor(std::shared_ptr<Light>& device, const Colo
 	response["header"]["name"] = "SetColorConfirmation";
 	response["header"]["payloadVersion"] = 2;
 
-	response["payload"]["achievedState"]["color"]["hue"] = c.getHue();
-	response["payload"]["achievedState"]["color"]["saturation"] = c.getSat();
-	response["payload"]["achievedState"]["color"]["brightness"] = c.getVal();
+	response["payload"]["achievedState"]["color"]["hue"] = state.hue;
+	response["payload"]["achievedState"]["color"]["saturation"] = state.saturation/255.;
+	response["payload"]["achievedState"]["color"]["brightness"] = state.brightness/100.;
 
 	return response;
 }
 
-Json::Value AlexaHub::processSetPercentage(std::shared_ptr<Light>& device, 
+Json::Value AlexaHub::processSetPercentage(const std::vector<std::shared_ptr<Light>>& devices,
 	double brightness) {
 	
-	device->getBuffer().setAll({255.f*brightness/100.f, 255.f*brightness/100.f,
-		255.f*brightness/100.f});
+	//Keep the stored hue and saturation, only the value changes
+	uint8_t percentage = std::min(100l, std::max(0l, std::lround(brightness)));
+
+	applyStates(devices, [percentage](LightState state) {
+		state.brightness = percentage;
+		state.on = percentage > 0;
+
+		return state;
+	});
 
 	Json::Value response;
 
@@ -202,8 +448,15 @@ Json::Value AlexaHub::processSetPercentage(std::shared_ptr<Light>& device,
 	return response;
 }
 
-Json::Value AlexaHub::processTurnOn(std::shared_ptr<Light>& device) {
-	device->getBuffer().setAll({255, 255, 255});
+Json::Value AlexaHub::processTurnOn(const std::vector<std::shared_ptr<Light>>& devices) {
+	applyStates(devices, [](LightState state) {
+		state.on = true;
+		if(state.brightness == 0) {
+			state.brightness = 100;
+		}
+
+		return state;
+	});
 
 	Json::Value response;
 
@@ -215,8 +468,12 @@ Json::Value AlexaHub::processTurnOn(std::shared_ptr<Light>& device) {
 	return response;
 }
 
-Json::Value AlexaHub::processTurnOff(std::shared_ptr<Light>& device) {
-	device->getBuffer().setAll({0, 0, 0});
+Json::Value AlexaHub::processTurnOff(const std::vector<std::shared_ptr<Light>>& devices) {
+	applyStates(devices, [](LightState state) {
+		state.on = false;
+
+		return state;
+	});
 
 	Json::Value response;
 
@@ -227,3 +484,57 @@ Json::Value AlexaHub::processTurnOff(std::shared_ptr<Light>& device) {
 
 	return response;
 }
+
+Json::Value AlexaHub::processReportState(std::shared_ptr<Light>& device,
+	const Json::Value& directive) {
+	
+	//Answered from the state cache, the light is never queried
+	auto state = device->getState();
+
+	char timeOfSample[32];
+	auto now = std::time(nullptr);
+	std::strftime(timeOfSample, sizeof(timeOfSample), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+	auto property = [&timeOfSample](const std::string& nspace, const std::string& name,
+		const Json::Value& value) {
+		Json::Value p;
+
+		p["namespace"] = nspace;
+		p["name"] = name;
+		p["value"] = value;
+		p["timeOfSample"] = timeOfSample;
+		p["uncertaintyInMilliseconds"] = 0;
+
+		return p;
+	};
+
+	Json::Value color;
+	color["hue"] = state.hue;
+	color["saturation"] = state.saturation/255.;
+	color["brightness"] = state.brightness/100.;
+
+	//Agrees with discovery's isReachable, from the hub's liveness tracking
+	Json::Value connectivity;
+	connectivity["value"] = device->isReachable() ? "OK" : "UNREACHABLE";
+
+	Json::Value properties{Json::arrayValue};
+	properties.append(property("Alexa.PowerController", "powerState", state.on ? "ON" : "OFF"));
+	properties.append(property("Alexa.BrightnessController", "brightness", state.brightness));
+	properties.append(property("Alexa.ColorController", "color", color));
+	properties.append(property("Alexa.EndpointHealth", "connectivity", connectivity));
+
+	Json::Value response;
+
+	response["event"]["header"]["messageId"] = "0000-0000-0000-0000";
+	response["event"]["header"]["namespace"] = "Alexa";
+	response["event"]["header"]["name"] = "StateReport";
+	response["event"]["header"]["payloadVersion"] = "3";
+	if(directive["header"].isMember("correlationToken")) {
+		response["event"]["header"]["correlationToken"] = directive["header"]["correlationToken"];
+	}
+	response["event"]["endpoint"] = directive["endpoint"];
+	response["event"]["payload"] = Json::objectValue;
+	response["context"]["properties"] = properties;
+
+	return response;
+}
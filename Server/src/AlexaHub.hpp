@@ -2,42 +2,109 @@
 
 #include <vector>
 #include <memory>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <functional>
 
 #include "LightHub.hpp"
 #include "Light.hpp"
 #include "CloudServer.hpp"
-#include "PeriodicTimer.hpp"
+#include "MetricsServer.hpp"
+#include "LoopMonitor.hpp"
+#include "Snapshot.hpp"
 
 #include "json/json.h"
 
 class AlexaHub {
 public:
+	struct Config {
+		uint16_t lightPort = 5492;
+		uint16_t serverPort = 9160;
+		size_t maxCloudConnections = CloudServer::DEFAULT_MAX_CONNECTIONS;
+
+		//Served on 127.0.0.1 only, 0 disables the endpoint
+		uint16_t metricsPort = 9161;
+
+		//Where NodeInfo requests are sent
+		boost::asio::ip::address discoveryAddress = boost::asio::ip::address_v4::broadcast();
+
+		//Threads encoding and sending frames, 0 starts one per core
+		size_t lightShards = 1;
+
+		//Topology snapshot for a warm start, empty disables it
+		std::string stateFile;
+	};
+
 	AlexaHub();
+	AlexaHub(const Config& config);
 	~AlexaHub();
 
 	void run();
 
+	//Handles one framed cloud message and returns the response, may be
+	//called from any thread
+	std::string processCloudMsg(const std::string& msg);
+
+	LightHub& getLightHub();
+
+	//Reads {"Group name": ["node:light", ...], ...}
+	void loadGroups(const std::string& path);
+
 private:
-	const uint16_t PORT = 5492;
-	const uint16_t SERVER_PORT = 9160;
+	const std::string GROUP_PREFIX = "group:";
+	const std::string ALL_LIGHTS_GROUP = "All Lights";
+
+	//A named set of lights discovered as one appliance
+	struct LightGroup {
+		std::string id, name;
+		std::vector<std::shared_ptr<Light>> lights;
+	};
 
 	std::vector<std::shared_ptr<Light>> getLights() const;
 	std::shared_ptr<Light> getLightById(const std::string& id) const;
 
-	std::string processCloudMsg(const std::string& msg);
+	//Configured groups, one per multi-light node and one for every light,
+	//built once per topology snapshot
+	struct GroupTable {
+		std::shared_ptr<const Topology> topology;
+
+		std::vector<LightGroup> groups;
+		std::unordered_map<std::string, size_t> indexById;
+	};
+
+	//Rebuilt by the first caller after the topology or the groups changed
+	std::shared_ptr<const GroupTable> getGroupTable() const;
+	std::shared_ptr<const GroupTable> buildGroupTable(std::shared_ptr<const Topology> topology) const;
 
-	Json::Value processSetColor(std::shared_ptr<Light>& device, const Color& c);
-	Json::Value processSetPercentage(std::shared_ptr<Light>& device, double brightness);
-	Json::Value processTurnOn(std::shared_ptr<Light>& device);
-	Json::Value processTurnOff(std::shared_ptr<Light>& device);
+	//Resolves a light or group appliance id to the lights it controls
+	std::vector<std::shared_ptr<Light>> getTargets(const std::string& id) const;
+
+	void applyStates(const std::vector<std::shared_ptr<Light>>& devices,
+		const std::function<LightState(LightState)>& transform);
+
+	Json::Value processSetColor(const std::vector<std::shared_ptr<Light>>& devices, double hue,
+		double saturation, double brightness);
+	Json::Value processSetPercentage(const std::vector<std::shared_ptr<Light>>& devices,
+		double brightness);
+	Json::Value processTurnOn(const std::vector<std::shared_ptr<Light>>& devices);
+	Json::Value processTurnOff(const std::vector<std::shared_ptr<Light>>& devices);
+	Json::Value processReportState(std::shared_ptr<Light>& device, const Json::Value& directive);
 
 	Json::Value processDiscover();
 
+	std::map<std::string, std::vector<std::string>> configuredGroups;
+
 	LightHub hub;
 
+	//Holds the hub's lights, so it has to be destroyed before the hub is
+	mutable Snapshot<GroupTable> groupTable{std::make_shared<const GroupTable>()};
+
 	boost::asio::io_service ioService;
 	std::unique_ptr<boost::asio::io_service::work> ioWork;
+	boost::asio::signal_set signals;
 	CloudServer server;
+	std::unique_ptr<MetricsServer> metricsServer;
 
-	PeriodicTimer updateTimer;
+	LoopMonitor loopMonitor;
 };
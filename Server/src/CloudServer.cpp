@@ -1,111 +1,267 @@
 #include "CloudServer.hpp"
 
 #include <algorithm>
-#include <iostream>
+#include <deque>
+
+#include "Log.hpp"
+#include "Probe.hpp"
+#include "Trace.hpp"
 
 using namespace boost::asio;
 
+static Trace::Stage frameStage{"cloud.frame"};
+static Trace::Stage handleStage{"cloud.handle"};
+static Trace::Stage respondStage{"cloud.respond"};
+
+//One connected client
+//Responses are written one at a time in order. Once MAX_PENDING_RESPONSES
+//are waiting, reading stops until the client has taken some of them, so a
+//client that does not read cannot make the hub buffer without bound.
+struct CloudServer::Session {
+	Session(io_service& ioService)
+		:	socket{ioService}
+		,	scanned{0}
+		,	open{true}
+		,	sending{false}
+		,	paused{false} {
+	}
+
+	struct Response {
+		std::string data;
+		uint64_t traceId;
+		uint64_t queued;
+	};
+
+	ip::tcp::socket socket;
+	ip::tcp::endpoint remote;
+
+	std::array<uint8_t, 512> readBuffer;
+	std::string msgBuffer;
+	size_t scanned;
+
+	std::deque<Response> sendQueue;
+	bool open, sending, paused;
+};
+
 CloudServer::CloudServer(io_service& _ioService, uint16_t _port,
-	const ReceiveHandler& _handler)
+	const ReceiveHandler& _handler, size_t _maxConnections)
 	:	ioService{_ioService}
 	,	endpoint{ip::tcp::v4(), _port}
-	, acceptor{ioService, endpoint}
-	,	socket{ioService}
-	,	handler{_handler} {
-	
+	,	acceptor{ioService, endpoint}
+	,	maxConnections{_maxConnections}
+	,	handler{_handler}
+	,	connections(Metrics::gauge("alexahub_cloud_connections", "Connected cloud clients"))
+	,	connectionsAccepted(Metrics::counter("alexahub_cloud_connections_total",
+			"Cloud connections accepted", "result=\"accepted\""))
+	,	connectionsRejected(Metrics::counter("alexahub_cloud_connections_total",
+			"Cloud connections accepted", "result=\"rejected\""))
+	,	readsPaused(Metrics::counter("alexahub_cloud_reads_paused_total",
+			"Times a cloud client had too many unsent responses and was not read from")) {
+
 	ioService.post([this]() {
 		startAccept();
 	});
 }
 
+size_t CloudServer::getConnectionCount() const {
+	return sessions.size();
+}
+
 void CloudServer::startAccept() {
-	std::cout << "[Info] CloudServer: Starting Accept" << std::endl;
+	LOG_DEBUG("CloudServer: Starting accept");
+
+	auto session = std::make_shared<Session>(ioService);
 
-	acceptor.async_accept(socket, clientEndpoint, [this](const boost::system::error_code& ec) {
+	acceptor.async_accept(session->socket, session->remote, [this, session](
+		const boost::system::error_code& ec) {
 		if(ec) {
-			std::cout << "[Error] CloudServer::handleAccept: " << ec.message() << std::endl;
-			startAccept();
+			if(ec == error::operation_aborted) {
+				return;
+			}
+
+			LOG_ERROR("CloudServer::handleAccept: " << ec.message());
+		}
+		else if(sessions.size() >= maxConnections) {
+			connectionsRejected.inc();
+
+			LOG_DEBUG("CloudServer: Rejecting client " << session->remote.address().to_string()
+				<< ", " << maxConnections << " already connected");
+
+			boost::system::error_code ignored;
+			session->socket.close(ignored);
 		}
 		else {
-			std::cout << "[Info] CoudServer: Client connected" << std::endl;
-			startListen();
+			connectionsAccepted.inc();
+
+			LOG_INFO("CloudServer: Client connected from " << session->remote.address().to_string());
+
+			boost::system::error_code ignored;
+			session->socket.set_option(ip::tcp::no_delay(true), ignored);
+
+			sessions.insert(session);
+			connections.set(sessions.size());
+
+			startListen(session);
 		}
+
+		startAccept();
 	});
 }
 
-void CloudServer::startListen() {
-	socket.async_receive(buffer(readBuffer), [this](const boost::system::error_code& ec,
-		size_t bytesTransferred) {
+void CloudServer::startListen(std::shared_ptr<Session> session) {
+	session->socket.async_receive(buffer(session->readBuffer), [this, session](
+		const boost::system::error_code& ec, size_t bytesTransferred) {
+
+		if(!session->open) {
+			return;
+		}
 
 		if(ec || bytesTransferred == 0) {
-			if(ec) {
-				std::cout << "[Error] CloudServer::cbReceive: " << ec.message() << std::endl;
+			if(ec && (ec != error::eof)) {
+				LOG_ERROR("CloudServer::cbReceive: " << ec.message());
+			}
+			LOG_INFO("CloudServer: Client disconnected");
+			if(!session->msgBuffer.empty()) {
+				LOG_DEBUG("CloudServer: Discarding partial message:\n" << session->msgBuffer);
+			}
+
+			close(session);
+			return;
+		}
+
+		auto received = Trace::now();
+
+		session->msgBuffer.append(session->readBuffer.begin(),
+			session->readBuffer.begin() + bytesTransferred);
+
+		std::string msg;
+		while(parseMessage(session->msgBuffer, msg, session->scanned)) {
+			//Every framed message starts a new trace
+			auto traceId = Trace::begin();
+			Trace::Scope traceScope{traceId};
+			Trace::record(frameStage, traceId, received, Trace::now());
+
+			std::string response;
+			{
+				Trace::Span span{handleStage};
+				response = handler(msg);
+			}
+			received = Trace::now();
+
+			if(response.empty()) {
+				LOG_INFO("CloudServer: Empty response, closing socket");
+
+				close(session);
+				return;
 			}
-			std::cout << "[Info] CloudServer: Client Disconnected" << std::endl;
-			std::cout << msgBuffer << std::endl;
 
-			socket.cancel();
-			socket.close();
-			msgBuffer.clear();
+			session->sendQueue.push_back({std::move(response), traceId, received});
+			startSend(session);
+		}
+
+		if(session->msgBuffer.size() > MAX_MESSAGE_SIZE) {
+			LOG_WARNING("CloudServer: Closing client " << session->remote.address().to_string()
+				<< ", its message exceeds " << MAX_MESSAGE_SIZE << " bytes");
 
-			startAccept();
+			close(session);
+			return;
+		}
+
+		if(session->sendQueue.size() >= MAX_PENDING_RESPONSES) {
+			readsPaused.inc();
+			session->paused = true;
 		}
 		else {
-			msgBuffer.insert(msgBuffer.end(), readBuffer.begin(), readBuffer.begin() + bytesTransferred);
-
-			std::string msg;
-			while(parseMessage(msgBuffer, msg)) {
-				auto response = new std::string{handler(msg)};
-				
-				if(response->length() > 0) {
-					socket.async_send(buffer(*response), [response](const boost::system::error_code& ec,
-						std::size_t bytesTransferred) {
-						if(ec) {
-							std::cout << "[Error] CloudServer::cbSendResponse: " << ec.message() << std::endl;
-						}
-						else if(bytesTransferred != response->size()) {
-							std::cout << "[Error] CloudServer::cbSendResponse: Tried to send " << response->size()
-								<< " bytes, actually sent " << bytesTransferred << std::endl;
-						}
-						else {
-							std::cout << "[Info] CloudServer::cbSendResponse: Response sent" << std::endl;
-						}
-
-						delete response;
-					});
-				}
-				else {
-					delete response;
-
-					std::cout << "[Info] CloudServer: Empty response, closing socket" << std::endl;
-
-					socket.cancel();
-					socket.close();
-					msgBuffer.clear();
-
-					startAccept();
-
-					return;
-				}
-			}
+			startListen(session);
+		}
+	});
+}
+
+void CloudServer::startSend(std::shared_ptr<Session> session) {
+	if(session->sending || session->sendQueue.empty()) {
+		return;
+	}
+
+	session->sending = true;
+
+	const auto& response = session->sendQueue.front();
+
+	async_write(session->socket, buffer(response.data), [this, session](
+		const boost::system::error_code& ec, std::size_t bytesTransferred) {
+		session->sending = false;
+
+		if(!session->open) {
+			return;
+		}
+
+		const auto& response = session->sendQueue.front();
+		Trace::record(respondStage, response.traceId, response.queued, Trace::now());
+
+		if(ec) {
+			LOG_ERROR("CloudServer::cbSendResponse: " << ec.message());
 
-			startListen();
+			close(session);
+			return;
 		}
+		else if(bytesTransferred != response.data.size()) {
+			LOG_ERROR("CloudServer::cbSendResponse: Tried to send " << response.data.size()
+				<< " bytes, actually sent " << bytesTransferred);
+		}
+		else {
+			LOG_DEBUG("CloudServer::cbSendResponse: Response sent");
+		}
+
+		session->sendQueue.pop_front();
+
+		if(session->paused && (session->sendQueue.size() < MAX_PENDING_RESPONSES/2)) {
+			session->paused = false;
+			startListen(session);
+		}
+
+		startSend(session);
 	});
 }
 
+void CloudServer::close(std::shared_ptr<Session> session) {
+	if(!session->open) {
+		return;
+	}
+
+	session->open = false;
+
+	boost::system::error_code ignored;
+	session->socket.cancel(ignored);
+	session->socket.close(ignored);
+
+	sessions.erase(session);
+	connections.set(sessions.size());
+}
+
 bool CloudServer::parseMessage(std::string& buffer, std::string& msg) {
+	size_t scanned = 0;
+
+	return parseMessage(buffer, msg, scanned);
+}
+
+bool CloudServer::parseMessage(std::string& buffer, std::string& msg, size_t& scanned) {
+	PROBE("CloudServer::parseMessage");
+
 	const std::string endToken{"\r\n\r\n"};
 
-	auto itr = std::search(buffer.begin(), buffer.end(),
+	//The token may have started in the last bytes already searched
+	auto from = std::min(buffer.size(), scanned - std::min(scanned, endToken.length() - 1));
+
+	auto itr = std::search(buffer.begin() + from, buffer.end(),
 		endToken.begin(), endToken.end());
 
 	if(itr == buffer.end()) {
+		scanned = buffer.size();
 		return false;
 	}
 	else {
 		msg = std::string(buffer.begin(), itr);
 		buffer.erase(buffer.begin(), itr + endToken.length());
+		scanned = 0;
 
 		return true;
 	}
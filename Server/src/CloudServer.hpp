@@ -3,29 +3,59 @@
 #include <string>
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <set>
 
 #include <boost/asio.hpp>
 
+#include "Metrics.hpp"
+
 class CloudServer {
 public:
 	using ReceiveHandler = std::function<std::string(const std::string& msg)>;
 
-	CloudServer(boost::asio::io_service& ioService, uint16_t port, const ReceiveHandler& handler);
+	static const size_t DEFAULT_MAX_CONNECTIONS = 1024;
 
-private:
-	void startAccept();
-	void startListen();
+	//Serves up to maxConnections clients at once, further ones are closed
+	//as soon as they are accepted
+	CloudServer(boost::asio::io_service& ioService, uint16_t port, const ReceiveHandler& handler,
+		size_t maxConnections = DEFAULT_MAX_CONNECTIONS);
+
+	size_t getConnectionCount() const;
 
+	//Moves the first \r\n\r\n terminated message out of buffer
 	static bool parseMessage(std::string& buffer, std::string& msg);
 
+	//The same, resuming the search where the last one left off. scanned is
+	//how much of buffer was already searched, 0 for a new buffer.
+	static bool parseMessage(std::string& buffer, std::string& msg, size_t& scanned);
+
+private:
+	//Responses a client may have waiting before its reads are paused
+	static const size_t MAX_PENDING_RESPONSES = 64;
+
+	//A client whose message grows beyond this without ending is closed
+	static const size_t MAX_MESSAGE_SIZE = 64*1024;
+
+	struct Session;
+
+	void startAccept();
+	void startListen(std::shared_ptr<Session> session);
+	void startSend(std::shared_ptr<Session> session);
+	void close(std::shared_ptr<Session> session);
+
 	boost::asio::io_service& ioService;
-	
-	boost::asio::ip::tcp::endpoint endpoint, clientEndpoint;
+
+	boost::asio::ip::tcp::endpoint endpoint;
 	boost::asio::ip::tcp::acceptor acceptor;
-	boost::asio::ip::tcp::socket socket;
-	std::array<uint8_t, 512> readBuffer;
-	
-	std::string msgBuffer;
+
+	std::set<std::shared_ptr<Session>> sessions;
+	size_t maxConnections;
 
 	ReceiveHandler handler;
+
+	Metrics::Gauge& connections;
+	Metrics::Counter& connectionsAccepted;
+	Metrics::Counter& connectionsRejected;
+	Metrics::Counter& readsPaused;
 };
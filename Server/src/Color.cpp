@@ -3,6 +3,8 @@
 #include <cmath>
 #include <algorithm>
 
+#include "Probe.hpp"
+
 Color::Color() {
 	r = g = b = 0;
 }
@@ -123,6 +125,8 @@ uint8_t Color::getVal() const {
 }
 
 Color Color::HSV(uint8_t h, uint8_t s, uint8_t v) {
+	PROBE("Color::HSV");
+
 	float chroma, hprime, x, m, r, g, b;
 	
 	float hue = 360.f*h/255.f, saturation = s/255.f, value = v/255.f;
@@ -0,0 +1,90 @@
+#include "DatagramPool.hpp"
+
+DatagramPool::Datagram::Datagram()
+	:	traceId{0}
+	,	queued{0}
+	,	next{nullptr}
+	,	nextFree{NONE}
+	,	pooled{false}
+	,	length{0} {
+}
+
+uint8_t* DatagramPool::Datagram::data() {
+	return (length > CAPACITY) ? overflow.data() : bytes.data();
+}
+
+const uint8_t* DatagramPool::Datagram::data() const {
+	return (length > CAPACITY) ? overflow.data() : bytes.data();
+}
+
+size_t DatagramPool::Datagram::size() const {
+	return length;
+}
+
+uint8_t* DatagramPool::Datagram::resize(size_t size) {
+	length = size;
+
+	if(size > CAPACITY) {
+		static auto& oversize = Metrics::counter("alexahub_udp_pool_oversize_total",
+			"Datagrams too large for a pooled buffer");
+		oversize.inc();
+
+		//Keeps its capacity across reuse, so a large light allocates only once
+		overflow.resize(size);
+	}
+
+	return data();
+}
+
+DatagramPool::DatagramPool(size_t _capacity)
+	:	capacity{_capacity}
+	,	datagrams{new Datagram[_capacity]}
+	,	freeHead{pack(0, NONE)}
+	,	exhausted(Metrics::counter("alexahub_udp_pool_exhausted_total",
+			"Datagram buffers allocated because the pool was empty")) {
+
+	for(size_t i = 0; i < capacity; ++i) {
+		datagrams[i].pooled = true;
+		release(&datagrams[i]);
+	}
+}
+
+DatagramPool::Datagram* DatagramPool::acquire() {
+	auto head = freeHead.load(std::memory_order_acquire);
+
+	while(static_cast<uint32_t>(head) != NONE) {
+		auto& datagram = datagrams[static_cast<uint32_t>(head)];
+		auto next = pack((head >> 32) + 1, datagram.nextFree.load(std::memory_order_relaxed));
+
+		if(freeHead.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+			return &datagram;
+		}
+	}
+
+	exhausted.inc();
+
+	return new Datagram;
+}
+
+void DatagramPool::release(Datagram* datagram) {
+	if(!datagram->pooled) {
+		delete datagram;
+		return;
+	}
+
+	uint32_t index = datagram - datagrams.get();
+	auto head = freeHead.load(std::memory_order_relaxed);
+
+	do {
+		datagram->nextFree.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+	} while(!freeHead.compare_exchange_weak(head, pack((head >> 32) + 1, index),
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+size_t DatagramPool::getCapacity() const {
+	return capacity;
+}
+
+uint64_t DatagramPool::pack(uint32_t tag, uint32_t index) {
+	return (static_cast<uint64_t>(tag) << 32) | index;
+}
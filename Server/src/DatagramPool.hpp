@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "Metrics.hpp"
+
+//Fixed set of preallocated datagram buffers shared by every thread
+//acquire() and release() are lock-free: free buffers form a stack of
+//indices whose head carries a generation tag, so a buffer recycled while
+//another thread was popping cannot corrupt the stack. Only if every
+//buffer is in use does acquire() fall back to the heap.
+class DatagramPool {
+public:
+	struct Datagram {
+		//Fits an Ethernet frame, larger payloads spill to the heap
+		static const size_t CAPACITY = 1472;
+
+		Datagram();
+
+		uint8_t* data();
+		const uint8_t* data() const;
+		size_t size() const;
+
+		//Returns room for size bytes, only allocates beyond CAPACITY
+		uint8_t* resize(size_t size);
+
+		boost::asio::ip::udp::endpoint endpoint;
+		uint64_t traceId;
+		uint64_t queued;
+
+		//Links for MpscQueue and the pool's free stack
+		std::atomic<Datagram*> next;
+		std::atomic<uint32_t> nextFree;
+		bool pooled;
+
+	private:
+		size_t length;
+		std::array<uint8_t, CAPACITY> bytes;
+		std::vector<uint8_t> overflow;
+	};
+
+	DatagramPool(size_t capacity);
+
+	DatagramPool(const DatagramPool&) = delete;
+	DatagramPool& operator=(const DatagramPool&) = delete;
+
+	//Never returns nullptr
+	Datagram* acquire();
+	void release(Datagram* datagram);
+
+	size_t getCapacity() const;
+
+private:
+	static const uint32_t NONE = UINT32_MAX;
+
+	static uint64_t pack(uint32_t tag, uint32_t index);
+
+	size_t capacity;
+	std::unique_ptr<Datagram[]> datagrams;
+
+	//Generation tag in the high half, index of the top free buffer in the low
+	std::atomic<uint64_t> freeHead;
+
+	Metrics::Counter& exhausted;
+};
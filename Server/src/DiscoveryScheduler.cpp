@@ -0,0 +1,128 @@
+#include "DiscoveryScheduler.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "Log.hpp"
+
+using namespace std::chrono;
+
+DiscoveryScheduler::DiscoveryScheduler(boost::asio::io_service& ioService, const Config& _config,
+	const RoundHandler& _handler)
+	:	config(_config)
+	,	handler{_handler}
+	,	timer{ioService}
+	,	random{std::random_device{}()}
+	,	period{config.burstPeriod}
+	,	burstLeft{0}
+	,	budget(config.bytesPerSecond)
+	,	refilled{steady_clock::now()}
+	,	bytesSent(Metrics::counter("alexahub_discovery_bytes_total",
+			"Discovery traffic including IP and UDP headers", "direction=\"sent\""))
+	,	bytesReceived(Metrics::counter("alexahub_discovery_bytes_total",
+			"Discovery traffic including IP and UDP headers", "direction=\"received\""))
+	,	deferred(Metrics::counter("alexahub_discovery_deferred_total",
+			"Discovery rounds postponed because the bandwidth budget was spent"))
+	,	periodGauge(Metrics::gauge("alexahub_discovery_period_ms",
+			"Current interval between discovery rounds")) {
+
+	if(!handler) {
+		throw std::runtime_error("DiscoveryScheduler: Invalid handler");
+	}
+}
+
+DiscoveryScheduler::~DiscoveryScheduler() {
+	timer.cancel();
+}
+
+void DiscoveryScheduler::start() {
+	burstLeft = config.burstRounds;
+
+	round();
+}
+
+void DiscoveryScheduler::topologyChanged() {
+	burstLeft = config.burstRounds;
+
+	//Bring a distant round forward, a burst already under way keeps its pace
+	if(timer.expires_from_now() > config.burstPeriod) {
+		period = config.burstPeriod;
+		periodGauge.set(period.count());
+
+		schedule(jittered(period));
+	}
+}
+
+void DiscoveryScheduler::charge(size_t payloadBytes, Direction direction) {
+	auto bytes = payloadBytes + HEADER_BYTES;
+
+	(direction == Direction::Sent ? bytesSent : bytesReceived).inc(bytes);
+
+	refill();
+	budget -= bytes;
+}
+
+milliseconds DiscoveryScheduler::getPeriod() const {
+	return period;
+}
+
+void DiscoveryScheduler::round() {
+	handler();
+
+	if(burstLeft > 0) {
+		--burstLeft;
+		period = config.burstPeriod;
+	}
+	else if(period < config.minPeriod) {
+		period = config.minPeriod;
+	}
+	else {
+		period = std::min(period*2, config.maxPeriod);
+	}
+
+	periodGauge.set(period.count());
+
+	schedule(jittered(period));
+}
+
+void DiscoveryScheduler::schedule(milliseconds delay) {
+	timer.expires_from_now(delay);
+	timer.async_wait([this](const boost::system::error_code& error) {
+		cbTimer(error);
+	});
+}
+
+void DiscoveryScheduler::cbTimer(const boost::system::error_code& error) {
+	if(error == boost::asio::error::operation_aborted) {
+		return;
+	}
+	else if(error) {
+		LOG_ERROR("DiscoveryScheduler::cbTimer: " << error.message());
+	}
+
+	refill();
+
+	if(budget < 0) {
+		deferred.inc();
+
+		schedule(milliseconds(static_cast<int64_t>(-budget*1000/config.bytesPerSecond) + 1));
+		return;
+	}
+
+	round();
+}
+
+void DiscoveryScheduler::refill() {
+	auto now = steady_clock::now();
+
+	budget = std::min<double>(budget
+		+ config.bytesPerSecond*duration_cast<duration<double>>(now - refilled).count(),
+		config.bytesPerSecond);
+	refilled = now;
+}
+
+milliseconds DiscoveryScheduler::jittered(milliseconds delay) {
+	std::uniform_real_distribution<double> factor(1. - config.jitter, 1. + config.jitter);
+
+	return milliseconds(static_cast<int64_t>(delay.count()*factor(random)));
+}
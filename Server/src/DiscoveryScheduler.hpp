@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <random>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "Metrics.hpp"
+
+//Decides when LightHub runs a discovery round
+//Rounds come in a quick burst at startup and after every topology change,
+//then the period doubles after each quiet round up to maxPeriod. Every
+//delay is jittered so nodes do not answer in lockstep. Discovery traffic
+//in both directions is charged to a byte budget, and a round that falls
+//due while the budget is overdrawn waits until it has been paid back, so
+//the average discovery bandwidth never exceeds bytesPerSecond.
+class DiscoveryScheduler {
+public:
+	using RoundHandler = std::function<void(void)>;
+
+	enum class Direction {
+		Sent,
+		Received
+	};
+
+	struct Config {
+		//Rounds this far apart at startup and after a topology change
+		std::chrono::milliseconds burstPeriod{250};
+		size_t burstRounds = 4;
+
+		//The period after a burst, doubled every quiet round up to maxPeriod
+		std::chrono::milliseconds minPeriod{1000};
+		std::chrono::milliseconds maxPeriod{30000};
+
+		//Each delay is scaled by a random factor in [1 - jitter, 1 + jitter]
+		double jitter = 0.2;
+
+		//Average discovery traffic including IP and UDP headers, the budget
+		//holds at most one second's worth
+		size_t bytesPerSecond = 64*1024;
+	};
+
+	DiscoveryScheduler(boost::asio::io_service& ioService, const Config& config,
+		const RoundHandler& handler);
+	~DiscoveryScheduler();
+
+	//Runs the first round of the startup burst immediately
+	void start();
+
+	//Starts a new burst, e.g. a node or light appeared
+	void topologyChanged();
+
+	//Accounts one discovery datagram against the budget
+	void charge(size_t payloadBytes, Direction direction);
+
+	std::chrono::milliseconds getPeriod() const;
+
+private:
+	static const size_t HEADER_BYTES = 28;
+
+	void round();
+	void schedule(std::chrono::milliseconds delay);
+	void cbTimer(const boost::system::error_code& error);
+
+	//Adds what the budget earned since the last refill
+	void refill();
+
+	std::chrono::milliseconds jittered(std::chrono::milliseconds delay);
+
+	Config config;
+	RoundHandler handler;
+
+	boost::asio::steady_timer timer;
+	std::mt19937 random;
+
+	std::chrono::milliseconds period;
+	size_t burstLeft;
+
+	//Bytes that may still be spent, negative while overdrawn
+	double budget;
+	std::chrono::steady_clock::time_point refilled;
+
+	Metrics::Counter& bytesSent;
+	Metrics::Counter& bytesReceived;
+	Metrics::Counter& deferred;
+	Metrics::Gauge& periodGauge;
+};
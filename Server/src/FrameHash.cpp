@@ -0,0 +1,61 @@
+#include "FrameHash.hpp"
+
+#include <cstring>
+
+namespace {
+
+const uint32_t PRIME32_1 = 0x9E3779B1u;
+const uint32_t PRIME32_2 = 0x85EBCA77u;
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+
+const size_t LANES = 8;
+const size_t BLOCK_SIZE = LANES * sizeof(uint32_t);
+
+inline uint32_t rotl32(uint32_t x, int r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+} //namespace
+
+uint64_t FrameHash::compute(const uint8_t* data, size_t size) {
+	uint32_t lanes[LANES];
+	for(size_t i = 0; i < LANES; ++i) {
+		lanes[i] = PRIME32_1 + static_cast<uint32_t>(i) * PRIME32_2;
+	}
+
+	size_t blocks = size / BLOCK_SIZE;
+	for(size_t block = 0; block < blocks; ++block) {
+		uint32_t input[LANES];
+		memcpy(input, data + block*BLOCK_SIZE, BLOCK_SIZE);
+
+		for(size_t i = 0; i < LANES; ++i) {
+			lanes[i] = rotl32(lanes[i] + input[i]*PRIME32_2, 13) * PRIME32_1;
+		}
+	}
+
+	uint64_t hash = size * PRIME64_2;
+	for(size_t i = 0; i < LANES; ++i) {
+		hash = (hash ^ lanes[i]) * PRIME64_1;
+		hash ^= hash >> 29;
+	}
+
+	for(size_t i = blocks*BLOCK_SIZE; i < size; ++i) {
+		hash = (hash ^ data[i]) * PRIME64_1;
+	}
+
+	//Final avalanche (MurmurHash3 fmix64)
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+uint64_t FrameHash::compute(const std::vector<Color>& pixels) {
+	static_assert(sizeof(Color) == 3, "Color must be tightly packed RGB");
+
+	return compute(reinterpret_cast<const uint8_t*>(pixels.data()), pixels.size()*sizeof(Color));
+}
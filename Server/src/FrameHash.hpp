@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "Color.hpp"
+
+//Non-cryptographic 64 bit hash used to detect unchanged frames
+//The input is consumed in 32 byte blocks by 8 independent 32 bit lanes
+//(xxHash32 rounds) so the main loop maps directly onto SIMD multiplies.
+class FrameHash {
+public:
+	static uint64_t compute(const uint8_t* data, size_t size);
+	static uint64_t compute(const std::vector<Color>& pixels);
+};
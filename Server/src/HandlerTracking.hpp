@@ -0,0 +1,29 @@
+#pragma once
+
+//Boost.Asio handler tracking hooks, included by asio itself through
+//-D BOOST_ASIO_CUSTOM_HANDLER_TRACKING (see the Makefile)
+//Only the start and end of each handler invocation are used, so that
+//LoopMonitor can time handlers without the loop's idle waits. Every other
+//hook expands to nothing.
+namespace HandlerTracking {
+	//Defined in LoopMonitor.cpp, nested invocations are timed as one
+	void begin();
+	void end();
+}
+
+#define BOOST_ASIO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_ALSO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_HANDLER_TRACKING_INIT (void)0
+#define BOOST_ASIO_HANDLER_LOCATION(location) (void)0
+#define BOOST_ASIO_HANDLER_CREATION(args) (void)0
+#define BOOST_ASIO_HANDLER_COMPLETION(args) (void)0
+#define BOOST_ASIO_HANDLER_INVOCATION_BEGIN(args) ::HandlerTracking::begin()
+#define BOOST_ASIO_HANDLER_INVOCATION_END ::HandlerTracking::end()
+#define BOOST_ASIO_HANDLER_OPERATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_REGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_DEREGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_READ_EVENT 1
+#define BOOST_ASIO_HANDLER_REACTOR_WRITE_EVENT 2
+#define BOOST_ASIO_HANDLER_REACTOR_ERROR_EVENT 4
+#define BOOST_ASIO_HANDLER_REACTOR_EVENTS(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_OPERATION(args) (void)0
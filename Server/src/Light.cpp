@@ -4,6 +4,39 @@
 
 using namespace std;
 
+LightState::LightState()
+	:	on{false}
+	,	hue{0}
+	,	saturation{0}
+	,	brightness{100} {
+}
+
+LightState::LightState(bool _on, uint16_t _hue, uint8_t _saturation, uint8_t _brightness)
+	:	on{_on}
+	,	hue{static_cast<uint16_t>(_hue % 360)}
+	,	saturation{_saturation}
+	,	brightness{min<uint8_t>(_brightness, 100)} {
+}
+
+Color LightState::toColor() const {
+	if(!on) {
+		return {0, 0, 0};
+	}
+
+	return Color::HSV(hue*255/360, saturation, brightness*255/100);
+}
+
+uint32_t LightState::pack() const {
+	//Masked so an out of range field cannot spill into its neighbours
+	return (static_cast<uint32_t>(on) << 24) | ((static_cast<uint32_t>(brightness) & 0x7F) << 17)
+		| ((static_cast<uint32_t>(saturation) & 0xFF) << 9) | (hue & 0x1FF);
+}
+
+LightState LightState::unpack(uint32_t packed) {
+	return {static_cast<bool>((packed >> 24) & 0x01), static_cast<uint16_t>(packed & 0x1FF),
+		static_cast<uint8_t>((packed >> 9) & 0xFF), static_cast<uint8_t>((packed >> 17) & 0x7F)};
+}
+
 LightBuffer::LightBuffer(Light& _light)
 	:	light{_light} {
 	
@@ -11,8 +44,10 @@ LightBuffer::LightBuffer(Light& _light)
 }
 
 LightBuffer::~LightBuffer() {
-	lock_guard<mutex> pixelLock(light.pixelMutex);
-	light.pixels = light.pixelBuffer;
+	{
+		lock_guard<mutex> pixelLock(light.pixelMutex);
+		light.pixels = light.pixelBuffer;
+	}
 
 	light.bufferMutex.unlock();
 
@@ -50,12 +85,16 @@ void LightBuffer::setAll(const Color& c) {
 Light::Light(LightHub& _hub, LightNode& _node, const boost::asio::ip::address& _address,
 	uint8_t _lightID, const string& _name, int _size)
 	:	hub{_hub}
-	,	node{_node}
+	,	link{_node.link}
 	,	address{_address}
 	,	lightID{_lightID}
 	,	name{_name}
+	,	fullName{_node.name + ":" + _name}
 	,	pixels{_size}
-	,	pixelBuffer{_size} {
+	,	pixelBuffer{_size}
+	,	state{LightState{}.pack()}
+	,	reachable{true}
+	,	sentHash{0} {
 }
 
 boost::asio::ip::address Light::getAddress() const {
@@ -71,13 +110,46 @@ string Light::getName() const {
 }
 
 string Light::getFullName() const {
-	return node.name + ":" + name;
+	return fullName;
 }
 
 const vector<Color>& Light::getPixels() const {
 	return pixels;
 }
 
+LightState Light::getState() const {
+	return LightState::unpack(state.load(memory_order_relaxed));
+}
+
+void Light::setState(const LightState& newState) {
+	state.store(newState.pack(), memory_order_relaxed);
+
+	hub.stateDirty.store(true, memory_order_relaxed);
+}
+
+void Light::setState(const LightState& newState, const Color& color) {
+	lock_guard<mutex> bufferLock(bufferMutex);
+
+	setState(newState);
+	fill(color);
+}
+
+LightState Light::updateState(const function<LightState(LightState)>& transform) {
+	//Commands only change the state under bufferMutex, so this cannot race them
+	lock_guard<mutex> bufferLock(bufferMutex);
+
+	auto newState = transform(getState());
+
+	setState(newState);
+	fill(newState.toColor());
+
+	return newState;
+}
+
+bool Light::isReachable() const {
+	return reachable.load(memory_order_relaxed);
+}
+
 size_t Light::getSize() const {
 	return pixels.size();
 }
@@ -86,6 +158,21 @@ void Light::update() {
 	hub.update(*this);
 }
 
+void Light::setAll(const Color& c) {
+	lock_guard<mutex> bufferLock(bufferMutex);
+
+	fill(c);
+}
+
+void Light::fill(const Color& c) {
+	for(auto& pixel : pixelBuffer) {
+		pixel = c;
+	}
+
+	lock_guard<mutex> pixelLock(pixelMutex);
+	pixels = pixelBuffer;
+}
+
 LightBuffer Light::getBuffer() {
 	return {*this};
 }
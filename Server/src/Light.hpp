@@ -3,9 +3,12 @@
 #include <vector>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <memory>
 #include <iostream>
 #include <cstdint>
+#include <chrono>
+#include <functional>
 
 #include <boost/asio.hpp>
 
@@ -13,8 +16,27 @@
 
 class LightHub;
 class LightBuffer;
+class NodeLink;
 struct LightNode;
 
+//Logical state of a light as last commanded through the hub
+struct LightState {
+	LightState();
+	LightState(bool on, uint16_t hue, uint8_t saturation, uint8_t brightness);
+
+	//Black when off, otherwise the HSV color scaled by brightness
+	Color toColor() const;
+
+	//Packed into 25 bits so the state can be swapped atomically
+	uint32_t pack() const;
+	static LightState unpack(uint32_t);
+
+	bool on;
+	uint16_t hue;					//Degrees, 0-359
+	uint8_t saturation;		//0-255
+	uint8_t brightness;		//Percent, 0-100
+};
+
 class Light
 {
 public:
@@ -31,23 +53,52 @@ public:
 	size_t getSize() const;
 	const std::vector<Color>& getPixels() const;
 
+	LightState getState() const;
+	void setState(const LightState&);
+
+	//Sets the state and every pixel to color in one step, without transmitting
+	void setState(const LightState&, const Color& color);
+
+	//Replaces the state with transform(state) and every pixel with its color
+	//in one step, so concurrent commands neither lose updates nor leave the
+	//pixels disagreeing with the state. Does not transmit.
+	LightState updateState(const std::function<LightState(LightState)>& transform);
+
+	//False while the light's node does not answer
+	bool isReachable() const;
+
 	LightBuffer getBuffer();
 
+	//Sets every pixel without transmitting, follow with LightHub::update()
+	//to send several lights in one batch
+	void setAll(const Color& c);
+
 private:
 	friend class LightBuffer;
+	friend class LightHub;
 
 	void update();
 
+	//Sets every pixel, bufferMutex must be held
+	void fill(const Color& c);
+
 	LightHub& hub;
-	LightNode& node;
+	std::shared_ptr<NodeLink> link;
 
 	boost::asio::ip::address address;
 	uint8_t lightID;
 
-	std::string name;
+	std::string name, fullName;
 
 	std::vector<Color> pixels, pixelBuffer;
 	mutable std::mutex pixelMutex, bufferMutex;
+
+	std::atomic<uint32_t> state;
+	std::atomic<bool> reachable;
+
+	//Last frame actually transmitted, guarded by pixelMutex
+	uint64_t sentHash;
+	std::chrono::steady_clock::time_point sentTime;
 };
 
 class LightBuffer
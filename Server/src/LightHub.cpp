@@ -1,10 +1,17 @@
 #include "LightHub.hpp"
 
 #include "Packet.hpp"
+#include "FrameHash.hpp"
+#include "Probe.hpp"
+#include "Trace.hpp"
 
 using namespace std;
 using namespace boost::asio;
 
+static Trace::Stage encodeStage{"hub.encode"};
+static Trace::Stage queueStage{"hub.queue"};
+static Trace::Stage sendStage{"udp.send"};
+
 std::string toString(const std::vector<uint8_t>& data) {
 	std::string str("{");
 
@@ -20,172 +27,1051 @@ std::string toString(const std::vector<uint8_t>& data) {
 }
 
 LightNode::LightNode(const string& _name)
-	:	name{_name} {
+	:	name{_name}
+	,	reachable{true}
+	,	resync{false}
+	,	bootKnown{false}
+	,	bootID{0} {
+}
+
+LightHub::NodeQuery::NodeQuery(LightHub& hub, const ip::address& address)
+	:	hash{0}
+	,	known{false}
+	,	pendingHash{0}
+	,	pendingHashed{false}
+	,	retries{0}
+	,	timeout(hub.ioService, hub.LIGHT_INFO_TIMEOUT, [&hub, address]() {
+			hub.handleLightInfoTimeout(address);
+		})
+	,	complete{false}
+	,	firstQueried{std::chrono::steady_clock::now()} {
 }
 
-LightHub::LightHub(uint16_t _port, uint32_t _discoveryPeriod)
+LightHub::Shard::Shard(LightHub& hub, size_t index)
 	:	ioWork{make_unique<io_service::work>(ioService)}
+	,	loopMonitor{ioService, "light-shard" + to_string(index)}
+	,	socket(ioService, ip::udp::v4())
+	,	transmitter(socket, [&hub, this](const UdpTransmitter::Datagram& datagram,
+			const boost::system::error_code& ec) {
+			hub.handleSent(nodeCounters, datagram, ec);
+		}, hub.pool)
+	,	thread([this]() { loopMonitor.run(); }) {
+}
+
+void LightHub::Shard::stop() {
+	ioWork.reset();
+	ioService.stop();
+
+	thread.join();
+}
+
+static DiscoveryScheduler::Config discoveryConfig(uint32_t period) {
+	DiscoveryScheduler::Config config;
+	config.minPeriod = std::chrono::milliseconds(period);
+
+	return config;
+}
+
+LightHub::LightHub(uint16_t _port, uint32_t _discoveryPeriod,
+	const ip::address& _discoveryAddress, size_t shardCount)
+	:	pool{DATAGRAM_POOL_SIZE}
+	,	topology{make_shared<Topology>()}
+	,	ioWork{make_unique<io_service::work>(ioService)}
+	,	loopMonitor{ioService, "light"}
 	,	socket(ioService, ip::udp::v4())
 	,	port{_port}
-	,	discoveryTimer(ioService, std::chrono::milliseconds(_discoveryPeriod),
-		[this](){ discover(); })	{
+	,	discoveryAddress{_discoveryAddress}
+	,	receiver(socket, [this](const ip::udp::endpoint& from, const uint8_t* data, size_t size) {
+			handleReceive(from, data, size);
+		}, [this](const boost::system::error_code& ec) {
+			handleReceiveError(ec);
+		})
+	,	transmitter(socket, [this](const UdpTransmitter::Datagram& datagram,
+			const boost::system::error_code& ec) {
+			handleSent(nodeCounters, datagram, ec);
+		}, pool)
+	,	framesSent(Metrics::counter("alexahub_frames_sent_total",
+			"Light frames encoded and queued for transmission"))
+	,	framesSkipped(Metrics::counter("alexahub_frames_skipped_total",
+			"Light frames suppressed because they were unchanged"))
+	,	discoveryRounds(Metrics::counter("alexahub_discovery_rounds_total",
+			"NodeInfo broadcasts sent"))
+	,	sendErrors(Metrics::counter("alexahub_udp_send_errors_total",
+			"UDP datagrams that failed to send"))
+	,	parseFailures(Metrics::counter("alexahub_parse_failures_total",
+			"Messages that could not be parsed", "source=\"udp\""))
+	,	lightQueries(Metrics::counter("alexahub_discovery_light_queries_total",
+			"LightInfo requests sent", "result=\"sent\""))
+	,	lightQueriesSkipped(Metrics::counter("alexahub_discovery_light_queries_total",
+			"LightInfo requests sent", "result=\"skipped\""))
+	,	lightQueriesRetried(Metrics::counter("alexahub_discovery_light_queries_total",
+			"LightInfo requests sent", "result=\"retried\""))
+	,	lightQueryTimeouts(Metrics::counter("alexahub_discovery_light_query_timeouts_total",
+			"Nodes that left LightInfo requests unanswered after every retry"))
+	,	nodeCompleteTime(Metrics::histogram("alexahub_discovery_node_complete_seconds",
+			"Time from a node's first LightInfo request until all its lights had answered"))
+	,	fullTopologyTime(Metrics::gauge("alexahub_discovery_time_to_full_topology_ms",
+			"Time from a node first answering until every known node's lights had, last episode"))
+	,	livenessProbes(Metrics::counter("alexahub_liveness_probes_total",
+			"Unicast NodeInfo sent to nodes that stopped answering"))
+	,	evictions(Metrics::counter("alexahub_node_evictions_total",
+			"Nodes removed from the topology after being unreachable too long"))
+	,	framesReplayed(Metrics::counter("alexahub_frames_replayed_total",
+			"Frames re-sent to lights whose node restarted or became reachable again"))
+	,	framesRefreshed(Metrics::counter("alexahub_frames_refreshed_total",
+			"Unchanged frames re-sent because nothing was sent to the light for a while"))
+	,	reachableNodes(Metrics::gauge("alexahub_nodes", "Nodes in the topology or retired",
+			"state=\"reachable\""))
+	,	unreachableNodes(Metrics::gauge("alexahub_nodes", "Nodes in the topology or retired",
+			"state=\"unreachable\""))
+	,	retiredNodeCount(Metrics::gauge("alexahub_nodes", "Nodes in the topology or retired",
+			"state=\"retired\""))
+	,	stateSaveTime(Metrics::histogram("alexahub_state_save_seconds",
+			"Time taken to write the topology snapshot"))
+	,	stateSaveErrors(Metrics::counter("alexahub_state_save_errors_total",
+			"Topology snapshots that could not be written"))
+	,	incompleteNodes{0}
+	,	liveness{LIVENESS_SLOTS, LIVENESS_TICK}
+	,	discovery(ioService, discoveryConfig(_discoveryPeriod), [this](){ discover(); })
+	,	queueTimer(ioService, QUEUE_SAMPLE_PERIOD, [this](){ sampleQueues(); })
+	,	livenessTimer(ioService, LIVENESS_TICK, [this](){ checkLiveness(); })
+	,	stateDirty{false}
+	,	stateTimer(ioService, STATE_SAVE_PERIOD, [this](){ saveState(); })
+	,	stateWork{make_unique<io_service::work>(stateService)}
+	,	stateWriting{false}
+	,	stateThread([this]() { stateService.run(); })
+	,	refreshTimer(ioService, FRAME_REFRESH_CHECK_PERIOD, [this](){ refreshFrames(); })	{
 
 	socket.set_option(socket_base::broadcast(true));
 	socket.set_option(socket_base::reuse_address(true));
+	socket.set_option(socket_base::receive_buffer_size(RECEIVE_BUFFER_SIZE));
+
+	if(shardCount == 0) {
+		shardCount = max(thread::hardware_concurrency(), 1u);
+	}
+
+	for(size_t i = 0; i < shardCount; ++i) {
+		shards.emplace_back(make_unique<Shard>(*this, i));
+	}
 
 	asyncThread = std::thread([this]() { threadRoutine(); });
 
-	std::cout << "[Info] LightHub::LightHub: Now listening for packets"
-		<< std::endl;
+	LOG_INFO("LightHub::LightHub: Now listening for packets");
 	
 	//Post constructor setup (on local thread)
 	ioService.post([this]() {
-		discover();
+		discovery.start();
 
 		startListening();
 	});
 }
 
 LightHub::~LightHub() {
-	//Delete the work unit, allow io_service.run() to return
+	//Delete the work unit and abandon the pending receive/timers,
+	//allow io_service.run() to return
 	ioWork.reset();
+	ioService.stop();
 
 	asyncThread.join();
+
+	for(auto& shard : shards) {
+		shard->stop();
+	}
+
+	//Lets a write in progress finish
+	stateWork.reset();
+	stateThread.join();
+
+	//Nothing else touches the nodes any more
+	if(!statePath.empty() && stateDirty.exchange(false, memory_order_relaxed)) {
+		writeState(statePath, stateEntries());
+	}
 }
 
 void LightHub::threadRoutine() {
-	ioService.run();
+	loopMonitor.run();
 }
 
 
 void LightHub::discover() {
 	auto data = Packet::NodeInfo().asDatagram();
 
-	sendDatagram(ip::address_v4::broadcast(),
-		data);
+	discoveryRounds.inc();
+	discovery.charge(data.size(), DiscoveryScheduler::Direction::Sent);
+
+	sendDatagram(discoveryAddress, data);
 }
 
-void LightHub::sendDatagram(const ip::address& addr, const vector<uint8_t>& data) {
-	lock_guard<mutex> sendLock(sendMutex);
+LightHub::NodeMap::iterator LightHub::createNode(const ip::address& address,
+	const string& name) {
+	auto node = nodes.emplace(address, name).first;
+	auto& shard = getShard(address);
 
-	sendQueue.push_back(data);
+	try {
+		node->second.link = make_shared<NodeLink>(shard.ioService, ip::udp::endpoint(address, port),
+			pool, [this, &shard](const UdpTransmitter::Datagram& datagram,
+				const boost::system::error_code& ec) {
+				handleSent(shard.nodeCounters, datagram, ec);
+			});
+	}
+	catch(const boost::system::system_error& e) {
+		LOG_WARNING("LightHub::createNode: Sending frames to " << address.to_string()
+			<< " through the shared socket, could not open a link: " << e.what());
+	}
 
-	socket.async_send_to(buffer(sendQueue.back()), ip::udp::endpoint(addr, port),
-		[this](const boost::system::error_code& ec, size_t bytesTransferred) {
-			lock_guard<mutex> sendLock(sendMutex);
-			sendQueue.pop_front();
+	return node;
+}
 
-			if(ec) {
-				cerr << "[Error] LightHub::cbSendDatagram: " << ec.message() << endl;
-			}
-		});
+void LightHub::sampleQueues() {
+	for(auto& node : nodes) {
+		if(node.second.link) {
+			node.second.link->sampleQueue();
+		}
+	}
 }
 
-LightHub::NodeIterator LightHub::begin() const {
-	return nodes.begin();
+LightHub::NodeQuery& LightHub::getNodeQuery(const ip::address& address) {
+	auto query = nodeQueries.find(address);
+
+	if(query == nodeQueries.end()) {
+		query = nodeQueries.emplace(piecewise_construct, forward_as_tuple(address),
+			forward_as_tuple(*this, address)).first;
+
+		if(incompleteNodes++ == 0) {
+			incompleteSince = query->second.firstQueried;
+		}
+	}
+
+	return query->second;
 }
 
-LightHub::NodeIterator LightHub::end() const {
-	return nodes.end();
+void LightHub::queryLights(const ip::address& address, uint8_t lightCount, bool hashed,
+	uint32_t hash) {
+	auto& query = getNodeQuery(address);
+
+	query.pendingHash = hash;
+	query.pendingHashed = hashed;
+	query.pendingLights.reset();
+	for(size_t i = 0; i < lightCount; ++i) {
+		query.pendingLights.set(i);
+	}
+
+	query.retries = 0;
+	lightQueries.inc(lightCount);
+
+	if(query.pendingLights.none()) {
+		lightsAnswered(query);
+		return;
+	}
+
+	sendLightQueries(address, query);
+	query.timeout.feed();
 }
 
-size_t LightHub::getNodeCount() const {
-	return nodes.size();
+void LightHub::sendLightQueries(const ip::address& address, const NodeQuery& query) {
+	for(size_t i = 0; i < query.pendingLights.size(); ++i) {
+		if(query.pendingLights.test(i)) {
+			auto datagram = Packet::LightInfo(i).asDatagram();
+
+			discovery.charge(datagram.size(), DiscoveryScheduler::Direction::Sent);
+			sendDatagram(address, datagram);
+		}
+	}
 }
 
-void LightHub::startListening() {
-	//Start the async receive
-	socket.async_receive_from(buffer(readBuffer),
-		receiveEndpoint,
-		[this](const boost::system::error_code& ec, size_t bytesTransferred) {
-			handleReceive(ec, bytesTransferred);
-		});
+void LightHub::handleLightInfo(const ip::address& address, uint8_t lightID) {
+	auto found = nodeQueries.find(address);
+	if( (found == nodeQueries.end()) || !found->second.pendingLights.test(lightID) ) {
+		return;
+	}
+
+	auto& query = found->second;
+
+	query.pendingLights.reset(lightID);
+	if(query.pendingLights.none()) {
+		lightsAnswered(query);
+	}
 }
 
-void LightHub::handleReceive(const boost::system::error_code& ec,
-	size_t bytesTransferred) {
-	
+void LightHub::lightsAnswered(NodeQuery& query) {
+	query.timeout.stop();
+
+	if(query.pendingHashed) {
+		query.hash = query.pendingHash;
+		query.known = true;
+	}
+
+	if(!query.complete) {
+		query.complete = true;
+
+		auto now = std::chrono::steady_clock::now();
+		nodeCompleteTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			now - query.firstQueried).count());
+
+		if(--incompleteNodes == 0) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - incompleteSince);
+			fullTopologyTime.set(elapsed.count());
+
+			LOG_INFO("LightHub::handleLightInfo: Topology complete, " << nodeQueries.size()
+				<< " nodes known after " << elapsed.count() << " ms");
+		}
+	}
+}
+
+void LightHub::handleLightInfoTimeout(const ip::address& address) {
+	//The node may have been evicted since
+	auto found = nodeQueries.find(address);
+	if(found == nodeQueries.end()) {
+		return;
+	}
+
+	auto& query = found->second;
+
+	if(query.pendingLights.none()) {
+		return;
+	}
+
+	if(query.retries == MAX_LIGHT_INFO_RETRIES) {
+		lightQueryTimeouts.inc();
+
+		LOG_WARNING("LightHub::handleLightInfoTimeout: " << address.to_string() << " left "
+			<< query.pendingLights.count() << " LightInfo requests unanswered, "
+			"waiting for the next discovery round");
+
+		//A hashed node is queried again because its hash is still unknown
+		query.pendingLights.reset();
+		return;
+	}
+
+	++query.retries;
+	lightQueriesRetried.inc(query.pendingLights.count());
+
+	sendLightQueries(address, query);
+	query.timeout.start();
+}
+
+void LightHub::seen(NodeMap::iterator node) {
+	node->second.lastSeen = std::chrono::steady_clock::now();
+
+	probesSent.erase(node->first);
+	liveness.schedule(node->first, LIVENESS_TIMEOUT);
+
+	if(!node->second.reachable) {
+		LOG_INFO("LightHub::seen: " << node->second.name << " (" << node->first.to_string()
+			<< ") is reachable again");
+
+		setReachable(node, true);
+		node->second.resync = true;
+	}
+
+	if(node->second.resync) {
+		node->second.resync = false;
+		replayFrames(node->second.lights);
+	}
+}
+
+void LightHub::checkLiveness() {
+	vector<ip::address> expired;
+	liveness.advance(expired);
+
+	for(const auto& address : expired) {
+		handleLivenessTimeout(address);
+	}
+}
+
+void LightHub::handleLivenessTimeout(const ip::address& address) {
+	auto node = nodes.find(address);
+	if(node == nodes.end()) {
+		return;
+	}
+
+	if(!node->second.reachable) {
+		if(std::chrono::steady_clock::now() - node->second.lastSeen >= EVICTION_TIMEOUT) {
+			evict(node);
+		}
+		else {
+			probe(address);
+			liveness.schedule(address, UNREACHABLE_PROBE_INTERVAL);
+		}
+
+		return;
+	}
+
+	//A node that reboots between two discovery rounds only ever misses this
+	//deadline, and comes back dark
+	node->second.resync = true;
+
+	auto& probes = probesSent[address];
+	if(probes < MAX_LIVENESS_PROBES) {
+		++probes;
+
+		probe(address);
+		liveness.schedule(address, LIVENESS_PROBE_INTERVAL);
+		return;
+	}
+
+	LOG_WARNING("LightHub::handleLivenessTimeout: " << node->second.name << " ("
+		<< address.to_string() << ") stopped answering, marking its lights unreachable");
+
+	probesSent.erase(address);
+	setReachable(node, false);
+
+	liveness.schedule(address, UNREACHABLE_PROBE_INTERVAL);
+}
+
+void LightHub::probe(const ip::address& address) {
+	livenessProbes.inc();
+
+	auto data = Packet::NodeInfo().asDatagram();
+	discovery.charge(data.size(), DiscoveryScheduler::Direction::Sent);
+	sendDatagram(address, data);
+}
+
+void LightHub::setReachable(NodeMap::iterator node, bool reachable) {
+	node->second.reachable = reachable;
+
+	for(auto& light : node->second.lights) {
+		light->reachable.store(reachable, memory_order_relaxed);
+	}
+
+	publishTopology();
+
+	for(auto& light : node->second.lights) {
+		sigLightReachability(light);
+	}
+}
+
+void LightHub::evict(NodeMap::iterator node) {
+	auto address = node->first;
+
+	LOG_INFO("LightHub::evict: Removing " << node->second.name << " (" << address.to_string()
+		<< "), not heard from for " << EVICTION_TIMEOUT.count() << " minutes");
+
+	evictions.inc();
+
+	auto query = nodeQueries.find(address);
+	if(query != nodeQueries.end()) {
+		if(!query->second.complete) {
+			--incompleteNodes;
+		}
+
+		nodeQueries.erase(query);
+	}
+
+	auto lights = node->second.lights;
+
+	//Its lights keep their state for when the node comes back
+	auto now = std::chrono::steady_clock::now();
+	retiredNodes.erase(address);
+	retiredNodes.emplace(address, RetiredNode{move(node->second), now});
+	nodes.erase(node);
+
+	if(retiredNodes.size() > MAX_RETIRED_NODES) {
+		retiredNodes.erase(min_element(retiredNodes.begin(), retiredNodes.end(),
+			[](const pair<const ip::address, RetiredNode>& a,
+				const pair<const ip::address, RetiredNode>& b) {
+				return a.second.since < b.second.since;
+			}));
+	}
+
+	publishTopology();
+	discovery.topologyChanged();
+
+	for(auto& light : lights) {
+		sigLightRemove(light);
+	}
+}
+
+LightHub::NodeMap::iterator LightHub::restore(const ip::address& address) {
+	auto retired = retiredNodes.find(address);
+	if(retired == retiredNodes.end()) {
+		return nodes.end();
+	}
+
+	auto node = nodes.emplace(address, move(retired->second.node)).first;
+	retiredNodes.erase(retired);
+
+	LOG_INFO("LightHub::restore: " << node->second.name << " (" << address.to_string()
+		<< ") is back with " << node->second.lights.size() << " known lights");
+
+	//Announced again, seen() then makes them reachable and replays their frames
+	for(auto& light : node->second.lights) {
+		sigLightDiscover(light);
+	}
+
+	return node;
+}
+
+void LightHub::replayFrames(const vector<shared_ptr<Light>>& lights) {
+	framesReplayed.inc(lights.size());
+
+	update(lights, FrameMode::Always);
+}
+
+void LightHub::refreshFrames() {
+	vector<shared_ptr<Light>> lights;
+
+	for(const auto& node : nodes) {
+		lights.insert(lights.end(), node.second.lights.begin(), node.second.lights.end());
+	}
+
+	//The shards check each light's last send and skip the recent ones
+	update(lights, FrameMode::Stale);
+}
+
+void LightHub::sendDatagram(const ip::address& addr, const vector<uint8_t>& data) {
+	transmitter.send(ip::udp::endpoint(addr, port), data);
+}
+
+size_t LightHub::getShardIndex(const ip::address& address) const {
+	//FNV-1a of the address bytes
+	auto hash = [](const uint8_t* bytes, size_t size) {
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < size; ++i) {
+			h = (h ^ bytes[i]) * 16777619u;
+		}
+		return h;
+	};
+
+	uint32_t h;
+	if(address.is_v4()) {
+		auto bytes = address.to_v4().to_bytes();
+		h = hash(bytes.data(), bytes.size());
+	}
+	else {
+		auto bytes = address.to_v6().to_bytes();
+		h = hash(bytes.data(), bytes.size());
+	}
+
+	return h % shards.size();
+}
+
+LightHub::Shard& LightHub::getShard(const ip::address& address) {
+	return *shards[getShardIndex(address)];
+}
+
+size_t LightHub::getShardCount() const {
+	return shards.size();
+}
+
+void LightHub::handleSent(NodeCounterMap& nodeCounters, const UdpTransmitter::Datagram& datagram,
+	const boost::system::error_code& ec) {
+	Trace::record(sendStage, datagram.traceId, datagram.queued, Trace::now());
+
+	auto addr = datagram.endpoint.address();
+	auto& counters = getNodeCounters(nodeCounters, addr);
+
 	if(ec) {
-		cerr << "[Error] Failed to receive from UDP socket" << endl;
+		sendErrors.inc();
+		counters.errors->inc();
+
+		auto now = std::chrono::steady_clock::now();
+		if(now - counters.errorLogged >= SEND_ERROR_LOG_PERIOD) {
+			counters.errorLogged = now;
+
+			LOG_ERROR("LightHub::handleSent: Sending to " << addr.to_string() << " failed: "
+				<< ec.message() << ", " << counters.errors->value() << " errors so far");
+		}
 	}
 	else {
-		try {
-			Packet p{vector<uint8_t>{readBuffer.begin(), readBuffer.begin() + bytesTransferred}};
-			auto data = p.data();
-
-			switch(p.getID()) {
-				case Packet::ID::NodeInfoResponse: {
-					if(data.size() < 1) {
-						cerr << "[Error] LightHub::handleReceive: Invalid payload size for NodeInfoResponse: "
-							<< data.size() << endl;
-					}
-					else {
-						string name{data.begin()+1, data.end()};
+		counters.datagrams->inc();
+		counters.bytes->inc(datagram.size());
+	}
+}
+
+LightHub::NodeCounters& LightHub::getNodeCounters(NodeCounterMap& nodeCounters,
+	const ip::address& addr) {
+	auto counters = nodeCounters.find(addr);
+
+	if(counters == nodeCounters.end()) {
+		string label = "node=\"" + addr.to_string() + "\"";
+
+		counters = nodeCounters.emplace(addr, NodeCounters{
+			&Metrics::counter("alexahub_udp_datagrams_total", "UDP datagrams sent per node", label),
+			&Metrics::counter("alexahub_udp_bytes_total", "UDP payload bytes sent per node", label),
+			&Metrics::counter("alexahub_udp_node_send_errors_total",
+				"UDP datagrams to a node that failed to send, e.g. ICMP port unreachable", label),
+			{}
+		}).first;
+	}
+
+	return counters->second;
+}
+
+shared_ptr<const Topology> LightHub::getTopology() const {
+	return topology.load();
+}
 
-						for(int i = 0; i < data[0]; ++i) {
-							sendDatagram(receiveEndpoint.address(), Packet::LightInfo(i).asDatagram());
+size_t LightHub::getNodeCount() const {
+	return getTopology()->nodes.size();
+}
+
+LightHub::FrameStats LightHub::getFrameStats() const {
+	return {framesSent.value(), framesSkipped.value()};
+}
+
+void LightHub::addNode(const ip::address& address, const string& name,
+	const vector<pair<string, uint16_t>>& lights) {
+	promise<void> added;
+
+	ioService.post([&]() {
+		auto node = nodes.find(address);
+		if(node == nodes.end()) {
+			node = createNode(address, name);
+
+			//Like a discovered node, it has to answer to stay
+			node->second.lastSeen = std::chrono::steady_clock::now();
+			liveness.schedule(address, LIVENESS_TIMEOUT);
+		}
+
+		vector<shared_ptr<Light>> newLights;
+
+		for(size_t i = 0; i < lights.size(); ++i) {
+			auto& nodeLights = node->second.lights;
+
+			auto existing = find_if(nodeLights.begin(), nodeLights.end(),
+				[&lights, i](const shared_ptr<Light>& light) {
+					return light->getName() == lights[i].first;
+				});
+
+			if(existing == nodeLights.end()) {
+				nodeLights.emplace_back(make_shared<Light>(*this, node->second, address, i,
+					lights[i].first, lights[i].second));
+
+				newLights.push_back(nodeLights.back());
+			}
+		}
+
+		publishTopology();
+
+		for(auto& light : newLights) {
+			sigLightDiscover(light);
+		}
+
+		added.set_value();
+	});
+
+	added.get_future().wait();
+}
+
+void LightHub::loadState(const string& path) {
+	vector<TopologyFile::NodeEntry> saved;
+
+	try {
+		saved = TopologyFile::load(path);
+	}
+	catch(const exception& e) {
+		LOG_WARNING("LightHub::loadState: " << e.what() << ", starting without it");
+	}
+
+	size_t restoredNodes = 0, restoredLights = 0;
+	promise<void> loaded;
+
+	ioService.post([&]() {
+		statePath = path;
+
+		vector<shared_ptr<Light>> newLights;
+		auto now = std::chrono::steady_clock::now();
+
+		for(const auto& entry : saved) {
+			//Discovery got there first
+			if(nodes.find(entry.address) != nodes.end()) {
+				continue;
+			}
+
+			auto node = createNode(entry.address, entry.name);
+
+			//The hub and its nodes usually restart together after a power cut, so
+			//the node's first answer gets the saved frames
+			node->second.lastSeen = now;
+			node->second.resync = true;
+			liveness.schedule(entry.address, RESTORED_NODE_TIMEOUT);
+
+			for(const auto& savedLight : entry.lights) {
+				auto light = make_shared<Light>(*this, node->second, entry.address,
+					savedLight.lightID, savedLight.name, savedLight.size);
+
+				light->setState(savedLight.state, savedLight.state.toColor());
+
+				node->second.lights.push_back(light);
+				newLights.push_back(light);
+			}
+
+			//A V2 node answering with the same hash is not queried for its lights
+			if(entry.hashed) {
+				auto& query = nodeQueries.emplace(piecewise_construct, forward_as_tuple(entry.address),
+					forward_as_tuple(*this, entry.address)).first->second;
+
+				query.hash = entry.hash;
+				query.known = true;
+				query.complete = true;
+			}
+
+			++restoredNodes;
+		}
+
+		restoredLights = newLights.size();
+
+		publishTopology();
+
+		for(auto& light : newLights) {
+			sigLightDiscover(light);
+		}
+
+		loaded.set_value();
+	});
+
+	loaded.get_future().wait();
+
+	LOG_INFO("LightHub::loadState: Restored " << restoredNodes << " nodes with " << restoredLights
+		<< " lights from " << path);
+}
+
+void LightHub::saveState() {
+	//A write still in progress leaves stateDirty set for the next period
+	if(statePath.empty() || stateWriting.load(memory_order_acquire)
+		|| !stateDirty.exchange(false, memory_order_relaxed)) {
+		return;
+	}
+
+	stateWriting.store(true, memory_order_relaxed);
+
+	stateService.post([this, path = statePath, entries = stateEntries()]() {
+		writeState(path, entries);
+
+		stateWriting.store(false, memory_order_release);
+	});
+}
+
+vector<TopologyFile::NodeEntry> LightHub::stateEntries() const {
+	vector<TopologyFile::NodeEntry> entries;
+	entries.reserve(nodes.size());
+
+	for(const auto& node : nodes) {
+		TopologyFile::NodeEntry entry{node.first, node.second.name, false, 0, {}};
+
+		auto query = nodeQueries.find(node.first);
+		if( (query != nodeQueries.end()) && query->second.known ) {
+			entry.hashed = true;
+			entry.hash = query->second.hash;
+		}
+
+		for(const auto& light : node.second.lights) {
+			entry.lights.push_back({light->getLightID(), light->getName(),
+				static_cast<uint16_t>(light->getSize()), light->getState()});
+		}
+
+		entries.push_back(move(entry));
+	}
+
+	return entries;
+}
+
+void LightHub::writeState(const string& path, const vector<TopologyFile::NodeEntry>& entries) {
+	auto start = std::chrono::steady_clock::now();
+
+	try {
+		TopologyFile::save(path, entries);
+
+		stateSaveTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+	catch(const exception& e) {
+		stateSaveErrors.inc();
+
+		//Tried again next period
+		stateDirty.store(true, memory_order_relaxed);
+
+		LOG_ERROR("LightHub::writeState: " << e.what());
+	}
+}
+
+void LightHub::publishTopology() {
+	auto snapshot = make_shared<Topology>();
+
+	snapshot->nodes = nodes;
+	for(const auto& node : nodes) {
+		for(const auto& light : node.second.lights) {
+			snapshot->lights.push_back(light);
+			snapshot->lightsById.emplace(light->getFullName(), light);
+		}
+	}
+
+	topology.store(move(snapshot));
+	stateDirty.store(true, memory_order_relaxed);
+
+	size_t reachable = count_if(nodes.begin(), nodes.end(),
+		[](const NodeMap::value_type& node) { return node.second.reachable; });
+
+	reachableNodes.set(reachable);
+	unreachableNodes.set(nodes.size() - reachable);
+	retiredNodeCount.set(retiredNodes.size());
+}
+
+void LightHub::startListening() {
+	receiver.start();
+}
+
+void LightHub::handleReceiveError(const boost::system::error_code& ec) {
+	static auto& receiveErrors = Metrics::counter("alexahub_udp_dropped_total",
+		"Received UDP datagrams that were discarded", "reason=\"receive_error\"");
+
+	receiveErrors.inc();
+
+	LOG_ERROR("LightHub::handleReceive: Failed to receive from UDP socket: " << ec.message());
+}
+
+void LightHub::handleReceive(const ip::udp::endpoint& from, const uint8_t* datagram, size_t size) {
+	PROBE("LightHub::handleReceive");
+
+	static auto& unexpectedId = Metrics::counter("alexahub_udp_dropped_total",
+		"Received UDP datagrams that were discarded", "reason=\"unexpected_id\"");
+	static auto& unknownNode = Metrics::counter("alexahub_udp_dropped_total",
+		"Received UDP datagrams that were discarded", "reason=\"unknown_node\"");
+	static auto& badPayload = Metrics::counter("alexahub_udp_dropped_total",
+		"Received UDP datagrams that were discarded", "reason=\"bad_payload\"");
+
+	try {
+		Packet p{vector<uint8_t>{datagram, datagram + size}};
+		auto data = p.data();
+
+		switch(p.getID()) {
+			case Packet::ID::NodeInfoResponse:
+			case Packet::ID::NodeInfoResponseV2:
+			case Packet::ID::NodeInfoResponseV3: {
+				discovery.charge(size, DiscoveryScheduler::Direction::Received);
+
+				bool booted = (p.getID() == Packet::ID::NodeInfoResponseV3);
+				bool hashed = booted || (p.getID() == Packet::ID::NodeInfoResponseV2);
+				size_t nameOffset = booted ? 9 : hashed ? 5 : 1;
+
+				if(data.size() < nameOffset) {
+					badPayload.inc();
+
+					LOG_ERROR("LightHub::handleReceive: Invalid payload size for NodeInfoResponse: "
+						<< data.size());
+				}
+				else {
+					string name{data.begin()+nameOffset, data.end()};
+					uint8_t lightCount = data[0];
+
+					auto node = nodes.find(from.address());
+					if(node == nodes.end()) {
+						node = restore(from.address());
+						if(node == nodes.end()) {
+							node = createNode(from.address(), name);
 						}
 
-						if(nodes.find(receiveEndpoint.address()) == nodes.end()) {
-							nodes.emplace(receiveEndpoint.address(), name);
+						publishTopology();
+						discovery.topologyChanged();
+					}
+
+					if(booted) {
+						auto bootID = Packet::parse32(data.begin()+5);
+
+						if(node->second.bootKnown && (node->second.bootID != bootID)) {
+							LOG_INFO("LightHub::handleReceive: " << name << " ("
+								<< from.address().to_string() << ") restarted, replaying its frames");
+
+							node->second.resync = true;
 						}
+
+						node->second.bootKnown = true;
+						node->second.bootID = bootID;
+					}
+
+					seen(node);
+
+					if(!hashed) {
+						//Legacy node, its lights may have changed at any time
+						queryLights(from.address(), lightCount, false, 0);
+						break;
+					}
+
+					auto hash = Packet::parse32(data.begin()+1);
+					auto& query = getNodeQuery(from.address());
+
+					if(query.known && (query.hash == hash)) {
+						lightQueriesSkipped.inc(lightCount);
+						break;
+					}
+
+					//Answers for the same hash are still coming in or being retried
+					if(query.pendingLights.any() && query.pendingHashed && (query.pendingHash == hash)) {
+						break;
 					}
+
+					queryLights(from.address(), lightCount, true, hash);
 				}
-				break;
+			}
+			break;
 
-				case Packet::ID::LightInfoResponse: {
-					auto node = nodes.find(receiveEndpoint.address());
-					if(node == nodes.end()) {
-						cerr << "[Info] LightHub::handleReceive: Received LightInfoResponse from node not "
-							"in map" << endl;
+			case Packet::ID::LightInfoResponse: {
+				discovery.charge(size, DiscoveryScheduler::Direction::Received);
+
+				auto node = nodes.find(from.address());
+				if(node == nodes.end()) {
+					unknownNode.inc();
+
+					LOG_INFO("LightHub::handleReceive: Received LightInfoResponse from node not "
+						"in map");
+				}
+				else {
+					if(p.data().size() < 2) {
+						badPayload.inc();
+
+						LOG_ERROR("LightHub::handleReceive: Invalid payload size for "
+							"LightInfoResponse: " << p.data().size());
 					}
 					else {
-						if(p.data().size() < 2) {
-							cerr << "[Error] LightHub::handleReceive: Invalid payload size for "
-								"LightInfoResponse: " << p.data().size() << endl;
+						seen(node);
+
+						auto ledCount = Packet::parse16(p.data().begin());
+						string name{data.begin()+2, data.end()};
+
+						auto light = find_if(node->second.lights.begin(), node->second.lights.end(),
+							[&name](const std::shared_ptr<Light>& light) {
+								return light->getName() == name;
+							});
+
+						if(light == node->second.lights.end()) {
+							node->second.lights.emplace_back(make_shared<Light>(*this, node->second,
+								from.address(), p.getLightID(), name, ledCount));
+
+							publishTopology();
+							discovery.topologyChanged();
+
+							sigLightDiscover(node->second.lights.back());
 						}
-						else {
-							auto ledCount = Packet::parse16(p.data().begin());
-							string name{data.begin()+2, data.end()};
-
-							auto light = find_if(node->second.lights.begin(), node->second.lights.end(),
-								[&name](const std::shared_ptr<Light>& light) {
-									return light->getName() == name;
-								});
-
-							if(light == node->second.lights.end()) {
-								node->second.lights.emplace_back(make_shared<Light>(*this, node->second,
-									receiveEndpoint.address(), p.getLightID(), name, ledCount));
-
-								sigLightDiscover(node->second.lights.back());
-							}
-							else if((*light)->getSize() != ledCount) {
-								node->second.lights.erase(light);
-
-								cout << "[Info] LightHub::handleReceive: Previously connected light "
-									<< node->second.name << "/" << name << " has changed LED count"
-									<< endl;
-							}
+						else if((*light)->getSize() != ledCount) {
+							//Replaced rather than dropped: this answer completes the node's
+							//query, after which a known hash is never asked about again
+							auto old = *light;
+							auto state = old->getState();
+
+							*light = make_shared<Light>(*this, node->second, from.address(),
+								p.getLightID(), name, ledCount);
+							(*light)->setState(state, state.toColor());
+
+							publishTopology();
+							discovery.topologyChanged();
+
+							LOG_INFO("LightHub::handleReceive: Previously connected light "
+								<< node->second.name << "/" << name << " has changed LED count to "
+								<< ledCount);
+
+							sigLightRemove(old);
+							sigLightDiscover(*light);
 						}
+
+						handleLightInfo(from.address(), p.getLightID());
 					}
 				}
-				break;
-
-				default:
-					cerr << "[Error] Unexpected message ID received: " << static_cast<int>(p.getID())
-						<< endl;
-				break;
 			}
+			break;
+
+			default:
+				unexpectedId.inc();
+
+				LOG_ERROR("LightHub::handleReceive: Unexpected message ID received: "
+					<< static_cast<int>(p.getID()));
+			break;
 		}
-		catch(const exception& e) {
-			cerr << "[Error] LightHub::handleReceive: " << e.what() << endl;
+	}
+	catch(const exception& e) {
+		parseFailures.inc();
+
+		LOG_ERROR("LightHub::handleReceive: " << e.what());
+	}
+}
+
+UdpTransmitter::Datagram* LightHub::encodeFrame(Light& light, FrameMode mode) {
+	Trace::Span span{encodeStage};
+
+	lock_guard<mutex> pixelLock(light.pixelMutex);
+
+	auto now = std::chrono::steady_clock::now();
+	bool stale = (now - light.sentTime) >= FRAME_REFRESH_PERIOD;
+
+	if(mode == FrameMode::Stale) {
+		//Lights never sent to are not the hub's to refresh
+		if(!stale || (light.sentTime == std::chrono::steady_clock::time_point{})) {
+			return nullptr;
 		}
+
+		framesRefreshed.inc();
+	}
+
+	auto hash = FrameHash::compute(light.pixels);
+
+	if( (mode == FrameMode::Changed) && (hash == light.sentHash) && !stale ) {
+		framesSkipped.inc();
+		return nullptr;
+	}
+
+	light.sentHash = hash;
+	light.sentTime = now;
+
+	auto datagram = pool.acquire();
+	Packet::writeUpdateColor(light.getLightID(), light.pixels,
+		datagram->resize(Packet::updateColorSize(light.pixels.size())));
+
+	framesSent.inc();
+
+	return datagram;
+}
+
+void LightHub::sendFrame(Light& light, UdpTransmitter::Datagram* datagram) {
+	Trace::Span span{queueStage};
+
+	if(light.link) {
+		light.link->send(datagram);
+	}
+	else {
+		getShard(light.getAddress()).transmitter.send(ip::udp::endpoint(light.getAddress(), port),
+			datagram);
 	}
-	
-	startListening();
 }
 
 void LightHub::update(Light& light) {
-	sendDatagram(light.getAddress(),
-		Packet::UpdateColor(light.getLightID(), light.getPixels()).asDatagram());
+	//Its last frame is replayed once it is back
+	if(!light.isReachable()) {
+		return;
+	}
+
+	if(auto datagram = encodeFrame(light, FrameMode::Changed)) {
+		sendFrame(light, datagram);
+	}
+}
+
+void LightHub::update(const vector<shared_ptr<Light>>& lights) {
+	update(lights, FrameMode::Always);
+}
+
+void LightHub::update(const vector<shared_ptr<Light>>& lights, FrameMode mode) {
+	vector<vector<shared_ptr<Light>>> batches(shards.size());
+
+	for(const auto& light : lights) {
+		if(light->isReachable()) {
+			batches[getShardIndex(light->getAddress())].push_back(light);
+		}
+	}
+
+	auto traceId = Trace::current();
+
+	for(size_t i = 0; i < shards.size(); ++i) {
+		if(batches[i].empty()) {
+			continue;
+		}
+
+		shards[i]->ioService.post([this, traceId, mode, batch = move(batches[i])]() {
+			Trace::Scope scope{traceId};
+
+			for(const auto& light : batch) {
+				if(auto datagram = encodeFrame(*light, mode)) {
+					sendFrame(*light, datagram);
+				}
+			}
+		});
+	}
 }
@@ -1,17 +1,32 @@
 #pragma once
 
 #include <vector>
+#include <bitset>
 #include <memory>
 #include <thread>
-#include <iostream>
 #include <deque>
 #include <map>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <future>
 
 #include <boost/asio.hpp>
 #include <boost/signals2.hpp>
 
 #include "Light.hpp"
+#include "Log.hpp"
+#include "LoopMonitor.hpp"
+#include "DiscoveryScheduler.hpp"
+#include "Metrics.hpp"
+#include "NodeLink.hpp"
 #include "PeriodicTimer.hpp"
+#include "Snapshot.hpp"
+#include "TimingWheel.hpp"
+#include "TopologyFile.hpp"
+#include "UdpReceiver.hpp"
+#include "UdpTransmitter.hpp"
+#include "WatchdogTimer.hpp"
 
 
 class Rhopalia;
@@ -21,19 +36,55 @@ struct LightNode {
 
 	std::string name;
 	std::vector<std::shared_ptr<Light>> lights;
+
+	//Cleared once the node stops answering, until it is heard from again
+	bool reachable;
+	std::chrono::steady_clock::time_point lastSeen;
+
+	//Set when the node may have lost its frames (it restarted, or missed a
+	//liveness deadline), they are replayed at its next answer
+	bool resync;
+
+	//Last boot id from NodeInfoResponseV3, older nodes never set bootKnown
+	bool bootKnown;
+	uint32_t bootID;
+
+	//Carries the node's frames, nullptr if it could not be opened, in which
+	//case they go out through the shared socket
+	std::shared_ptr<NodeLink> link;
+};
+
+//Immutable view of the discovered nodes, republished by LightHub whenever
+//a node or light is added, removed or changes reachability
+struct Topology {
+	std::map<boost::asio::ip::address, LightNode> nodes;
+
+	std::vector<std::shared_ptr<Light>> lights;
+	std::unordered_map<std::string, std::shared_ptr<Light>> lightsById;
 };
 
 
 class LightHub
 {
 public:
-	using NodeIterator = std::map<boost::asio::ip::address, LightNode>::const_iterator;
-
 	enum class ListenerType {
-		LightDiscover
+		LightDiscover,
+		LightReachability,	//Light::isReachable() changed
+		LightRemove			//The light's node was evicted, or the light replaced
+	};
+
+	struct FrameStats {
+		uint64_t sent;
+		uint64_t skipped;
 	};
 
-	LightHub(uint16_t port, uint32_t discoverPeriod = 1000);
+	//Discovery runs every discoverPeriod once the startup burst is over,
+	//backing off while the topology is stable. Frames are encoded and sent
+	//by shardCount threads, each serving the nodes whose address hashes to
+	//it, 0 starts one per core.
+	LightHub(uint16_t port, uint32_t discoverPeriod = 1000,
+		const boost::asio::ip::address& discoveryAddress = boost::asio::ip::address_v4::broadcast(),
+		size_t shardCount = 1);
 	~LightHub();
 
 	template<class T>
@@ -41,59 +92,349 @@ public:
 		if(listenType == ListenerType::LightDiscover) {
 			sigLightDiscover.connect(slot);
 		}
+		else if(listenType == ListenerType::LightReachability) {
+			sigLightReachability.connect(slot);
+		}
+		else if(listenType == ListenerType::LightRemove) {
+			sigLightRemove.connect(slot);
+		}
 		else {
-			std::cout << "[Error] LightNode::addListener: Invalid listener type"
-				<< std::endl;
+			LOG_ERROR("LightNode::addListener: Invalid listener type");
 		}
 	}
 
-	NodeIterator begin() const;
-	NodeIterator end() const;
+	//Safe to call from any thread, never blocks
+	std::shared_ptr<const Topology> getTopology() const;
 
 	size_t getNodeCount() const;
 
+	FrameStats getFrameStats() const;
+
+	//Adds a node and its lights {name, LED count} as if they had been
+	//discovered, light IDs are their indices. Blocks until the topology
+	//is published, so it must not be called from the LightHub thread.
+	void addNode(const boost::asio::ip::address& address, const std::string& name,
+		const std::vector<std::pair<std::string, uint16_t>>& lights);
+
+	//Transmits the current frame of each light, even if it is unchanged: a
+	//repeated command is how a lost frame gets retried. The lights are
+	//handed to their shards, which encode and send them in one batch each,
+	//so this returns before the frames are encoded.
+	void update(const std::vector<std::shared_ptr<Light>>& lights);
+
+	size_t getShardCount() const;
+
+	//Restores the nodes and lights saved in path, if there are any, and
+	//from then on keeps the file up to date. Restored nodes are served at
+	//once and confirmed by discovery and liveness like any other, those
+	//that do not answer soon become unreachable. Blocks like addNode().
+	void loadState(const std::string& path);
+
 private:
+	//Identical frames from effects are suppressed. Every light's last frame
+	//is re-sent once nothing went to it for FRAME_REFRESH_PERIOD, checked
+	//every FRAME_REFRESH_CHECK_PERIOD, so a lost frame does not stick.
+	const std::chrono::seconds FRAME_REFRESH_PERIOD{5};
+	const std::chrono::seconds FRAME_REFRESH_CHECK_PERIOD{1};
+
+	//Room for a discovery burst, the kernel caps it at net.core.rmem_max
+	static const int RECEIVE_BUFFER_SIZE = 1 << 20;
+
+	//Datagram buffers shared by the discovery socket and every node link
+	static const size_t DATAGRAM_POOL_SIZE = 4096;
+
+	const std::chrono::seconds QUEUE_SAMPLE_PERIOD{1};
+
+	//Unanswered LightInfo requests are sent again after this, at most
+	//MAX_LIGHT_INFO_RETRIES times before waiting for the next round
+	const std::chrono::milliseconds LIGHT_INFO_TIMEOUT{250};
+	static const unsigned MAX_LIGHT_INFO_RETRIES = 4;
+
+	//A node not heard from for LIVENESS_TIMEOUT is probed with unicast
+	//NodeInfo, and unreachable once MAX_LIVENESS_PROBES went unanswered.
+	//The timeout outlasts the longest discovery period, whose answers keep
+	//nodes alive. Unreachable nodes keep being probed, more slowly, so a
+	//rebooted node is picked up without waiting for discovery, and are
+	//evicted once not heard from for EVICTION_TIMEOUT.
+	const std::chrono::seconds LIVENESS_TIMEOUT{40};
+	const std::chrono::milliseconds LIVENESS_PROBE_INTERVAL{1000};
+	static const unsigned MAX_LIVENESS_PROBES = 3;
+	const std::chrono::seconds UNREACHABLE_PROBE_INTERVAL{5};
+	const std::chrono::minutes EVICTION_TIMEOUT{10};
+
+	const std::chrono::milliseconds LIVENESS_TICK{250};
+	static const size_t LIVENESS_SLOTS = 256;
+
+	//Evicted nodes kept so their Lights, state included, come back with them
+	static const size_t MAX_RETIRED_NODES = 256;
+
+	//Restored nodes get a short first deadline, the startup discovery
+	//burst is over well before it
+	const std::chrono::seconds RESTORED_NODE_TIMEOUT{5};
+
+	//Changes are saved at most this often, and once more on shutdown
+	const std::chrono::seconds STATE_SAVE_PERIOD{10};
+
+	//A node that went away fails every frame sent to it
+	const std::chrono::seconds SEND_ERROR_LOG_PERIOD{10};
+
 	friend class Rhopalia;
 	friend class Light;
 
+	using NodeMap = std::map<boost::asio::ip::address, LightNode>;
+
+	struct NodeCounters {
+		Metrics::Counter* datagrams;
+		Metrics::Counter* bytes;
+		Metrics::Counter* errors;
+
+		//Errors are logged at most once per SEND_ERROR_LOG_PERIOD
+		std::chrono::steady_clock::time_point errorLogged;
+	};
+
+	using NodeCounterMap = std::map<boost::asio::ip::address, NodeCounters>;
+
+	//What the hub knows of a node's lights and the LightInfo requests it
+	//has not answered yet
+	struct NodeQuery {
+		NodeQuery(LightHub& hub, const boost::asio::ip::address& address);
+
+		//Hash the node's lights are known for, from NodeInfoResponseV2
+		uint32_t hash;
+		bool known;
+
+		//Lights asked for that have not answered, and the hash their
+		//answers will confirm if the node sent one
+		std::bitset<256> pendingLights;
+		uint32_t pendingHash;
+		bool pendingHashed;
+
+		unsigned retries;
+		WatchdogTimer timeout;
+
+		//Every light answered at least once
+		bool complete;
+		std::chrono::steady_clock::time_point firstQueried;
+	};
+
+	//Frame pipeline for a share of the nodes: their frames are encoded,
+	//and their links flushed, on the shard's own thread. Nodes without a
+	//link are sent to through the shard's socket.
+	struct Shard {
+		Shard(LightHub& hub, size_t index);
+
+		//Returns once the thread has exited
+		void stop();
+
+		boost::asio::io_service ioService;
+		std::unique_ptr<boost::asio::io_service::work> ioWork;
+		LoopMonitor loopMonitor;
+
+		boost::asio::ip::udp::socket socket;
+		UdpTransmitter transmitter;
+
+		//Only touched on the shard's thread
+		NodeCounterMap nodeCounters;
+
+		std::thread thread;
+	};
+
+	//Which frames encodeFrame() sends
+	enum class FrameMode {
+		Changed,	//Unless it matches the last one, sent within FRAME_REFRESH_PERIOD
+		Always,
+		Stale		//Only if nothing was sent for FRAME_REFRESH_PERIOD
+	};
+
+	//From a LightBuffer, unchanged frames are suppressed
 	void update(Light& light);
 
+	void update(const std::vector<std::shared_ptr<Light>>& lights, FrameMode mode);
+
+	//Re-sends the frames of lights nothing was sent to for a while
+	void refreshFrames();
+
 	void threadRoutine();
 
 	void startListening();
 
+	void publishTopology();
+
+	//Hands the node and light table to stateThread if it changed since the
+	//last save and no write is still in progress
+	void saveState();
+	std::vector<TopologyFile::NodeEntry> stateEntries() const;
+
+	//On stateThread, or in the destructor once it has exited
+	void writeState(const std::string& path, const std::vector<TopologyFile::NodeEntry>& entries);
+
 	void discover();
 
+	//Adds an empty node and opens its link
+	NodeMap::iterator createNode(
+		const boost::asio::ip::address& address, const std::string& name);
+
+	void sampleQueues();
+
+	static NodeCounters& getNodeCounters(NodeCounterMap& counters,
+		const boost::asio::ip::address& addr);
+
+	NodeQuery& getNodeQuery(const boost::asio::ip::address& address);
+
+	//Asks for each of the node's lights and tracks the answers, hashed is
+	//set if the node reported its configuration hash
+	void queryLights(const boost::asio::ip::address& address, uint8_t lightCount, bool hashed,
+		uint32_t hash);
+
+	//Sends LightInfo for every pending light
+	void sendLightQueries(const boost::asio::ip::address& address, const NodeQuery& query);
+
+	void handleLightInfo(const boost::asio::ip::address& address, uint8_t lightID);
+
+	//Every pending light has answered
+	void lightsAnswered(NodeQuery& query);
+	void handleLightInfoTimeout(const boost::asio::ip::address& address);
+
+	//The node answered, re-arms its liveness timeout and replays its frames if
+	//it was unreachable or resync is set
+	void seen(NodeMap::iterator node);
+
+	void checkLiveness();
+	void handleLivenessTimeout(const boost::asio::ip::address& address);
+
+	//Unicast NodeInfo, charged to discovery's budget
+	void probe(const boost::asio::ip::address& address);
+
+	void setReachable(NodeMap::iterator node, bool reachable);
+
+	//Removes the node from the topology, keeping it among the retired
+	void evict(NodeMap::iterator node);
+
+	//Brings a retired node back, nodes.end() if there is none
+	NodeMap::iterator restore(const boost::asio::ip::address& address);
+
+	//Sends the current frame of each light even if it is unchanged
+	void replayFrames(const std::vector<std::shared_ptr<Light>>& lights);
+
+	//Encodes the light's frame into a pooled datagram, nullptr if mode
+	//leaves it unsent
+	UdpTransmitter::Datagram* encodeFrame(Light& light, FrameMode mode);
+
 	void sendDatagram(const boost::asio::ip::address& addr,
 		const std::vector<uint8_t>& data);
 
+	//Sends through the light's node link, or its shard's socket without one
+	void sendFrame(Light& light, UdpTransmitter::Datagram* datagram);
+
+	//Called by a transmitter on its own thread for every datagram, with
+	//that thread's counters
+	void handleSent(NodeCounterMap& counters, const UdpTransmitter::Datagram& datagram,
+		const boost::system::error_code& ec);
+
 	void handleSendBroadcast(const boost::system::error_code&,
 		size_t bytesTransferred);
 
-	void handleReceive(const boost::system::error_code&,
-		size_t bytesTransferred);
+	//Called on asyncThread by the receiver for every datagram
+	void handleReceive(const boost::asio::ip::udp::endpoint& from, const uint8_t* datagram,
+		size_t size);
+	void handleReceiveError(const boost::system::error_code& ec);
+
 
 	//Callback for discovery timer
 	void handleDiscoveryTimer(const boost::system::error_code&);
 
+	//Stable across restarts, so a node always lands on the same shard
+	size_t getShardIndex(const boost::asio::ip::address& address) const;
+	Shard& getShard(const boost::asio::ip::address& address);
+
 	//Signals
 	boost::signals2::signal<void(std::shared_ptr<Light>)> sigLightDiscover;
+	boost::signals2::signal<void(std::shared_ptr<Light>)> sigLightReachability;
+	boost::signals2::signal<void(std::shared_ptr<Light>)> sigLightRemove;
 
-	std::map<boost::asio::ip::address, LightNode> nodes;
+	//Shared by every transmitter, declared first so it outlives them
+	DatagramPool pool;
+
+	//Outlive nodes, whose links use the shards' io_services
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	//Owned by asyncThread, other threads read the published snapshot
+	NodeMap nodes;
+	Snapshot<Topology> topology;
 
 	//Thread stuff
 	boost::asio::io_service ioService;
 	std::unique_ptr<boost::asio::io_service::work> ioWork;
+	LoopMonitor loopMonitor;
 	std::thread asyncThread;
 
 	//Network stuff
 	boost::asio::ip::udp::socket socket;
-	boost::asio::ip::udp::endpoint receiveEndpoint;
 	uint16_t port;
-	std::array<uint8_t, 512> readBuffer;
-	std::deque<std::vector<uint8_t>> sendQueue;
-	mutable std::mutex sendMutex;
+	boost::asio::ip::address discoveryAddress;
+	UdpReceiver receiver;
+	UdpTransmitter transmitter;
+
+	//Metrics
+	Metrics::Counter& framesSent;
+	Metrics::Counter& framesSkipped;
+	Metrics::Counter& discoveryRounds;
+	Metrics::Counter& sendErrors;
+	Metrics::Counter& parseFailures;
+
+	Metrics::Counter& lightQueries;
+	Metrics::Counter& lightQueriesSkipped;
+	Metrics::Counter& lightQueriesRetried;
+	Metrics::Counter& lightQueryTimeouts;
+	Metrics::Histogram& nodeCompleteTime;
+	Metrics::Gauge& fullTopologyTime;
+	Metrics::Counter& livenessProbes;
+	Metrics::Counter& evictions;
+	Metrics::Counter& framesReplayed;
+	Metrics::Counter& framesRefreshed;
+	Metrics::Gauge& reachableNodes;
+	Metrics::Gauge& unreachableNodes;
+	Metrics::Gauge& retiredNodeCount;
+	Metrics::Histogram& stateSaveTime;
+	Metrics::Counter& stateSaveErrors;
+
+	//Only touched on asyncThread
+	NodeCounterMap nodeCounters;
+	std::map<boost::asio::ip::address, NodeQuery> nodeQueries;
+
+	//Nodes whose lights have not all answered yet, and since when there
+	//have been any
+	size_t incompleteNodes;
+	std::chrono::steady_clock::time_point incompleteSince;
+
+	struct RetiredNode {
+		LightNode node;
+		std::chrono::steady_clock::time_point since;
+	};
+
+	TimingWheel<boost::asio::ip::address> liveness;
+	std::map<boost::asio::ip::address, unsigned> probesSent;
+	std::map<boost::asio::ip::address, RetiredNode> retiredNodes;
 
 	//Autodiscovery stuff
-	PeriodicTimer discoveryTimer;
+	DiscoveryScheduler discovery;
+
+	PeriodicTimer queueTimer;
+
+	PeriodicTimer livenessTimer;
+
+	//Set on asyncThread by loadState(), empty while nothing is persisted
+	std::string statePath;
+
+	//A light's state or the topology changed since the last save
+	std::atomic<bool> stateDirty;
+	PeriodicTimer stateTimer;
+
+	//Snapshots are written here, a slow disk must not stall asyncThread
+	boost::asio::io_service stateService;
+	std::unique_ptr<boost::asio::io_service::work> stateWork;
+	std::atomic<bool> stateWriting;
+	std::thread stateThread;
+
+	PeriodicTimer refreshTimer;
 };
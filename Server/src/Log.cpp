@@ -0,0 +1,548 @@
+#include "Log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+const char Log::BINARY_MAGIC[8] = {'A', 'H', 'L', 'O', 'G', '0', '0', '1'};
+
+atomic<Log::Level> Log::runtimeLevel{Log::Level::Info};
+
+//Single-producer/single-consumer ring owned by one logging thread
+class Log::Ring {
+public:
+	static constexpr size_t CAPACITY = 1024;
+
+	Ring(uint32_t _thread)
+		:	thread{_thread}
+		,	dropped{0}
+		,	closed{false}
+		,	head{0}
+		,	tail{0} {
+	}
+
+	//Producer side
+	Record* acquire() {
+		auto h = head.load(memory_order_relaxed);
+
+		if( (h - tail.load(memory_order_acquire)) >= CAPACITY ) {
+			return nullptr;
+		}
+
+		return &slots[h % CAPACITY];
+	}
+
+	void commit() {
+		head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	//Consumer side
+	bool pop(Record& record) {
+		auto t = tail.load(memory_order_relaxed);
+
+		if(t == head.load(memory_order_acquire)) {
+			return false;
+		}
+
+		record = slots[t % CAPACITY];
+		tail.store(t + 1, memory_order_release);
+
+		return true;
+	}
+
+	const uint32_t thread;
+	atomic<uint64_t> dropped;
+	atomic<bool> closed;
+
+private:
+	array<Record, CAPACITY> slots;
+
+	alignas(64) atomic<size_t> head;
+	alignas(64) atomic<size_t> tail;
+};
+
+namespace {
+
+//Frees any strings that were too long to be stored inline
+void releaseHeapStrings(Log::Record& record) {
+	size_t i = 0;
+
+	while(i < record.length) {
+		auto tag = static_cast<Log::Tag>(record.payload[i++]);
+
+		switch(tag) {
+			case Log::Tag::String:
+				i += 1 + record.payload[i];
+			break;
+
+			case Log::Tag::HeapString: {
+				string* str;
+				memcpy(&str, &record.payload[i], sizeof(str));
+				delete str;
+				i += sizeof(str);
+			}
+			break;
+
+			case Log::Tag::Bool:
+				i += 1;
+			break;
+
+			default:
+				i += 8;
+			break;
+		}
+	}
+
+	record.length = 0;
+}
+
+//Copies the payload into out, replacing heap strings with inline blobs
+void flatten(const Log::Record& record, string& out) {
+	out.clear();
+
+	size_t i = 0;
+	while(i < record.length) {
+		auto tag = static_cast<Log::Tag>(record.payload[i]);
+
+		if(tag == Log::Tag::HeapString) {
+			string* str;
+			memcpy(&str, &record.payload[i+1], sizeof(str));
+
+			uint32_t size = str->size();
+			out.push_back(static_cast<char>(Log::Tag::Blob));
+			out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+			out.append(*str);
+
+			i += 1 + sizeof(str);
+		}
+		else {
+			size_t size;
+			switch(tag) {
+				case Log::Tag::String:
+					size = 2 + record.payload[i+1];
+				break;
+
+				case Log::Tag::Bool:
+					size = 2;
+				break;
+
+				default:
+					size = 9;
+				break;
+			}
+
+			out.append(reinterpret_cast<const char*>(&record.payload[i]), size);
+			i += size;
+		}
+	}
+}
+
+uint64_t now() {
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class Writer {
+public:
+	Writer()
+		:	running{true}
+		,	binaryFile{nullptr}
+		,	nextThread{0} {
+
+		thread = std::thread([this]() { threadRoutine(); });
+	}
+
+	~Writer() {
+		{
+			lock_guard<mutex> stateLock(stateMutex);
+			running = false;
+		}
+		cv.notify_all();
+		thread.join();
+
+		drain();
+
+		if(binaryFile != nullptr) {
+			fclose(binaryFile);
+		}
+	}
+
+	shared_ptr<Log::Ring> registerThread() {
+		lock_guard<mutex> ringLock(ringMutex);
+
+		rings.push_back(make_shared<Log::Ring>(nextThread++));
+
+		return rings.back();
+	}
+
+	void setBinaryOutput(const string& path) {
+		lock_guard<mutex> drainLock(drainMutex);
+
+		auto file = fopen(path.c_str(), "wb");
+		if(file == nullptr) {
+			throw runtime_error("Log::setBinaryOutput: Unable to open " + path);
+		}
+		fwrite(Log::BINARY_MAGIC, 1, sizeof(Log::BINARY_MAGIC), file);
+
+		if(binaryFile != nullptr) {
+			fclose(binaryFile);
+		}
+		binaryFile = file;
+	}
+
+	void drain() {
+		lock_guard<mutex> drainLock(drainMutex);
+
+		vector<shared_ptr<Log::Ring>> active;
+		{
+			lock_guard<mutex> ringLock(ringMutex);
+			active = rings;
+		}
+
+		batch.clear();
+		for(auto& ring : active) {
+			bool closed = ring->closed.load(memory_order_acquire);
+
+			Log::Record record;
+			while(ring->pop(record)) {
+				batch.push_back(record);
+			}
+
+			auto dropped = ring->dropped.exchange(0);
+			if(dropped > 0) {
+				fprintf(stderr, "[Warning] Log: Dropped %llu records from thread T%u\n",
+					static_cast<unsigned long long>(dropped), ring->thread);
+			}
+
+			if(closed) {
+				lock_guard<mutex> ringLock(ringMutex);
+				rings.erase(find(rings.begin(), rings.end(), ring));
+			}
+		}
+
+		stable_sort(batch.begin(), batch.end(), [](const Log::Record& a, const Log::Record& b) {
+			return a.timestamp < b.timestamp;
+		});
+
+		for(auto& record : batch) {
+			flatten(record, flat);
+			releaseHeapStrings(record);
+
+			if(binaryFile != nullptr) {
+				writeBinary(record, flat);
+			}
+			else {
+				auto text = Log::format(record.timestamp, record.level, record.thread,
+					reinterpret_cast<const uint8_t*>(flat.data()), flat.size(), record.flags);
+				text.push_back('\n');
+
+				fwrite(text.data(), 1, text.size(),
+					(record.level >= Log::Level::Warning) ? stderr : stdout);
+			}
+		}
+
+		if(!batch.empty()) {
+			fflush((binaryFile != nullptr) ? binaryFile : stdout);
+		}
+	}
+
+private:
+	void threadRoutine() {
+		unique_lock<mutex> stateLock(stateMutex);
+
+		while(running) {
+			cv.wait_for(stateLock, chrono::milliseconds(10));
+
+			stateLock.unlock();
+			drain();
+			stateLock.lock();
+		}
+	}
+
+	//Record layout: uint64 timestamp, uint32 thread, uint8 level, uint8 flags,
+	//uint32 payload length, payload (native byte order)
+	void writeBinary(const Log::Record& record, const string& payload) {
+		uint32_t length = payload.size();
+
+		fwrite(&record.timestamp, sizeof(record.timestamp), 1, binaryFile);
+		fwrite(&record.thread, sizeof(record.thread), 1, binaryFile);
+		fwrite(&record.level, sizeof(record.level), 1, binaryFile);
+		fwrite(&record.flags, sizeof(record.flags), 1, binaryFile);
+		fwrite(&length, sizeof(length), 1, binaryFile);
+		fwrite(payload.data(), 1, payload.size(), binaryFile);
+	}
+
+	bool running;
+	mutex stateMutex;
+	condition_variable cv;
+	std::thread thread;
+
+	mutex drainMutex;
+	FILE* binaryFile;
+	vector<Log::Record> batch;
+	string flat;
+
+	mutex ringMutex;
+	vector<shared_ptr<Log::Ring>> rings;
+	uint32_t nextThread;
+};
+
+Writer& writer() {
+	static Writer w;
+
+	return w;
+}
+
+struct RingHandle {
+	RingHandle()
+		:	ring{writer().registerThread()} {
+	}
+
+	~RingHandle() {
+		ring->closed.store(true, memory_order_release);
+	}
+
+	shared_ptr<Log::Ring> ring;
+};
+
+Log::Ring& localRing() {
+	thread_local RingHandle handle;
+
+	return *handle.ring;
+}
+
+//Scratch record used when the ring is full
+thread_local Log::Record overflowRecord;
+
+} //namespace
+
+Log::Line::Line(Level level)
+	:	ring{&localRing()}
+	,	record{ring->acquire()} {
+
+	if(record == nullptr) {
+		record = &overflowRecord;
+	}
+
+	record->timestamp = now();
+	record->thread = ring->thread;
+	record->level = level;
+	record->flags = 0;
+	record->length = 0;
+}
+
+Log::Line::~Line() {
+	if(record == &overflowRecord) {
+		releaseHeapStrings(*record);
+		ring->dropped.fetch_add(1, memory_order_relaxed);
+	}
+	else {
+		ring->commit();
+	}
+}
+
+Log::Line& Log::Line::operator<<(const char* str) {
+	putString(str, strlen(str));
+
+	return *this;
+}
+
+Log::Line& Log::Line::operator<<(const string& str) {
+	putString(str.data(), str.size());
+
+	return *this;
+}
+
+Log::Line& Log::Line::operator<<(char c) {
+	putString(&c, 1);
+
+	return *this;
+}
+
+Log::Line& Log::Line::operator<<(bool b) {
+	uint8_t v = b;
+	put(Tag::Bool, &v, sizeof(v));
+
+	return *this;
+}
+
+Log::Line& Log::Line::operator<<(double d) {
+	put(Tag::Double, &d, sizeof(d));
+
+	return *this;
+}
+
+void Log::Line::put(Tag tag, const void* data, size_t size) {
+	auto& r = *record;
+
+	if( (r.length + 1 + size) > r.payload.size() ) {
+		r.flags |= Record::FLAG_TRUNCATED;
+		return;
+	}
+
+	r.payload[r.length++] = static_cast<uint8_t>(tag);
+	memcpy(&r.payload[r.length], data, size);
+	r.length += size;
+}
+
+void Log::Line::putString(const char* str, size_t size) {
+	auto& r = *record;
+	size_t remaining = r.payload.size() - r.length;
+
+	if( (size <= 0xFF) && ((2 + size) <= remaining) ) {
+		r.payload[r.length++] = static_cast<uint8_t>(Tag::String);
+		r.payload[r.length++] = size;
+		memcpy(&r.payload[r.length], str, size);
+		r.length += size;
+	}
+	else if( (1 + sizeof(string*)) <= remaining ) {
+		//Too long to store inline, pay for an allocation instead
+		auto heapStr = new string(str, size);
+		put(Tag::HeapString, &heapStr, sizeof(heapStr));
+	}
+	else {
+		r.flags |= Record::FLAG_TRUNCATED;
+	}
+}
+
+void Log::setLevel(Level level) {
+	runtimeLevel.store(level, memory_order_relaxed);
+}
+
+Log::Level Log::getLevel() {
+	return runtimeLevel.load(memory_order_relaxed);
+}
+
+Log::Level Log::parseLevel(const string& name) {
+	for(auto level : {Level::Debug, Level::Info, Level::Warning, Level::Error, Level::None}) {
+		auto levelName = toString(level);
+		if(equal(name.begin(), name.end(), levelName.begin(), levelName.end(),
+			[](char a, char b) { return tolower(a) == tolower(b); })) {
+			return level;
+		}
+	}
+
+	throw invalid_argument("Log::parseLevel: Unknown level: " + name);
+}
+
+string Log::toString(Level level) {
+	switch(level) {
+		case Level::Debug:
+			return "Debug";
+		case Level::Info:
+			return "Info";
+		case Level::Warning:
+			return "Warning";
+		case Level::Error:
+			return "Error";
+		default:
+			return "None";
+	}
+}
+
+void Log::setBinaryOutput(const string& path) {
+	writer().setBinaryOutput(path);
+}
+
+void Log::flush() {
+	writer().drain();
+}
+
+string Log::format(uint64_t timestamp, Level level, uint32_t thread,
+	const uint8_t* payload, size_t length, uint8_t flags) {
+
+	time_t seconds = timestamp / 1000000000;
+	tm local;
+	localtime_r(&seconds, &local);
+
+	char prefix[64];
+	auto prefixLength = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+	snprintf(prefix + prefixLength, sizeof(prefix) - prefixLength, ".%06u T%u ",
+		static_cast<unsigned>((timestamp % 1000000000) / 1000), thread);
+
+	string str = string(prefix) + "[" + toString(level) + "] ";
+
+	size_t i = 0;
+	while(i < length) {
+		auto tag = static_cast<Tag>(payload[i++]);
+		size_t remaining = length - i;
+
+		switch(tag) {
+			case Tag::String:
+				if( (remaining < 1) || (remaining < (1u + payload[i])) ) {
+					return str + "<corrupt>";
+				}
+				str.append(reinterpret_cast<const char*>(payload + i + 1), payload[i]);
+				i += 1 + payload[i];
+			break;
+
+			case Tag::Blob: {
+				uint32_t size;
+				if(remaining < sizeof(size)) {
+					return str + "<corrupt>";
+				}
+				memcpy(&size, payload + i, sizeof(size));
+				if( (remaining - sizeof(size)) < size ) {
+					return str + "<corrupt>";
+				}
+				str.append(reinterpret_cast<const char*>(payload + i + sizeof(size)), size);
+				i += sizeof(size) + size;
+			}
+			break;
+
+			case Tag::Int:
+			case Tag::UInt:
+			case Tag::Double: {
+				if(remaining < 8) {
+					return str + "<corrupt>";
+				}
+
+				char number[32];
+				if(tag == Tag::Int) {
+					int64_t v;
+					memcpy(&v, payload + i, sizeof(v));
+					snprintf(number, sizeof(number), "%lld", static_cast<long long>(v));
+				}
+				else if(tag == Tag::UInt) {
+					uint64_t v;
+					memcpy(&v, payload + i, sizeof(v));
+					snprintf(number, sizeof(number), "%llu", static_cast<unsigned long long>(v));
+				}
+				else {
+					double v;
+					memcpy(&v, payload + i, sizeof(v));
+					snprintf(number, sizeof(number), "%g", v);
+				}
+				str += number;
+				i += 8;
+			}
+			break;
+
+			case Tag::Bool:
+				if(remaining < 1) {
+					return str + "<corrupt>";
+				}
+				str += payload[i] ? "true" : "false";
+				i += 1;
+			break;
+
+			default:
+				return str + "<corrupt>";
+		}
+	}
+
+	if(flags & Record::FLAG_TRUNCATED) {
+		str += "...";
+	}
+
+	return str;
+}
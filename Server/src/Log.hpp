@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <type_traits>
+
+//Levels below LOG_COMPILE_LEVEL are removed at compile time
+//(0 = Debug, 1 = Info, 2 = Warning, 3 = Error)
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
+//Usage: LOG_INFO("LightHub::discover: Found " << count << " nodes");
+//The arguments are only evaluated if the level is enabled
+#define LOG(level, msg) \
+	do { \
+		if(Log::isCompiled(level) && Log::isEnabled(level)) { \
+			Log::Line{level} << msg; \
+		} \
+	} while(0)
+
+#define LOG_DEBUG(msg) LOG(Log::Level::Debug, msg)
+#define LOG_INFO(msg) LOG(Log::Level::Info, msg)
+#define LOG_WARNING(msg) LOG(Log::Level::Warning, msg)
+#define LOG_ERROR(msg) LOG(Log::Level::Error, msg)
+
+//Asynchronous logger
+//Each thread appends fixed-size records to its own lock-free ring buffer.
+//Arguments are stored as tagged binary values; formatting and I/O happen on
+//a background writer thread, which either prints text or dumps the raw
+//records to a binary file (see tools/LogDecode.cpp).
+class Log {
+public:
+	enum class Level : uint8_t {
+		Debug = 0,
+		Info,
+		Warning,
+		Error,
+		None
+	};
+
+	enum class Tag : uint8_t {
+		String = 0,	//uint8_t length, bytes
+		Blob,				//uint32_t length, bytes (binary files only)
+		HeapString,	//std::string* (in-memory records only)
+		Int,				//int64_t
+		UInt,				//uint64_t
+		Double,			//double
+		Bool				//uint8_t
+	};
+
+	struct Record {
+		static constexpr size_t SIZE = 256;
+		static constexpr uint8_t FLAG_TRUNCATED = 0x01;
+
+		uint64_t timestamp; //Nanoseconds since epoch
+		uint32_t thread;
+		Level level;
+		uint8_t flags;
+		uint16_t length;
+		std::array<uint8_t, SIZE - 16> payload;
+	};
+
+	class Ring;
+
+	class Line {
+	public:
+		Line(Level);
+		~Line();
+
+		Line(const Line&) = delete;
+		Line& operator=(const Line&) = delete;
+
+		Line& operator<<(const char*);
+		Line& operator<<(const std::string&);
+		Line& operator<<(char);
+		Line& operator<<(bool);
+		Line& operator<<(double);
+
+		template<class T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+		Line& operator<<(T value) {
+			if(std::is_signed<T>::value) {
+				int64_t v = value;
+				put(Tag::Int, &v, sizeof(v));
+			}
+			else {
+				uint64_t v = value;
+				put(Tag::UInt, &v, sizeof(v));
+			}
+
+			return *this;
+		}
+
+	private:
+		void put(Tag, const void* data, size_t size);
+		void putString(const char* str, size_t size);
+
+		Ring* ring;
+		Record* record;
+	};
+
+	static constexpr bool isCompiled(Level level) {
+		return (static_cast<int>(level) + 1) > LOG_COMPILE_LEVEL;
+	}
+
+	static bool isEnabled(Level level) {
+		return level >= runtimeLevel.load(std::memory_order_relaxed);
+	}
+
+	static void setLevel(Level);
+	static Level getLevel();
+
+	//Throws std::invalid_argument for unknown names
+	static Level parseLevel(const std::string& name);
+	static std::string toString(Level);
+
+	//Switches the writer from text on stdout/stderr to binary records
+	static void setBinaryOutput(const std::string& path);
+
+	//Blocks until everything logged so far has been written
+	static void flush();
+
+	//Shared by the writer thread and the offline decoder
+	static std::string format(uint64_t timestamp, Level level, uint32_t thread,
+		const uint8_t* payload, size_t length, uint8_t flags);
+
+	static const char BINARY_MAGIC[8];
+
+private:
+	static std::atomic<Level> runtimeLevel;
+};
@@ -0,0 +1,158 @@
+#include "LoopMonitor.hpp"
+
+#include <ctime>
+
+#include "Log.hpp"
+
+using namespace boost::asio;
+
+namespace {
+	//The monitor whose run() is on this thread
+	thread_local LoopMonitor* currentMonitor = nullptr;
+
+	//A handler may run others inline through dispatch()
+	thread_local unsigned handlerDepth = 0;
+	thread_local std::chrono::steady_clock::time_point handlerStart;
+}
+
+void HandlerTracking::begin() {
+	if( (currentMonitor != nullptr) && (handlerDepth++ == 0) ) {
+		handlerStart = std::chrono::steady_clock::now();
+	}
+}
+
+void HandlerTracking::end() {
+	if( (currentMonitor != nullptr) && (handlerDepth > 0) && (--handlerDepth == 0) ) {
+		currentMonitor->recordHandler(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - handlerStart).count());
+	}
+}
+
+LoopMonitor::LoopMonitor(io_service& _ioService, const std::string& _name,
+	std::chrono::milliseconds _period)
+	:	ioService{_ioService}
+	,	name{_name}
+	,	period{_period}
+	,	timer{ioService}
+	,	lastReport{std::chrono::steady_clock::now()}
+	,	running{true}
+	,	handlersRun{0}
+	,	windowLag{std::make_unique<Metrics::Histogram>()}
+	,	windowHandlerTime{std::make_unique<Metrics::Histogram>()}
+	,	windowHandlerCpu{std::make_unique<Metrics::Histogram>()}
+	,	lag(Metrics::histogram("alexahub_loop_lag_seconds",
+			"How late the event loop ran a due timer", "loop=\"" + name + "\""))
+	,	handlerTime(Metrics::histogram("alexahub_loop_handler_seconds",
+			"Wall clock time spent in each event loop handler", "loop=\"" + name + "\""))
+	,	handlerCpu(Metrics::histogram("alexahub_loop_handler_cpu_seconds",
+			"CPU time spent in each event loop handler", "loop=\"" + name + "\""))
+	,	queueDepth(Metrics::gauge("alexahub_loop_queue_depth",
+			"Handlers that ran ahead of the last probe", "loop=\"" + name + "\""))
+	,	handlers(Metrics::counter("alexahub_loop_handlers_total",
+			"Event loop handlers run", "loop=\"" + name + "\"")) {
+
+	timer.expires_from_now(period);
+	startTimer();
+}
+
+LoopMonitor::~LoopMonitor() {
+	running = false;
+	timer.cancel();
+}
+
+void LoopMonitor::run() {
+	currentMonitor = this;
+
+	//run_one() also blocks while idle, which costs no CPU time, so the
+	//thread CPU clock isolates the handler itself. Its wall time is taken
+	//by the HandlerTracking hooks, around the handler alone.
+	for(;;) {
+		auto start = threadCpuTime();
+		handlerDepth = 0;
+
+		if(ioService.run_one() == 0) {
+			break;
+		}
+
+		auto cpu = threadCpuTime() - start;
+		handlerCpu.record(cpu);
+		windowHandlerCpu->record(cpu);
+
+		handlers.inc();
+		++handlersRun;
+	}
+
+	currentMonitor = nullptr;
+}
+
+void LoopMonitor::recordHandler(uint64_t ns) {
+	handlerTime.record(ns);
+	windowHandlerTime->record(ns);
+}
+
+void LoopMonitor::startTimer() {
+	timer.async_wait([this](const boost::system::error_code& error) {
+		cbTimer(error);
+	});
+}
+
+void LoopMonitor::cbTimer(const boost::system::error_code& error) {
+	if(error == error::operation_aborted) {
+		return;
+	}
+	else if(error) {
+		LOG_ERROR("LoopMonitor::cbTimer: " << error.message());
+	}
+	else {
+		auto now = std::chrono::steady_clock::now();
+		auto late = std::chrono::duration_cast<std::chrono::nanoseconds>(now - timer.expires_at());
+
+		lag.record(late.count());
+		windowLag->record(late.count());
+
+		//Everything that runs before the probe, apart from this handler,
+		//was already queued ahead of it
+		ioService.post([this, posted = handlersRun + 1]() {
+			queueDepth.set(handlersRun - posted);
+		});
+
+		if( (now - lastReport) >= REPORT_PERIOD ) {
+			report();
+			lastReport = now;
+		}
+	}
+
+	if(running) {
+		//Fixed schedule, so a stall shows up as lag instead of drift
+		timer.expires_at(timer.expires_at() + period);
+		startTimer();
+	}
+}
+
+void LoopMonitor::report() {
+	auto us = [](uint64_t ns) {
+		return ns/1000;
+	};
+
+	auto max = windowLag->max();
+	auto p50 = windowLag->percentile(0.5), p99 = windowLag->percentile(0.99);
+
+	auto level = (std::chrono::nanoseconds(max) > LAG_WARNING) ? Log::Level::Warning
+		: Log::Level::Debug;
+
+	LOG(level, "LoopMonitor: " << name << " loop lag p50 " << us(p50) << "us, p99 " << us(p99)
+		<< "us, max " << us(max) << "us, handler p99 " << us(windowHandlerTime->percentile(0.99))
+		<< "us (CPU " << us(windowHandlerCpu->percentile(0.99)) << "us), max "
+		<< us(windowHandlerTime->max()) << "us");
+
+	windowLag = std::make_unique<Metrics::Histogram>();
+	windowHandlerTime = std::make_unique<Metrics::Histogram>();
+	windowHandlerCpu = std::make_unique<Metrics::Histogram>();
+}
+
+uint64_t LoopMonitor::threadCpuTime() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return static_cast<uint64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "HandlerTracking.hpp"
+#include "Metrics.hpp"
+
+//Runs an io_service and samples how healthy its event loop is
+//	lag			How late a periodic timer fires, i.e. how long a ready
+//				handler waits behind the one currently running
+//	queue depth	Handlers that ran between posting a probe and running it
+//	handler		Wall clock and CPU time spent in each handler. Only the wall
+//				time shows a handler that blocks, in fsync() or a sleep.
+//Exported as alexahub_loop_*{loop="<name>"} and summarised in the log
+//once per report period.
+class LoopMonitor {
+public:
+	LoopMonitor(boost::asio::io_service& ioService, const std::string& name,
+		std::chrono::milliseconds period = std::chrono::milliseconds(100));
+	~LoopMonitor();
+
+	//Replaces io_service::run(), returns when the io_service stops
+	void run();
+
+private:
+	const std::chrono::seconds REPORT_PERIOD{60};
+
+	//A window with a larger maximum lag is reported as a warning
+	const std::chrono::milliseconds LAG_WARNING{50};
+
+	void startTimer();
+	void cbTimer(const boost::system::error_code& error);
+	void report();
+
+	static uint64_t threadCpuTime();
+
+	friend void HandlerTracking::end();
+	void recordHandler(uint64_t ns);
+
+	boost::asio::io_service& ioService;
+	std::string name;
+	std::chrono::milliseconds period;
+
+	boost::asio::steady_timer timer;
+	std::chrono::steady_clock::time_point lastReport;
+	bool running;
+
+	//Only touched on the loop thread
+	uint64_t handlersRun;
+	std::unique_ptr<Metrics::Histogram> windowLag, windowHandlerTime, windowHandlerCpu;
+
+	Metrics::Histogram& lag;
+	Metrics::Histogram& handlerTime;
+	Metrics::Histogram& handlerCpu;
+	Metrics::Gauge& queueDepth;
+	Metrics::Counter& handlers;
+};
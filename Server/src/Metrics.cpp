@@ -0,0 +1,264 @@
+#include "Metrics.hpp"
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+namespace {
+
+template<class T>
+struct Family {
+	string help;
+	map<string, unique_ptr<T>> metrics;
+};
+
+struct Registry {
+	mutex registryMutex;
+
+	map<string, Family<Metrics::Counter>> counters;
+	map<string, Family<Metrics::Gauge>> gauges;
+	map<string, Family<Metrics::Histogram>> histograms;
+};
+
+Registry& registry() {
+	static Registry r;
+
+	return r;
+}
+
+template<class T>
+T& lookup(map<string, Family<T>>& families, const string& name, const string& help,
+	const string& labels) {
+	lock_guard<mutex> registryLock(registry().registryMutex);
+
+	auto& family = families[name];
+	if(family.help.empty()) {
+		family.help = help;
+	}
+
+	auto& metric = family.metrics[labels];
+	if(!metric) {
+		metric = make_unique<T>();
+	}
+
+	return *metric;
+}
+
+size_t shardIndex(size_t shards) {
+	static atomic<size_t> nextShard{0};
+	thread_local size_t index = nextShard.fetch_add(1, memory_order_relaxed);
+
+	return index % shards;
+}
+
+string withLabels(const string& name, const string& labels, const string& extra = "") {
+	if(labels.empty() && extra.empty()) {
+		return name;
+	}
+	else if(labels.empty() || extra.empty()) {
+		return name + "{" + labels + extra + "}";
+	}
+	else {
+		return name + "{" + labels + "," + extra + "}";
+	}
+}
+
+//Histogram buckets exported to Prometheus, in seconds
+const double EXPORT_BUCKETS[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+	1e-3, 2.5e-3, 5e-3, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+} //namespace
+
+Metrics::Counter::Counter() {
+	for(auto& shard : shards) {
+		shard.value = 0;
+	}
+}
+
+void Metrics::Counter::inc(uint64_t n) {
+	shards[shardIndex(SHARDS)].value.fetch_add(n, memory_order_relaxed);
+}
+
+uint64_t Metrics::Counter::value() const {
+	uint64_t sum = 0;
+
+	for(const auto& shard : shards) {
+		sum += shard.value.load(memory_order_relaxed);
+	}
+
+	return sum;
+}
+
+Metrics::Gauge::Gauge()
+	:	v{0} {
+}
+
+void Metrics::Gauge::set(int64_t value) {
+	v.store(value, memory_order_relaxed);
+}
+
+void Metrics::Gauge::add(int64_t value) {
+	v.fetch_add(value, memory_order_relaxed);
+}
+
+int64_t Metrics::Gauge::value() const {
+	return v.load(memory_order_relaxed);
+}
+
+Metrics::Histogram::Histogram()
+	:	total{0}
+	,	totalSum{0}
+	,	maximum{0} {
+	for(auto& bucket : buckets) {
+		bucket = 0;
+	}
+}
+
+void Metrics::Histogram::record(uint64_t ns) {
+	buckets[bucketIndex(ns)].fetch_add(1, memory_order_relaxed);
+	total.fetch_add(1, memory_order_relaxed);
+	totalSum.fetch_add(ns, memory_order_relaxed);
+
+	auto currentMax = maximum.load(memory_order_relaxed);
+	while( (ns > currentMax)
+		&& !maximum.compare_exchange_weak(currentMax, ns, memory_order_relaxed) ) {
+	}
+}
+
+uint64_t Metrics::Histogram::count() const {
+	return total.load(memory_order_relaxed);
+}
+
+uint64_t Metrics::Histogram::sum() const {
+	return totalSum.load(memory_order_relaxed);
+}
+
+uint64_t Metrics::Histogram::max() const {
+	return maximum.load(memory_order_relaxed);
+}
+
+uint64_t Metrics::Histogram::percentile(double p) const {
+	uint64_t n = count();
+	if(n == 0) {
+		return 0;
+	}
+
+	uint64_t rank = p*n + 0.5;
+	if(rank < 1) {
+		rank = 1;
+	}
+
+	uint64_t cumulative = 0;
+	for(size_t i = 0; i < BUCKETS; ++i) {
+		cumulative += buckets[i].load(memory_order_relaxed);
+
+		if(cumulative >= rank) {
+			return std::min(bucketUpper(i), max());
+		}
+	}
+
+	return max();
+}
+
+uint64_t Metrics::Histogram::countBelow(uint64_t ns) const {
+	uint64_t cumulative = 0;
+
+	for(size_t i = 0; (i < BUCKETS) && (bucketUpper(i) <= ns); ++i) {
+		cumulative += buckets[i].load(memory_order_relaxed);
+	}
+
+	return cumulative;
+}
+
+size_t Metrics::Histogram::bucketIndex(uint64_t value) {
+	if(value < SUB_BUCKETS) {
+		return value;
+	}
+
+	int exponent = 63 - __builtin_clzll(value);
+	size_t sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+	return (exponent - SUB_BUCKET_BITS + 1)*SUB_BUCKETS + sub;
+}
+
+uint64_t Metrics::Histogram::bucketLower(size_t index) {
+	if(index < SUB_BUCKETS) {
+		return index;
+	}
+
+	int exponent = index/SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	uint64_t sub = index % SUB_BUCKETS;
+
+	return (SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS);
+}
+
+uint64_t Metrics::Histogram::bucketUpper(size_t index) {
+	if(index + 1 >= BUCKETS) {
+		return UINT64_MAX;
+	}
+
+	return bucketLower(index + 1) - 1;
+}
+
+Metrics::Counter& Metrics::counter(const string& name, const string& help,
+	const string& labels) {
+	return lookup(registry().counters, name, help, labels);
+}
+
+Metrics::Gauge& Metrics::gauge(const string& name, const string& help,
+	const string& labels) {
+	return lookup(registry().gauges, name, help, labels);
+}
+
+Metrics::Histogram& Metrics::histogram(const string& name, const string& help,
+	const string& labels) {
+	return lookup(registry().histograms, name, help, labels);
+}
+
+void Metrics::exportPrometheus(ostream& out) {
+	auto& r = registry();
+	lock_guard<mutex> registryLock(r.registryMutex);
+
+	for(const auto& family : r.counters) {
+		out << "# HELP " << family.first << " " << family.second.help << "\n"
+			<< "# TYPE " << family.first << " counter\n";
+
+		for(const auto& metric : family.second.metrics) {
+			out << withLabels(family.first, metric.first) << " " << metric.second->value() << "\n";
+		}
+	}
+
+	for(const auto& family : r.gauges) {
+		out << "# HELP " << family.first << " " << family.second.help << "\n"
+			<< "# TYPE " << family.first << " gauge\n";
+
+		for(const auto& metric : family.second.metrics) {
+			out << withLabels(family.first, metric.first) << " " << metric.second->value() << "\n";
+		}
+	}
+
+	for(const auto& family : r.histograms) {
+		out << "# HELP " << family.first << " " << family.second.help << "\n"
+			<< "# TYPE " << family.first << " histogram\n";
+
+		for(const auto& metric : family.second.metrics) {
+			const auto& h = *metric.second;
+			auto count = h.count();
+
+			for(auto le : EXPORT_BUCKETS) {
+				char bound[32];
+				snprintf(bound, sizeof(bound), "le=\"%g\"", le);
+
+				out << withLabels(family.first + "_bucket", metric.first, bound) << " "
+					<< h.countBelow(static_cast<uint64_t>(le*1e9)) << "\n";
+			}
+			out << withLabels(family.first + "_bucket", metric.first, "le=\"+Inf\"") << " "
+				<< count << "\n";
+			out << withLabels(family.first + "_sum", metric.first) << " " << h.sum()/1e9 << "\n";
+			out << withLabels(family.first + "_count", metric.first) << " " << count << "\n";
+		}
+	}
+}
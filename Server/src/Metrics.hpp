@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+//Process-wide registry of counters, gauges and latency histograms
+//Metrics are registered once (under a lock) and live for the lifetime of
+//the process, so callers cache the returned reference. Updates are
+//lock-free. Labels are given in Prometheus syntax, e.g. "node=\"10.0.0.5\"".
+class Metrics {
+public:
+	//Monotonic counter, sharded per thread so concurrent increments never
+	//contend on the same cache line
+	class Counter {
+	public:
+		Counter();
+
+		void inc(uint64_t n = 1);
+		uint64_t value() const;
+
+	private:
+		static constexpr size_t SHARDS = 16;
+
+		struct alignas(64) Shard {
+			std::atomic<uint64_t> value;
+		};
+
+		std::array<Shard, SHARDS> shards;
+	};
+
+	class Gauge {
+	public:
+		Gauge();
+
+		void set(int64_t);
+		void add(int64_t);
+		int64_t value() const;
+
+	private:
+		std::atomic<int64_t> v;
+	};
+
+	//HDR-style log-linear histogram of nanosecond values
+	//16 linear sub-buckets per power of two, so percentiles are reported
+	//with at most 1/16 relative error
+	class Histogram {
+	public:
+		Histogram();
+
+		void record(uint64_t ns);
+
+		uint64_t count() const;
+		uint64_t sum() const;
+		uint64_t max() const;
+
+		//p in [0, 1], returns the upper bound of the bucket holding it
+		uint64_t percentile(double p) const;
+
+		//Number of recorded values <= ns (rounded to bucket boundaries)
+		uint64_t countBelow(uint64_t ns) const;
+
+		static constexpr int SUB_BUCKET_BITS = 4;
+		static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+		static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+		static size_t bucketIndex(uint64_t value);
+		static uint64_t bucketLower(size_t index);
+		static uint64_t bucketUpper(size_t index);
+
+	private:
+		std::array<std::atomic<uint64_t>, BUCKETS> buckets;
+		std::atomic<uint64_t> total, totalSum, maximum;
+	};
+
+	static Counter& counter(const std::string& name, const std::string& help,
+		const std::string& labels = "");
+	static Gauge& gauge(const std::string& name, const std::string& help,
+		const std::string& labels = "");
+	static Histogram& histogram(const std::string& name, const std::string& help,
+		const std::string& labels = "");
+
+	//Prometheus text exposition format (version 0.0.4)
+	static void exportPrometheus(std::ostream&);
+};
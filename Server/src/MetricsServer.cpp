@@ -0,0 +1,105 @@
+#include "MetricsServer.hpp"
+
+#include <sstream>
+
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Probe.hpp"
+#include "Trace.hpp"
+
+using namespace boost::asio;
+
+struct MetricsServer::Session {
+	Session(io_service& ioService)
+		:	socket{ioService} {
+	}
+
+	ip::tcp::socket socket;
+	boost::asio::streambuf request;
+	std::string response;
+};
+
+MetricsServer::MetricsServer(io_service& _ioService, const ip::address& _address, uint16_t _port)
+	:	ioService{_ioService}
+	,	acceptor{ioService, ip::tcp::endpoint{_address, _port}} {
+
+	LOG_INFO("MetricsServer: Listening on " << _address.to_string() << ":" << getPort());
+
+	startAccept();
+}
+
+uint16_t MetricsServer::getPort() const {
+	return acceptor.local_endpoint().port();
+}
+
+void MetricsServer::startAccept() {
+	auto session = std::make_shared<Session>(ioService);
+
+	acceptor.async_accept(session->socket, [this, session](const boost::system::error_code& ec) {
+		if(ec) {
+			if(ec == error::operation_aborted) {
+				return;
+			}
+
+			LOG_ERROR("MetricsServer::handleAccept: " << ec.message());
+		}
+		else {
+			handleRequest(session);
+		}
+
+		startAccept();
+	});
+}
+
+void MetricsServer::handleRequest(std::shared_ptr<Session> session) {
+	async_read_until(session->socket, session->request, "\r\n\r\n",
+		[session](const boost::system::error_code& ec, size_t) {
+			if(ec) {
+				return;
+			}
+
+			std::string requestLine;
+			std::istream stream(&session->request);
+			std::getline(stream, requestLine);
+
+			session->response = respond(requestLine);
+
+			async_write(session->socket, buffer(session->response),
+				[session](const boost::system::error_code&, size_t) {
+					boost::system::error_code ignored;
+					session->socket.shutdown(ip::tcp::socket::shutdown_both, ignored);
+				});
+		});
+}
+
+std::string MetricsServer::respond(const std::string& requestLine) {
+	std::istringstream request(requestLine);
+	std::string method, path;
+	request >> method >> path;
+
+	std::ostringstream body;
+	std::string status = "200 OK", contentType;
+
+	if( (method == "GET") && (path == "/metrics") ) {
+		contentType = "text/plain; version=0.0.4";
+		Metrics::exportPrometheus(body);
+	}
+	else if( (method == "GET") && (path == "/trace") ) {
+		contentType = "application/json";
+		Trace::exportChrome(body);
+	}
+	else if( (method == "GET") && (path == "/probes") ) {
+		contentType = "text/plain";
+		Probe::dump(body);
+	}
+	else {
+		status = "404 Not Found";
+		contentType = "text/plain";
+		body << "Not found\n";
+	}
+
+	auto content = body.str();
+
+	return "HTTP/1.0 " + status + "\r\nContent-Type: " + contentType + "\r\nContent-Length: "
+		+ std::to_string(content.size()) + "\r\nConnection: close\r\n\r\n" + content;
+}
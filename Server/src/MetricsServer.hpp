@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include <boost/asio.hpp>
+
+//Minimal HTTP/1.0 endpoint for operational data
+//	GET /metrics	Prometheus text format
+//	GET /trace		Recorded traces in Chrome trace-event JSON
+//	GET /probes		Timing probe summary (make probes builds only)
+class MetricsServer {
+public:
+	MetricsServer(boost::asio::io_service& ioService, const boost::asio::ip::address& address,
+		uint16_t port);
+
+	uint16_t getPort() const;
+
+private:
+	struct Session;
+
+	void startAccept();
+	void handleRequest(std::shared_ptr<Session> session);
+
+	static std::string respond(const std::string& request);
+
+	boost::asio::io_service& ioService;
+	boost::asio::ip::tcp::acceptor acceptor;
+};
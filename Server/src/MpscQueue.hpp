@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+
+//Intrusive multi-producer single-consumer queue (Vyukov)
+//T needs a member std::atomic<T*> next and a default constructor. push()
+//is wait-free and may be called from any thread, pop() only from the
+//consumer. The queue never allocates: nodes are linked through their own
+//next pointer, and an internal stub node stands in when it runs empty.
+//pop() can briefly return nullptr while a producer is between its two
+//steps, so a producer should signal the consumer after push() returns.
+template<class T>
+class MpscQueue {
+public:
+	MpscQueue()
+		:	head{&stub}
+		,	tail{&stub} {
+		stub.next.store(nullptr, std::memory_order_relaxed);
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	void push(T* node) {
+		node->next.store(nullptr, std::memory_order_relaxed);
+
+		auto prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	T* pop() {
+		auto first = tail;
+		auto next = first->next.load(std::memory_order_acquire);
+
+		if(first == &stub) {
+			if(next == nullptr) {
+				return nullptr;
+			}
+
+			tail = next;
+			first = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+
+		if(next != nullptr) {
+			tail = next;
+			return first;
+		}
+
+		//first is the last node, unless a producer is still linking one after it
+		if(first != head.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+
+		push(&stub);
+
+		next = first->next.load(std::memory_order_acquire);
+		if(next != nullptr) {
+			tail = next;
+			return first;
+		}
+
+		return nullptr;
+	}
+
+private:
+	T stub;
+
+	alignas(64) std::atomic<T*> head;
+	alignas(64) T* tail;
+};
@@ -0,0 +1,41 @@
+#include "NodeLink.hpp"
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+
+using namespace boost::asio;
+
+NodeLink::NodeLink(io_service& ioService, const ip::udp::endpoint& _endpoint,
+	DatagramPool& pool, const UdpTransmitter::SentHandler& handler)
+	:	endpoint{_endpoint}
+	,	socket{connect(ioService, _endpoint)}
+	,	transmitter(socket, handler, pool)
+	,	queuedBytes(Metrics::gauge("alexahub_udp_node_send_queue_bytes",
+			"Bytes in a node's kernel send queue, sampled with SIOCOUTQ",
+			"node=\"" + _endpoint.address().to_string() + "\"")) {
+}
+
+const ip::udp::endpoint& NodeLink::getEndpoint() const {
+	return endpoint;
+}
+
+void NodeLink::send(UdpTransmitter::Datagram* datagram) {
+	transmitter.send(endpoint, datagram);
+}
+
+void NodeLink::sampleQueue() {
+	int bytes = 0;
+
+	if(ioctl(socket.native_handle(), SIOCOUTQ, &bytes) == 0) {
+		queuedBytes.set(bytes);
+	}
+}
+
+ip::udp::socket NodeLink::connect(io_service& ioService, const ip::udp::endpoint& endpoint) {
+	ip::udp::socket socket(ioService, endpoint.protocol());
+
+	socket.non_blocking(true);
+	socket.connect(endpoint);
+
+	return socket;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include "DatagramPool.hpp"
+#include "Metrics.hpp"
+#include "UdpTransmitter.hpp"
+
+//Connected UDP socket that carries one node's frames
+//Connecting resolves the route and neighbour once instead of on every
+//send, and gives the node its own kernel send queue, so an ICMP error
+//such as port unreachable is reported for this node alone and its
+//backlog can be read with SIOCOUTQ. Discovery stays on LightHub's shared
+//socket.
+class NodeLink {
+public:
+	//Throws boost::system::system_error if the socket cannot be opened or
+	//connected, e.g. out of file descriptors or no route to the node
+	NodeLink(boost::asio::io_service& ioService, const boost::asio::ip::udp::endpoint& endpoint,
+		DatagramPool& pool, const UdpTransmitter::SentHandler& handler);
+
+	NodeLink(const NodeLink&) = delete;
+	NodeLink& operator=(const NodeLink&) = delete;
+
+	const boost::asio::ip::udp::endpoint& getEndpoint() const;
+
+	//Safe to call from any thread, takes ownership of datagram
+	void send(UdpTransmitter::Datagram* datagram);
+
+	//Updates the send queue gauge from SIOCOUTQ
+	void sampleQueue();
+
+private:
+	static boost::asio::ip::udp::socket connect(boost::asio::io_service& ioService,
+		const boost::asio::ip::udp::endpoint& endpoint);
+
+	boost::asio::ip::udp::endpoint endpoint;
+	boost::asio::ip::udp::socket socket;
+	UdpTransmitter transmitter;
+
+	Metrics::Gauge& queuedBytes;
+};
@@ -2,6 +2,8 @@
 
 #include <stdexcept>
 
+#include "Probe.hpp"
+
 using namespace std;
 
 Packet::Packet(ID _id)
@@ -39,12 +41,43 @@ Packet Packet::NodeInfoResponse(uint8_t lightCount, const std::string& name) {
 	return p;
 }
 
+Packet Packet::NodeInfoResponseV2(uint8_t lightCount, uint32_t configHash,
+	const std::string& name) {
+	Packet p(ID::NodeInfoResponseV2);
+	p.payload.push_back(lightCount);
+
+	auto hashVec = pack32(configHash);
+	p.payload.insert(p.payload.end(), hashVec.begin(), hashVec.end());
+	p.payload.insert(p.payload.end(), name.begin(), name.end());
+
+	return p;
+}
+
+Packet Packet::NodeInfoResponseV3(uint8_t lightCount, uint32_t configHash, uint32_t bootID,
+	const std::string& name) {
+	Packet p(ID::NodeInfoResponseV3);
+	p.payload.push_back(lightCount);
+
+	auto hashVec = pack32(configHash);
+	p.payload.insert(p.payload.end(), hashVec.begin(), hashVec.end());
+
+	auto bootVec = pack32(bootID);
+	p.payload.insert(p.payload.end(), bootVec.begin(), bootVec.end());
+	p.payload.insert(p.payload.end(), name.begin(), name.end());
+
+	return p;
+}
+
 Packet Packet::LightInfo(uint8_t lightID) {
 	return {ID::LightInfo, lightID};
 }
 
 Packet Packet::LightInfoResponse(uint16_t ledCount, const std::string& name) {
-	Packet p(ID::LightInfoResponse);
+	return LightInfoResponse(0, ledCount, name);
+}
+
+Packet Packet::LightInfoResponse(uint8_t lightID, uint16_t ledCount, const std::string& name) {
+	Packet p(ID::LightInfoResponse, lightID);
 	
 	auto countVec = pack16(ledCount);
 	p.payload.insert(p.payload.end(), countVec.begin(), countVec.end());
@@ -54,6 +87,8 @@ Packet Packet::LightInfoResponse(uint16_t ledCount, const std::string& name) {
 }
 
 Packet Packet::UpdateColor(uint8_t lightID, const std::vector<Color>& leds) {
+	PROBE("Packet::UpdateColor");
+
 	Packet p{ID::UpdateColor, lightID};
 	p.payload.push_back(0x07); //Update H, S, V
 
@@ -66,6 +101,24 @@ Packet Packet::UpdateColor(uint8_t lightID, const std::vector<Color>& leds) {
 	return p;
 }
 
+size_t Packet::updateColorSize(size_t ledCount) {
+	return 3 + 3*ledCount;
+}
+
+void Packet::writeUpdateColor(uint8_t lightID, const std::vector<Color>& leds, uint8_t* out) {
+	PROBE("Packet::writeUpdateColor");
+
+	*out++ = lightID;
+	*out++ = static_cast<uint8_t>(ID::UpdateColor);
+	*out++ = 0x07; //Update H, S, V
+
+	for(const auto& led : leds) {
+		*out++ = led.getHue();
+		*out++ = led.getSat();
+		*out++ = led.getVal();
+	}
+}
+
 Packet::ID Packet::getID() const {
 	return id;
 }
@@ -87,6 +140,8 @@ vector<uint8_t>::iterator Packet::end() {
 }
 
 vector<uint8_t> Packet::asDatagram() const {
+	PROBE("Packet::asDatagram");
+
 	vector<uint8_t> datagram;
 	datagram.reserve(2 + payload.size());
 	
@@ -104,3 +159,12 @@ uint16_t Packet::parse16(vector<uint8_t>::const_iterator itr) {
 array<uint8_t, 2> Packet::pack16(uint16_t value) {
 	return {(value >> 8) & 0xFF, value & 0xFF};
 }
+
+uint32_t Packet::parse32(vector<uint8_t>::const_iterator itr) {
+	return (static_cast<uint32_t>(itr[0]) << 24) | (itr[1] << 16) | (itr[2] << 8) | itr[3];
+}
+
+array<uint8_t, 4> Packet::pack32(uint32_t value) {
+	return {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+		static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)};
+}
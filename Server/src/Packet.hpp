@@ -17,7 +17,15 @@ public:
 		TurnOn,
 		TurnOff,
 		UpdateColor,
-		ChangeBrightness
+		ChangeBrightness,
+
+		//NodeInfoResponse that also carries a hash of the node's light
+		//configuration (names and LED counts), which changes whenever it does
+		NodeInfoResponseV2,
+
+		//NodeInfoResponseV2 plus an id the node picks at every boot, so the hub
+		//notices a restart and resends what its lights were showing
+		NodeInfoResponseV3
 	};
 
 	Packet(ID);
@@ -27,10 +35,20 @@ public:
 	
 	static Packet NodeInfo();
 	static Packet NodeInfoResponse(uint8_t lightCount, const std::string& name);
+	static Packet NodeInfoResponseV2(uint8_t lightCount, uint32_t configHash,
+		const std::string& name);
+	static Packet NodeInfoResponseV3(uint8_t lightCount, uint32_t configHash, uint32_t bootID,
+		const std::string& name);
 	static Packet LightInfo(uint8_t lightID);
 	static Packet LightInfoResponse(uint16_t ledCount, const std::string& name);
+	static Packet LightInfoResponse(uint8_t lightID, uint16_t ledCount, const std::string& name);
 	static Packet UpdateColor(uint8_t lightID, const std::vector<Color>& leds);
 
+	//Encodes UpdateColor's datagram straight into out, which must hold
+	//updateColorSize(leds.size()) bytes
+	static size_t updateColorSize(size_t ledCount);
+	static void writeUpdateColor(uint8_t lightID, const std::vector<Color>& leds, uint8_t* out);
+
 	ID getID() const;
 	uint8_t getLightID() const;
 	std::vector<uint8_t> data() const;
@@ -43,6 +61,9 @@ public:
 	static uint16_t parse16(std::vector<uint8_t>::const_iterator);
 	static std::array<uint8_t, 2> pack16(uint16_t);
 
+	static uint32_t parse32(std::vector<uint8_t>::const_iterator);
+	static std::array<uint8_t, 4> pack32(uint32_t);
+
 private:
 	ID id;
 	uint8_t lightID;
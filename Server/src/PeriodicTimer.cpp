@@ -1,7 +1,8 @@
 #include "PeriodicTimer.hpp"
 
 #include <stdexcept>
-#include <iostream>
+
+#include "Log.hpp"
 
 PeriodicTimer::PeriodicTimer(boost::asio::io_service& _ioService,
 	const std::chrono::microseconds& _period, const TimerHandler& _handler)
@@ -34,7 +35,7 @@ void PeriodicTimer::cbTimer(const boost::system::error_code& error) {
 		return;
 	}
 	else {
-		std::cout << "[Error] PeriodicTimer: cbTimer: " << error.message() << std::endl;
+		LOG_ERROR("PeriodicTimer: cbTimer: " << error.message());
 	}
 
 	resetTimer();
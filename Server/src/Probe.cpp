@@ -0,0 +1,166 @@
+#include "Probe.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+struct Registry {
+	mutex registryMutex;
+
+	vector<const char*> names;
+
+	//Kept alive after their thread exits so dump() still sees them
+	vector<shared_ptr<void>> threads;
+};
+
+Registry& registry() {
+	static Registry r;
+
+	return r;
+}
+
+uint64_t relaxedLoad(const atomic<uint64_t>& value) {
+	return value.load(memory_order_relaxed);
+}
+
+//Only the owning thread writes, so a load and store is enough
+void relaxedAdd(atomic<uint64_t>& value, uint64_t n) {
+	value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+} //namespace
+
+Probe::Site::Site(const char* _name)
+	:	name{_name} {
+	auto& r = registry();
+	lock_guard<mutex> registryLock(r.registryMutex);
+
+	if(r.names.size() < MAX_SITES) {
+		index = r.names.size();
+		r.names.push_back(name);
+	}
+	else {
+		index = -1;
+	}
+}
+
+const char* Probe::Site::getName() const {
+	return name;
+}
+
+int Probe::Site::getIndex() const {
+	return index;
+}
+
+Probe::ThreadStats::ThreadStats() {
+	for(auto& site : sites) {
+		site.calls = site.ticks = site.max = 0;
+
+		for(auto& bucket : site.buckets) {
+			bucket = 0;
+		}
+	}
+}
+
+uint64_t Probe::now() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const char* Probe::getUnit() {
+#if defined(__x86_64__) || defined(__i386__)
+	return "cycles";
+#else
+	return "ns";
+#endif
+}
+
+Probe::ThreadStats& Probe::local() {
+	thread_local ThreadStats* stats = []() {
+		auto owned = make_shared<ThreadStats>();
+
+		auto& r = registry();
+		lock_guard<mutex> registryLock(r.registryMutex);
+		r.threads.push_back(owned);
+
+		return owned.get();
+	}();
+
+	return *stats;
+}
+
+void Probe::record(const Site& site, uint64_t ticks) {
+	if(site.getIndex() < 0) {
+		return;
+	}
+
+	auto& stats = local().sites[site.getIndex()];
+
+	relaxedAdd(stats.calls, 1);
+	relaxedAdd(stats.ticks, ticks);
+	relaxedAdd(stats.buckets[(ticks == 0) ? 0 : 63 - __builtin_clzll(ticks)], 1);
+
+	if(ticks > relaxedLoad(stats.max)) {
+		stats.max.store(ticks, memory_order_relaxed);
+	}
+}
+
+void Probe::dump(ostream& out) {
+	if(!isCompiled()) {
+		out << "Probes are not compiled in, build with 'make probes'\n";
+		return;
+	}
+
+	auto& r = registry();
+	lock_guard<mutex> registryLock(r.registryMutex);
+
+	out << "probe\tcalls\tmean\tp50\tp99\tmax\t(" << getUnit() << ", percentiles are "
+		"power of two upper bounds)\n";
+
+	for(size_t i = 0; i < r.names.size(); ++i) {
+		uint64_t calls = 0, ticks = 0, max = 0;
+		array<uint64_t, BUCKETS> buckets{};
+
+		for(const auto& thread : r.threads) {
+			const auto& stats = static_cast<const ThreadStats*>(thread.get())->sites[i];
+
+			calls += relaxedLoad(stats.calls);
+			ticks += relaxedLoad(stats.ticks);
+			max = std::max(max, relaxedLoad(stats.max));
+
+			for(int b = 0; b < BUCKETS; ++b) {
+				buckets[b] += relaxedLoad(stats.buckets[b]);
+			}
+		}
+
+		auto percentile = [&](double p) -> uint64_t {
+			uint64_t rank = p*calls, cumulative = 0;
+
+			for(int b = 0; b < BUCKETS; ++b) {
+				cumulative += buckets[b];
+
+				if(cumulative > rank) {
+					return std::min((b < 63) ? (uint64_t{2} << b) - 1 : UINT64_MAX, max);
+				}
+			}
+
+			return max;
+		};
+
+		out << r.names[i] << "\t" << calls << "\t" << ((calls == 0) ? 0 : ticks/calls) << "\t"
+			<< percentile(0.5) << "\t" << percentile(0.99) << "\t" << max << "\n";
+	}
+}
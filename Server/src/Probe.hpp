@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+//Scoped timing probes for hot functions
+//	void Color::HSV(...) {
+//		PROBE("Color::HSV");
+//		...
+//Only compiled in with -D ALEXAHUB_PROBES (make probes). Otherwise PROBE()
+//expands to nothing, so release builds carry no trace of it.
+//Each thread accumulates call counts and a log2 histogram of elapsed ticks
+//(TSC cycles on x86, nanoseconds elsewhere) in its own storage.
+#ifdef ALEXAHUB_PROBES
+#define PROBE_CONCAT_(a, b) a##b
+#define PROBE_CONCAT(a, b) PROBE_CONCAT_(a, b)
+#define PROBE(name) \
+	static const Probe::Site PROBE_CONCAT(probeSite, __LINE__){name}; \
+	Probe::Scope PROBE_CONCAT(probeScope, __LINE__){PROBE_CONCAT(probeSite, __LINE__)}
+#else
+#define PROBE(name) ((void)0)
+#endif
+
+class Probe {
+public:
+	//One per PROBE() call site, registered on first use
+	class Site {
+	public:
+		Site(const char* name);
+
+		const char* getName() const;
+		int getIndex() const;
+
+	private:
+		const char* name;
+		int index;
+	};
+
+	class Scope {
+	public:
+		Scope(const Site& site)
+			:	site(site)
+			,	start{now()} {
+		}
+
+		~Scope() {
+			record(site, now() - start);
+		}
+
+	private:
+		const Site& site;
+		uint64_t start;
+	};
+
+	static constexpr bool isCompiled() {
+#ifdef ALEXAHUB_PROBES
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static uint64_t now();
+	static const char* getUnit();
+
+	static void record(const Site& site, uint64_t ticks);
+
+	//Sums every thread's counters, one line per probe
+	static void dump(std::ostream&);
+
+	static constexpr int MAX_SITES = 64;
+	static constexpr int BUCKETS = 64;
+
+private:
+	//Written only by the owning thread, read by dump()
+	struct Stats {
+		std::atomic<uint64_t> calls, ticks, max;
+		std::array<std::atomic<uint64_t>, BUCKETS> buckets;
+	};
+
+	struct ThreadStats {
+		ThreadStats();
+
+		std::array<Stats, MAX_SITES> sites;
+	};
+
+	static ThreadStats& local();
+};
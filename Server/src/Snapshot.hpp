@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//Read-copy-update cell holding an immutable T
+//load() never blocks: it pins the current version through a per-epoch
+//reader count while copying the shared_ptr. store() publishes a new version,
+//waits out a grace period for readers still pinning the old one, then
+//drops its reference.
+template<class T>
+class Snapshot {
+public:
+	Snapshot(std::shared_ptr<const T> initial)
+		:	current{new Holder{std::move(initial)}}
+		,	epoch{0} {
+		readers[0] = 0;
+		readers[1] = 0;
+	}
+
+	~Snapshot() {
+		delete current.load();
+	}
+
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	std::shared_ptr<const T> load() const {
+		auto e = epoch.load() & 1;
+
+		readers[e].fetch_add(1);
+		auto value = current.load()->value;
+		readers[e].fetch_sub(1);
+
+		return value;
+	}
+
+	void store(std::shared_ptr<const T> value) {
+		std::lock_guard<std::mutex> writeLock(writeMutex);
+
+		auto old = current.exchange(new Holder{std::move(value)});
+
+		synchronize();
+
+		delete old;
+	}
+
+private:
+	struct Holder {
+		std::shared_ptr<const T> value;
+	};
+
+	//Flip the epoch twice so that readers which sampled either parity
+	//before the exchange have finished
+	void synchronize() {
+		for(int i = 0; i < 2; ++i) {
+			auto e = epoch.fetch_add(1) & 1;
+
+			while(readers[e].load() != 0) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	std::atomic<Holder*> current;
+	std::atomic<unsigned> epoch;
+	mutable std::atomic<int> readers[2];
+	std::mutex writeMutex;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+//Hashed timing wheel holding one timeout per key
+//Keys sit in the slot their deadline falls into, carrying how many more
+//turns of the wheel to wait, so arming, re-arming and cancelling are
+//cheap no matter how many keys are tracked, and each tick only visits
+//one slot. Re-arming moves the key's list node between slots instead of
+//allocating. Deadlines are rounded up to whole ticks. Not thread-safe,
+//advance() is expected to be driven by a periodic timer of period tick.
+template<class Key>
+class TimingWheel {
+public:
+	TimingWheel(size_t slotCount, std::chrono::milliseconds _tick)
+		:	slots(slotCount)
+		,	current{0}
+		,	tick{_tick} {
+
+		if( (slotCount == 0) || (tick.count() <= 0) ) {
+			throw std::invalid_argument("TimingWheel: Invalid slot count or tick");
+		}
+	}
+
+	//Arms or re-arms key to expire after delay
+	void schedule(const Key& key, std::chrono::milliseconds delay) {
+		size_t ticks = std::max<size_t>(1, (delay.count() + tick.count() - 1) / tick.count());
+		size_t slot = (current + ticks) % slots.size();
+		size_t rounds = (ticks - 1) / slots.size();
+
+		auto found = index.find(key);
+		if(found == index.end()) {
+			slots[slot].push_back({key, rounds});
+			index.emplace(key, Position{slot, std::prev(slots[slot].end())});
+		}
+		else {
+			auto& position = found->second;
+
+			slots[slot].splice(slots[slot].end(), slots[position.slot], position.entry);
+			position.slot = slot;
+			position.entry->rounds = rounds;
+		}
+	}
+
+	void cancel(const Key& key) {
+		auto found = index.find(key);
+		if(found != index.end()) {
+			slots[found->second.slot].erase(found->second.entry);
+			index.erase(found);
+		}
+	}
+
+	bool contains(const Key& key) const {
+		return index.count(key) != 0;
+	}
+
+	size_t size() const {
+		return index.size();
+	}
+
+	std::chrono::milliseconds getTick() const {
+		return tick;
+	}
+
+	//Moves the wheel on by one tick and appends the keys that expired
+	void advance(std::vector<Key>& expired) {
+		current = (current + 1) % slots.size();
+
+		auto& slot = slots[current];
+		for(auto entry = slot.begin(); entry != slot.end(); ) {
+			if(entry->rounds > 0) {
+				--entry->rounds;
+				++entry;
+			}
+			else {
+				expired.push_back(entry->key);
+				index.erase(entry->key);
+				entry = slot.erase(entry);
+			}
+		}
+	}
+
+private:
+	struct Entry {
+		Key key;
+		size_t rounds;
+	};
+
+	struct Position {
+		size_t slot;
+		typename std::list<Entry>::iterator entry;
+	};
+
+	std::vector<std::list<Entry>> slots;
+	std::map<Key, Position> index;
+
+	size_t current;
+	std::chrono::milliseconds tick;
+};
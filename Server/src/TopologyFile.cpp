@@ -0,0 +1,285 @@
+#include "TopologyFile.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+using namespace boost::asio;
+
+namespace {
+	std::string systemError(const std::string& what, const std::string& path) {
+		return what + " " + path + ": " + strerror(errno);
+	}
+
+	//Closes and unmaps on every way out of load()
+	struct Mapping {
+		~Mapping() {
+			if(data != MAP_FAILED) {
+				munmap(data, size);
+			}
+			if(fd >= 0) {
+				close(fd);
+			}
+		}
+
+		int fd = -1;
+		void* data = MAP_FAILED;
+		size_t size = 0;
+	};
+}
+
+void TopologyFile::save(const std::string& path, const std::vector<NodeEntry>& nodes) {
+	static_assert(sizeof(Header) == 24, "Header layout changed");
+	static_assert(sizeof(NodeRecord) == 36, "NodeRecord layout changed");
+	static_assert(sizeof(LightRecord) == 16, "LightRecord layout changed");
+
+	std::vector<NodeRecord> nodeRecords;
+	std::vector<LightRecord> lightRecords;
+	std::string strings;
+
+	//Light names tend to repeat from node to node
+	std::map<std::string, uint32_t> stringOffsets;
+	auto addString = [&strings, &stringOffsets](const std::string& s) {
+		auto found = stringOffsets.find(s);
+		if(found != stringOffsets.end()) {
+			return found->second;
+		}
+
+		uint32_t offset = strings.size();
+		strings += s;
+		stringOffsets.emplace(s, offset);
+
+		return offset;
+	};
+
+	for(const auto& node : nodes) {
+		NodeRecord record{};
+
+		if(node.address.is_v4()) {
+			auto bytes = node.address.to_v4().to_bytes();
+			std::copy(bytes.begin(), bytes.end(), record.address);
+		}
+		else {
+			auto bytes = node.address.to_v6().to_bytes();
+			std::copy(bytes.begin(), bytes.end(), record.address);
+			record.flags |= FLAG_IPV6;
+		}
+
+		record.nameOffset = addString(node.name);
+		record.nameLength = node.name.size();
+		record.firstLight = lightRecords.size();
+		record.lightCount = node.lights.size();
+
+		if(node.hashed) {
+			record.flags |= FLAG_HASHED;
+			record.hash = node.hash;
+		}
+
+		for(const auto& light : node.lights) {
+			LightRecord lightRecord{};
+
+			lightRecord.nameOffset = addString(light.name);
+			lightRecord.nameLength = light.name.size();
+			lightRecord.state = light.state.pack();
+			lightRecord.size = light.size;
+			lightRecord.lightID = light.lightID;
+
+			lightRecords.push_back(lightRecord);
+		}
+
+		nodeRecords.push_back(record);
+	}
+
+	auto nodeBytes = nodeRecords.size()*sizeof(NodeRecord);
+	auto lightBytes = lightRecords.size()*sizeof(LightRecord);
+
+	std::vector<uint8_t> file(sizeof(Header) + nodeBytes + lightBytes + strings.size());
+
+	auto body = file.data() + sizeof(Header);
+	memcpy(body, nodeRecords.data(), nodeBytes);
+	memcpy(body + nodeBytes, lightRecords.data(), lightBytes);
+	memcpy(body + nodeBytes + lightBytes, strings.data(), strings.size());
+
+	Header header{};
+	memcpy(header.magic, "AHTF", sizeof(header.magic));
+	header.version = VERSION;
+	header.nodeCount = nodeRecords.size();
+	header.lightCount = lightRecords.size();
+	header.stringBytes = strings.size();
+	header.checksum = checksum(body, file.size() - sizeof(Header));
+	memcpy(file.data(), &header, sizeof(header));
+
+	auto temporary = path + ".tmp";
+
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0) {
+		throw std::runtime_error(systemError("TopologyFile::save: Unable to open", temporary));
+	}
+
+	for(size_t written = 0; written < file.size(); ) {
+		auto result = write(fd, file.data() + written, file.size() - written);
+		if(result < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			auto error = systemError("TopologyFile::save: Unable to write", temporary);
+			close(fd);
+			unlink(temporary.c_str());
+
+			throw std::runtime_error(error);
+		}
+
+		written += result;
+	}
+
+	//The data has to be on disk before the rename makes it the snapshot
+	if( (fsync(fd) != 0) || (close(fd) != 0) ) {
+		auto error = systemError("TopologyFile::save: Unable to write", temporary);
+		unlink(temporary.c_str());
+
+		throw std::runtime_error(error);
+	}
+
+	if(rename(temporary.c_str(), path.c_str()) != 0) {
+		auto error = systemError("TopologyFile::save: Unable to replace", path);
+		unlink(temporary.c_str());
+
+		throw std::runtime_error(error);
+	}
+
+	//Until its directory is on disk too, a power cut can undo the rename
+	auto separator = path.find_last_of('/');
+	auto directory = (separator == std::string::npos) ? std::string(".")
+		: (separator == 0) ? std::string("/") : path.substr(0, separator);
+
+	int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirFd < 0) {
+		throw std::runtime_error(systemError("TopologyFile::save: Unable to open", directory));
+	}
+
+	if(fsync(dirFd) != 0) {
+		auto error = systemError("TopologyFile::save: Unable to sync", directory);
+		close(dirFd);
+
+		throw std::runtime_error(error);
+	}
+
+	close(dirFd);
+}
+
+std::vector<TopologyFile::NodeEntry> TopologyFile::load(const std::string& path) {
+	Mapping mapping;
+
+	mapping.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(mapping.fd < 0) {
+		if(errno == ENOENT) {
+			return {};
+		}
+
+		throw std::runtime_error(systemError("TopologyFile::load: Unable to open", path));
+	}
+
+	struct stat info;
+	if(fstat(mapping.fd, &info) != 0) {
+		throw std::runtime_error(systemError("TopologyFile::load: Unable to stat", path));
+	}
+
+	mapping.size = info.st_size;
+	if(mapping.size < sizeof(Header)) {
+		throw std::runtime_error("TopologyFile::load: " + path + " is too short");
+	}
+
+	mapping.data = mmap(nullptr, mapping.size, PROT_READ, MAP_PRIVATE, mapping.fd, 0);
+	if(mapping.data == MAP_FAILED) {
+		throw std::runtime_error(systemError("TopologyFile::load: Unable to map", path));
+	}
+
+	auto base = static_cast<const uint8_t*>(mapping.data);
+	auto header = reinterpret_cast<const Header*>(base);
+
+	if( (memcmp(header->magic, "AHTF", sizeof(header->magic)) != 0)
+		|| (header->version != VERSION) ) {
+		throw std::runtime_error("TopologyFile::load: " + path + " is not a topology snapshot "
+			"of this version");
+	}
+
+	auto nodeBytes = static_cast<uint64_t>(header->nodeCount)*sizeof(NodeRecord);
+	auto lightBytes = static_cast<uint64_t>(header->lightCount)*sizeof(LightRecord);
+	if(sizeof(Header) + nodeBytes + lightBytes + header->stringBytes != mapping.size) {
+		throw std::runtime_error("TopologyFile::load: " + path + " has an invalid size");
+	}
+
+	auto body = base + sizeof(Header);
+	if(checksum(body, mapping.size - sizeof(Header)) != header->checksum) {
+		throw std::runtime_error("TopologyFile::load: " + path + " failed its checksum");
+	}
+
+	auto nodeRecords = reinterpret_cast<const NodeRecord*>(body);
+	auto lightRecords = reinterpret_cast<const LightRecord*>(body + nodeBytes);
+	auto strings = reinterpret_cast<const char*>(body + nodeBytes + lightBytes);
+
+	auto getString = [header, strings, &path](uint32_t offset, uint16_t length) {
+		if(static_cast<uint64_t>(offset) + length > header->stringBytes) {
+			throw std::runtime_error("TopologyFile::load: " + path + " has a name out of bounds");
+		}
+
+		return std::string(strings + offset, length);
+	};
+
+	std::vector<NodeEntry> nodes;
+	nodes.reserve(header->nodeCount);
+
+	for(uint32_t i = 0; i < header->nodeCount; ++i) {
+		const auto& record = nodeRecords[i];
+
+		if(static_cast<uint64_t>(record.firstLight) + record.lightCount > header->lightCount) {
+			throw std::runtime_error("TopologyFile::load: " + path + " has lights out of bounds");
+		}
+
+		NodeEntry node;
+
+		if(record.flags & FLAG_IPV6) {
+			ip::address_v6::bytes_type bytes;
+			std::copy(record.address, record.address + bytes.size(), bytes.begin());
+			node.address = ip::address_v6(bytes);
+		}
+		else {
+			ip::address_v4::bytes_type bytes;
+			std::copy(record.address, record.address + bytes.size(), bytes.begin());
+			node.address = ip::address_v4(bytes);
+		}
+
+		node.name = getString(record.nameOffset, record.nameLength);
+		node.hashed = (record.flags & FLAG_HASHED) != 0;
+		node.hash = record.hash;
+
+		for(uint32_t j = 0; j < record.lightCount; ++j) {
+			const auto& lightRecord = lightRecords[record.firstLight + j];
+
+			node.lights.push_back({lightRecord.lightID,
+				getString(lightRecord.nameOffset, lightRecord.nameLength), lightRecord.size,
+				LightState::unpack(lightRecord.state)});
+		}
+
+		nodes.push_back(std::move(node));
+	}
+
+	return nodes;
+}
+
+uint32_t TopologyFile::checksum(const uint8_t* data, size_t size) {
+	uint32_t hash = 2166136261u;
+
+	for(size_t i = 0; i < size; ++i) {
+		hash = (hash ^ data[i])*16777619u;
+	}
+
+	return hash;
+}
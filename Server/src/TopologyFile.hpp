@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "Light.hpp"
+
+//Compact on-disk copy of the node and light table, for a warm start
+//The file is a header, fixed size node records, fixed size light records
+//and a table of the names they point into. Records are aligned and in host
+//byte order so the file is read in place from a read-only mapping; a
+//checksum rejects torn or foreign files. save() writes a temporary file,
+//renames it over the old one and syncs the directory, so a crash never
+//leaves half a snapshot.
+class TopologyFile {
+public:
+	struct LightEntry {
+		uint8_t lightID;
+		std::string name;
+		uint16_t size;
+		LightState state;
+	};
+
+	struct NodeEntry {
+		boost::asio::ip::address address;
+		std::string name;
+
+		//Configuration hash from NodeInfoResponseV2, if the node sent one
+		bool hashed;
+		uint32_t hash;
+
+		std::vector<LightEntry> lights;
+	};
+
+	//Throws std::runtime_error if the file cannot be written
+	static void save(const std::string& path, const std::vector<NodeEntry>& nodes);
+
+	//Empty if there is no file, throws std::runtime_error if it cannot be
+	//read or is not a valid snapshot
+	static std::vector<NodeEntry> load(const std::string& path);
+
+private:
+	static const uint32_t VERSION = 1;
+
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint32_t nodeCount;
+		uint32_t lightCount;
+		uint32_t stringBytes;
+
+		//FNV-1a over everything after the header
+		uint32_t checksum;
+	};
+
+	struct NodeRecord {
+		uint8_t address[16];		//IPv4 addresses use the first 4 bytes
+		uint32_t nameOffset;
+		uint32_t firstLight;
+		uint32_t hash;
+		uint16_t nameLength;
+		uint16_t lightCount;
+		uint8_t flags;
+		uint8_t reserved[3];
+	};
+
+	struct LightRecord {
+		uint32_t nameOffset;
+		uint32_t state;				//LightState::pack()
+		uint16_t nameLength;
+		uint16_t size;
+		uint8_t lightID;
+		uint8_t reserved[3];
+	};
+
+	static const uint8_t FLAG_IPV6 = 1;
+	static const uint8_t FLAG_HASHED = 2;
+
+	static uint32_t checksum(const uint8_t* data, size_t size);
+};
@@ -0,0 +1,174 @@
+#include "Trace.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+atomic<bool> Trace::enabled{false};
+
+namespace {
+
+struct Event {
+	atomic<uint64_t> sequence; //Odd while being written, 0 if never used
+	uint64_t traceId;
+	const char* name;
+	uint64_t start, end;
+	uint32_t thread;
+};
+
+const size_t CAPACITY = 1 << 16;
+
+array<Event, CAPACITY> events;
+atomic<uint64_t> nextEvent{0};
+atomic<uint64_t> nextTraceId{1};
+atomic<uint32_t> nextThread{0};
+
+thread_local uint64_t currentTrace = 0;
+
+uint32_t threadIndex() {
+	thread_local uint32_t index = nextThread.fetch_add(1);
+
+	return index;
+}
+
+//Chrome trace timestamps are microseconds
+string micros(uint64_t ns) {
+	char str[32];
+	snprintf(str, sizeof(str), "%llu.%03llu", static_cast<unsigned long long>(ns/1000),
+		static_cast<unsigned long long>(ns % 1000));
+
+	return str;
+}
+
+} //namespace
+
+Trace::Stage::Stage(const char* _name)
+	:	name{_name}
+	,	latency(Metrics::histogram("alexahub_stage_latency_seconds",
+			"Time spent in each stage of command processing",
+			string("stage=\"") + _name + "\"")) {
+}
+
+const char* Trace::Stage::getName() const {
+	return name;
+}
+
+Metrics::Histogram& Trace::Stage::getLatency() const {
+	return latency;
+}
+
+Trace::Span::Span(const Stage& _stage)
+	:	stage(_stage)
+	,	traceId{currentTrace}
+	,	start{now()} {
+}
+
+Trace::Span::~Span() {
+	record(stage, traceId, start, now());
+}
+
+Trace::Scope::Scope(uint64_t id)
+	:	previous{currentTrace} {
+	currentTrace = id;
+}
+
+Trace::Scope::~Scope() {
+	currentTrace = previous;
+}
+
+void Trace::setEnabled(bool enable) {
+	enabled.store(enable, memory_order_relaxed);
+}
+
+bool Trace::isEnabled() {
+	return enabled.load(memory_order_relaxed);
+}
+
+uint64_t Trace::begin() {
+	if(!isEnabled()) {
+		return 0;
+	}
+
+	return nextTraceId.fetch_add(1, memory_order_relaxed);
+}
+
+uint64_t Trace::current() {
+	return currentTrace;
+}
+
+uint64_t Trace::now() {
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const Stage& stage, uint64_t traceId, uint64_t start, uint64_t end) {
+	stage.getLatency().record(end - start);
+
+	if(traceId == 0) {
+		return;
+	}
+
+	//Oldest events are overwritten once the ring wraps
+	auto index = nextEvent.fetch_add(1, memory_order_relaxed);
+	auto& event = events[index % CAPACITY];
+
+	auto sequence = 2*index + 1;
+	event.sequence.store(sequence, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	event.traceId = traceId;
+	event.name = stage.getName();
+	event.start = start;
+	event.end = end;
+	event.thread = threadIndex();
+
+	event.sequence.store(sequence + 1, memory_order_release);
+}
+
+void Trace::exportChrome(ostream& out) {
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+	bool first = true;
+	for(auto& event : events) {
+		//Seqlock read, skip slots that are empty or being overwritten
+		auto sequence = event.sequence.load(memory_order_acquire);
+		if( (sequence == 0) || (sequence & 1) ) {
+			continue;
+		}
+
+		auto traceId = event.traceId;
+		auto name = event.name;
+		auto start = event.start, end = event.end;
+		auto thread = event.thread;
+
+		atomic_thread_fence(memory_order_acquire);
+		if(event.sequence.load(memory_order_relaxed) != sequence) {
+			continue;
+		}
+
+		if(!first) {
+			out << ",";
+		}
+		first = false;
+
+		out << "\n{\"name\":\"" << name << "\",\"cat\":\"alexahub\",\"ph\":\"X\",\"pid\":1"
+			<< ",\"tid\":" << thread << ",\"ts\":" << micros(start) << ",\"dur\":" << micros(end - start)
+			<< ",\"args\":{\"trace\":" << traceId << "}}";
+	}
+
+	out << "\n]}\n";
+}
+
+void Trace::writeChrome(const string& path) {
+	ofstream file(path);
+	if(!file) {
+		throw runtime_error("Trace::writeChrome: Unable to open " + path);
+	}
+
+	exportChrome(file);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "Metrics.hpp"
+
+//Lightweight request tracing
+//A trace id is assigned when a cloud message is framed and carried through
+//a thread-local Scope; Spans stamp each stage with steady_clock timestamps.
+//Completed spans go to a fixed-size lock-free ring that can be exported in
+//Chrome trace-event format (chrome://tracing, Perfetto, speedscope).
+//Every stage also feeds the alexahub_stage_latency_seconds histogram,
+//whether or not tracing is enabled.
+class Trace {
+public:
+	//Named pipeline stage, declared once per call site as a static object
+	class Stage {
+	public:
+		Stage(const char* name);
+
+		const char* getName() const;
+		Metrics::Histogram& getLatency() const;
+
+	private:
+		const char* name;
+		Metrics::Histogram& latency;
+	};
+
+	//Times a stage of the current trace, recorded when it goes out of scope
+	class Span {
+	public:
+		Span(const Stage&);
+		~Span();
+
+		Span(const Span&) = delete;
+		Span& operator=(const Span&) = delete;
+
+	private:
+		const Stage& stage;
+		uint64_t traceId;
+		uint64_t start;
+	};
+
+	//Makes id the current trace of this thread while in scope
+	class Scope {
+	public:
+		Scope(uint64_t id);
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		uint64_t previous;
+	};
+
+	static void setEnabled(bool);
+	static bool isEnabled();
+
+	//Returns a new trace id, or 0 (no trace) while tracing is disabled
+	static uint64_t begin();
+	static uint64_t current();
+
+	//Monotonic nanoseconds
+	static uint64_t now();
+
+	//Records a span measured by hand, e.g. across threads
+	//The trace event is skipped if traceId is 0, the latency is always kept
+	static void record(const Stage&, uint64_t traceId, uint64_t start, uint64_t end);
+
+	static void exportChrome(std::ostream&);
+	static void writeChrome(const std::string& path);
+
+private:
+	static std::atomic<bool> enabled;
+};
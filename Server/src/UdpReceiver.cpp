@@ -0,0 +1,89 @@
+#include "UdpReceiver.hpp"
+
+#include <cerrno>
+
+#include "Log.hpp"
+#include "Probe.hpp"
+
+using namespace boost::asio;
+
+UdpReceiver::UdpReceiver(ip::udp::socket& _socket, const DatagramHandler& _handler,
+	const ErrorHandler& _errorHandler)
+	:	socket(_socket)
+	,	handler{_handler}
+	,	errorHandler{_errorHandler}
+	,	buffers(BATCH)
+	,	sources(BATCH)
+	,	iovecs(BATCH)
+	,	messages(BATCH)
+	,	syscalls(Metrics::counter("alexahub_udp_recv_syscalls_total",
+			"recvmmsg calls made to receive UDP datagrams"))
+	,	datagrams(Metrics::counter("alexahub_udp_received_total", "UDP datagrams received"))
+	,	truncated(Metrics::counter("alexahub_udp_dropped_total",
+			"Received UDP datagrams that were discarded", "reason=\"truncated\"")) {
+}
+
+void UdpReceiver::start() {
+	startWait();
+}
+
+void UdpReceiver::startWait() {
+	socket.async_wait(ip::udp::socket::wait_read, [this](const boost::system::error_code& ec) {
+		if(ec) {
+			if(ec == error::operation_aborted) {
+				return;
+			}
+
+			errorHandler(ec);
+		}
+		else {
+			receive();
+		}
+
+		startWait();
+	});
+}
+
+void UdpReceiver::receive() {
+	PROBE("UdpReceiver::receive");
+
+	//The headers are rewritten every time, recvmmsg updates lengths in place
+	for(size_t i = 0; i < BATCH; ++i) {
+		iovecs[i] = {buffers[i].data(), buffers[i].size()};
+
+		auto& msg = messages[i].msg_hdr;
+		msg = msghdr{};
+		msg.msg_name = sources[i].data();
+		msg.msg_namelen = sources[i].capacity();
+		msg.msg_iov = &iovecs[i];
+		msg.msg_iovlen = 1;
+	}
+
+	int count = recvmmsg(socket.native_handle(), messages.data(), BATCH, MSG_DONTWAIT, nullptr);
+	syscalls.inc();
+
+	if(count < 0) {
+		if( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+			errorHandler(boost::system::error_code(errno, boost::system::system_category()));
+		}
+
+		return;
+	}
+
+	datagrams.inc(count);
+
+	for(int i = 0; i < count; ++i) {
+		const auto& msg = messages[i].msg_hdr;
+
+		if(msg.msg_flags & MSG_TRUNC) {
+			truncated.inc();
+
+			LOG_ERROR("UdpReceiver: Discarding datagram larger than " << MAX_DATAGRAM << " bytes");
+			continue;
+		}
+
+		sources[i].resize(msg.msg_namelen);
+
+		handler(sources[i], buffers[i].data(), messages[i].msg_len);
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <boost/asio.hpp>
+
+#include "Metrics.hpp"
+
+//Batched receive path for a UDP socket
+//Waits for the socket to become readable, then takes up to BATCH datagrams
+//with one recvmmsg into a fixed pool of buffers and hands all of them to
+//the handler within the same io_service handler, so a burst of responses
+//costs one wakeup and a few syscalls instead of one of each per datagram.
+class UdpReceiver {
+public:
+	using DatagramHandler = std::function<void(const boost::asio::ip::udp::endpoint& from,
+		const uint8_t* data, size_t size)>;
+	using ErrorHandler = std::function<void(const boost::system::error_code&)>;
+
+	static const size_t BATCH = 64;
+	static const size_t MAX_DATAGRAM = 2048;
+
+	UdpReceiver(boost::asio::ip::udp::socket& socket, const DatagramHandler& handler,
+		const ErrorHandler& errorHandler);
+
+	//Starts receiving, call on the socket's io_service thread
+	void start();
+
+private:
+	void startWait();
+	void receive();
+
+	boost::asio::ip::udp::socket& socket;
+	DatagramHandler handler;
+	ErrorHandler errorHandler;
+
+	std::vector<std::array<uint8_t, MAX_DATAGRAM>> buffers;
+	std::vector<boost::asio::ip::udp::endpoint> sources;
+	std::vector<iovec> iovecs;
+	std::vector<mmsghdr> messages;
+
+	Metrics::Counter& syscalls;
+	Metrics::Counter& datagrams;
+	Metrics::Counter& truncated;
+};
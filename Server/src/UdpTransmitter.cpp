@@ -0,0 +1,262 @@
+#include "UdpTransmitter.hpp"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#include "Log.hpp"
+#include "Probe.hpp"
+#include "Trace.hpp"
+
+using namespace boost::asio;
+
+UdpTransmitter::UdpTransmitter(ip::udp::socket& _socket, const SentHandler& _handler,
+	DatagramPool& _pool)
+	:	socket(_socket)
+	,	handler{_handler}
+	,	connected{false}
+	,	segmentation{false}
+	,	pool(_pool)
+	,	flushPending{false}
+	,	inFlightSent{0}
+	,	waitingWritable{false}
+	,	syscalls(Metrics::counter("alexahub_udp_send_syscalls_total",
+			"sendmmsg calls made to transmit UDP datagrams"))
+	,	segmentedMessages(Metrics::counter("alexahub_udp_gso_messages_total",
+			"Messages that carried several datagrams to one node with UDP_SEGMENT"))
+	,	socketFull(Metrics::counter("alexahub_udp_socket_full_total",
+			"Times the UDP send buffer was full and transmission waited"))
+	,	queueDepth(Metrics::gauge("alexahub_send_queue_depth",
+			"UDP datagrams taken off the send queue but not yet sent")) {
+
+	inFlight.reserve(MAX_MESSAGES);
+
+	boost::system::error_code ec;
+	socket.remote_endpoint(ec);
+	connected = !ec;
+
+#ifdef UDP_SEGMENT
+	int size = 0;
+	socklen_t length = sizeof(size);
+	segmentation = (getsockopt(socket.native_handle(), SOL_UDP, UDP_SEGMENT, &size, &length) == 0);
+#endif
+
+	//Every node link has a transmitter, the kernel's answer is the same for all
+	static std::once_flag logged;
+	std::call_once(logged, [this]() {
+		LOG_INFO("UdpTransmitter: UDP segmentation offload "
+			<< (segmentation ? "available" : "not available"));
+	});
+}
+
+UdpTransmitter::~UdpTransmitter() {
+	for(size_t i = inFlightSent; i < inFlight.size(); ++i) {
+		pool.release(inFlight[i]);
+	}
+
+	while(auto datagram = queue.pop()) {
+		pool.release(datagram);
+	}
+}
+
+void UdpTransmitter::send(const ip::udp::endpoint& endpoint, Datagram* datagram) {
+	datagram->endpoint = endpoint;
+	datagram->traceId = Trace::current();
+	datagram->queued = Trace::now();
+
+	queue.push(datagram);
+
+	//Only the first producer since the last flush has to wake the consumer
+	if(!flushPending.exchange(true, std::memory_order_acq_rel)) {
+		boost::asio::post(socket.get_executor(), [this]() {
+			flush();
+		});
+	}
+}
+
+void UdpTransmitter::send(const ip::udp::endpoint& endpoint, const std::vector<uint8_t>& data) {
+	auto datagram = pool.acquire();
+	std::copy(data.begin(), data.end(), datagram->resize(data.size()));
+
+	send(endpoint, datagram);
+}
+
+bool UdpTransmitter::isSegmentationEnabled() const {
+	return segmentation;
+}
+
+void UdpTransmitter::flush() {
+	//Cleared first, so a push that this drain misses schedules another flush
+	flushPending.store(false, std::memory_order_release);
+
+	size_t taken = 0;
+	while(auto datagram = queue.pop()) {
+		inFlight.push_back(datagram);
+		++taken;
+	}
+
+	//Shared by every transmitter, so only ever adjusted
+	queueDepth.add(taken);
+
+	if(!waitingWritable) {
+		transmit();
+	}
+}
+
+void UdpTransmitter::transmit() {
+	PROBE("UdpTransmitter::transmit");
+
+	const size_t MAX_IOVECS = MAX_MESSAGES*4;
+
+	std::array<mmsghdr, MAX_MESSAGES> messages;
+	std::array<iovec, MAX_IOVECS> iovecs;
+	std::array<size_t, MAX_MESSAGES> runs;
+
+#ifdef UDP_SEGMENT
+	struct Control {
+		alignas(cmsghdr) char data[CMSG_SPACE(sizeof(uint16_t))];
+	};
+	std::array<Control, MAX_MESSAGES> controls;
+#endif
+
+	//Datagrams before this index are sent one per message, their run was
+	//rejected as a whole
+	size_t unsegmentedEnd = 0;
+
+	while(inFlightSent < inFlight.size()) {
+		size_t count = 0, iovecsUsed = 0;
+
+		for(size_t next = inFlightSent; (next < inFlight.size()) && (count < MAX_MESSAGES); ) {
+			auto run = (segmentation && (next >= unsegmentedEnd)) ? segmentRun(next) : 1;
+			if(iovecsUsed + run > MAX_IOVECS) {
+				break;
+			}
+
+			auto& msg = messages[count].msg_hdr;
+			msg = msghdr{};
+			if(!connected) {
+				msg.msg_name = inFlight[next]->endpoint.data();
+				msg.msg_namelen = inFlight[next]->endpoint.size();
+			}
+			msg.msg_iov = &iovecs[iovecsUsed];
+			msg.msg_iovlen = run;
+
+			for(size_t i = 0; i < run; ++i) {
+				auto datagram = inFlight[next + i];
+				iovecs[iovecsUsed++] = {datagram->data(), datagram->size()};
+			}
+
+#ifdef UDP_SEGMENT
+			if(run > 1) {
+				msg.msg_control = controls[count].data;
+				msg.msg_controllen = sizeof(controls[count].data);
+
+				auto cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+				uint16_t segmentSize = inFlight[next]->size();
+				memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+			}
+#endif
+
+			runs[count++] = run;
+			next += run;
+		}
+
+		int sent = sendmmsg(socket.native_handle(), messages.data(), count, MSG_DONTWAIT);
+		syscalls.inc();
+
+		if(sent < 0) {
+			if( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+				socketFull.inc();
+				waitingWritable = true;
+
+				socket.async_wait(ip::udp::socket::wait_write, [this](const boost::system::error_code& ec) {
+					waitingWritable = false;
+
+					if(!ec) {
+						transmit();
+					}
+				});
+
+				return;
+			}
+			else if( (errno == EIO) && (runs[0] > 1) ) {
+				//The route's device cannot segment, send datagrams one by one from now on
+				segmentation = false;
+
+				LOG_WARNING("UdpTransmitter: UDP segmentation offload failed, disabling it");
+				continue;
+			}
+			else if( (errno == EINVAL) && (runs[0] > 1) ) {
+				//Too large for the route, the datagrams may still go out on their own
+				unsegmentedEnd = inFlightSent + runs[0];
+				continue;
+			}
+
+			//The first message failed, report it and carry on with the next
+			complete(runs[0], boost::system::error_code(errno, boost::system::system_category()));
+			continue;
+		}
+
+		for(int i = 0; i < sent; ++i) {
+			if(runs[i] > 1) {
+				segmentedMessages.inc();
+			}
+
+			complete(runs[i], {});
+		}
+	}
+
+	inFlight.clear();
+	inFlightSent = 0;
+}
+
+size_t UdpTransmitter::segmentRun(size_t first) const {
+	const auto& head = *inFlight[first];
+	auto segmentSize = head.size();
+
+	if(segmentSize > MAX_SEGMENT_BYTES) {
+		return 1;
+	}
+
+	size_t run = 1, bytes = segmentSize;
+
+	for(auto i = first + 1; (i < inFlight.size()) && (run < MAX_SEGMENTS); ++i) {
+		const auto& datagram = *inFlight[i];
+
+		//Every segment but the last must be full size
+		if( (datagram.endpoint != head.endpoint) || (datagram.size() > segmentSize)
+			|| (bytes + datagram.size() > MAX_GSO_BYTES) ) {
+			break;
+		}
+
+		++run;
+		bytes += datagram.size();
+
+		if(datagram.size() < segmentSize) {
+			break;
+		}
+	}
+
+	return run;
+}
+
+void UdpTransmitter::complete(size_t count, const boost::system::error_code& ec) {
+	for(size_t i = 0; i < count; ++i) {
+		auto datagram = inFlight[inFlightSent + i];
+
+		handler(*datagram, ec);
+		pool.release(datagram);
+	}
+
+	inFlightSent += count;
+	queueDepth.add(-static_cast<int64_t>(count));
+}
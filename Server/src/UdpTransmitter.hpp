@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "DatagramPool.hpp"
+#include "Metrics.hpp"
+#include "MpscQueue.hpp"
+
+//Batched transmit path for a UDP socket
+//Producers on any thread take a buffer from the pool, fill it and send()
+//it; neither step locks or allocates in steady state. Several
+//transmitters may share one pool. Everything sent
+//before the socket's io_service gets to the flush goes out together:
+//consecutive datagrams to the same endpoint, of up to an MTU each, are
+//merged into one UDP_SEGMENT (GSO) message where the kernel supports it,
+//and all messages
+//are handed over with as few sendmmsg calls as possible. If the socket
+//buffer is full the rest waits for the socket to become writable. Each
+//buffer belongs to its send until the handler has seen it, then returns
+//to the pool. On a connected socket the datagrams' endpoints are only
+//used to tell them apart, the kernel's cached route is used to send.
+class UdpTransmitter {
+public:
+	using Datagram = DatagramPool::Datagram;
+
+	//Called on the io_service thread once per datagram, after it was sent
+	//or failed
+	using SentHandler = std::function<void(const Datagram&, const boost::system::error_code&)>;
+
+	//The socket must be connected, if at all, before the transmitter is
+	//constructed
+	UdpTransmitter(boost::asio::ip::udp::socket& socket, const SentHandler& handler,
+		DatagramPool& pool);
+	~UdpTransmitter();
+
+	//Takes ownership of datagram, which must come from the pool
+	void send(const boost::asio::ip::udp::endpoint& endpoint, Datagram* datagram);
+
+	void send(const boost::asio::ip::udp::endpoint& endpoint, const std::vector<uint8_t>& data);
+
+	bool isSegmentationEnabled() const;
+
+private:
+	//Limits of a single sendmmsg call and of one GSO message
+	static const size_t MAX_MESSAGES = 256;
+	static const size_t MAX_SEGMENTS = 64;
+	static const size_t MAX_GSO_BYTES = 65000;
+
+	//Larger segments would exceed an Ethernet or Wi-Fi MTU, and the kernel
+	//rejects the whole message with EINVAL
+	static const size_t MAX_SEGMENT_BYTES = DatagramPool::Datagram::CAPACITY;
+
+	void flush();
+
+	//Sends from the front of inFlight until done or the socket is full
+	void transmit();
+
+	//Number of datagrams from inFlight[first] that fit in one GSO message
+	size_t segmentRun(size_t first) const;
+
+	void complete(size_t count, const boost::system::error_code& ec);
+
+	boost::asio::ip::udp::socket& socket;
+	SentHandler handler;
+	bool connected;
+	bool segmentation;
+
+	DatagramPool& pool;
+	MpscQueue<Datagram> queue;
+	std::atomic<bool> flushPending;
+
+	//Only touched on the io_service thread
+	std::vector<Datagram*> inFlight;
+	size_t inFlightSent;
+	bool waitingWritable;
+
+	Metrics::Counter& syscalls;
+	Metrics::Counter& segmentedMessages;
+	Metrics::Counter& socketFull;
+	Metrics::Gauge& queueDepth;
+};
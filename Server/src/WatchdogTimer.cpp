@@ -8,12 +8,17 @@ WatchdogTimer::WatchdogTimer(boost::asio::io_service& _ioService,
 	,	timeout{_timeout}
 	,	handler{_handler}
 	,	timer{ioService}
-	,	state{State::Stopped} {
+	,	state{State::Stopped}
+	,	generation{std::make_shared<uint64_t>(0)} {
 		if(!handler) {
 			throw std::invalid_argument("WatchdogTimer: Invalid handler");
 		}
 }
 
+WatchdogTimer::~WatchdogTimer() {
+	timer.cancel();
+}
+
 void WatchdogTimer::start() {
 	if(state == State::Running) {
 		return;
@@ -30,6 +35,7 @@ void WatchdogTimer::stop() {
 	}
 
 	timer.cancel();
+	++*generation;
 
 	state = State::Stopped;
 }
@@ -45,8 +51,20 @@ void WatchdogTimer::feed() {
 }
 
 void WatchdogTimer::setTimer() {
+	auto expected = ++*generation;
+	std::weak_ptr<uint64_t> current = generation;
+
 	timer.expires_from_now(timeout);
-	timer.async_wait([this](const boost::system::error_code& error) {
+	timer.async_wait([this, expected, current](const boost::system::error_code& error) {
+		if(error == boost::asio::error::operation_aborted) {
+			return;
+		}
+
+		auto live = current.lock();
+		if(!live || (*live != expected)) {
+			return;
+		}
+
 		if(!error) {
 			state = State::Stopped;
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <memory>
 
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
@@ -17,6 +19,9 @@ public:
 	WatchdogTimer(boost::asio::io_service& ioService,
 		const std::chrono::microseconds& timeout, const TimeoutHandler& handler);
 
+	//A timeout already queued when the timer is destroyed is dropped
+	~WatchdogTimer();
+
 	void start();
 	void stop();
 
@@ -33,4 +38,9 @@ private:
 
 	boost::asio::steady_timer timer;
 	State state;
+
+	//Bumped whenever the timer is set or stopped. A wait that completed
+	//before a cancel() still runs its handler with success, so it only
+	//acts if this is still the generation it was set for and exists.
+	std::shared_ptr<uint64_t> generation;
 };
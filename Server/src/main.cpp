@@ -2,11 +2,108 @@
 
 #include <chrono>
 #include <thread>
+#include <iostream>
 
-int main() {
-	AlexaHub hub{};
+#include "Log.hpp"
+#include "Probe.hpp"
+#include "Trace.hpp"
+
+void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--log-level <debug|info|warning|error|none>\n"
+		<< "\t--log-binary <file>\tWrite binary log records (see LogDecode)\n"
+		<< "\t--groups <file>\tJSON object of group name to light ids\n"
+		<< "\t--trace <file>\tRecord command traces, written as Chrome trace JSON on exit\n"
+		<< "\t--metrics-port <port>\tServe /metrics and /trace on 127.0.0.1 (default 9161, 0 disables)\n"
+		<< "\t--cloud-port <port>\tTCP port for cloud directives (default 9160)\n"
+		<< "\t--max-connections <n>\tConcurrent cloud clients, more are refused (default 1024)\n"
+		<< "\t--light-port <port>\tUDP port of the light nodes (default 5492)\n"
+		<< "\t--discovery-address <address>\tWhere NodeInfo is sent (default 255.255.255.255)\n"
+		<< "\t--light-shards <n>\tThreads encoding and sending frames, 0 for one per core (default 1)\n"
+		<< "\t--state-file <file>\tSave discovered lights there and restore them on start\n";
+}
+
+int main(int argc, char* argv[]) {
+	std::string groupsFile, traceFile;
+	AlexaHub::Config config;
+
+	try {
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+
+			if( (arg == "--log-level") && (i+1 < argc) ) {
+				Log::setLevel(Log::parseLevel(argv[++i]));
+			}
+			else if( (arg == "--log-binary") && (i+1 < argc) ) {
+				Log::setBinaryOutput(argv[++i]);
+			}
+			else if( (arg == "--groups") && (i+1 < argc) ) {
+				groupsFile = argv[++i];
+			}
+			else if( (arg == "--trace") && (i+1 < argc) ) {
+				traceFile = argv[++i];
+				Trace::setEnabled(true);
+			}
+			else if( (arg == "--metrics-port") && (i+1 < argc) ) {
+				config.metricsPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+			}
+			else if( (arg == "--cloud-port") && (i+1 < argc) ) {
+				config.serverPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+			}
+			else if( (arg == "--max-connections") && (i+1 < argc) ) {
+				config.maxCloudConnections = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--light-port") && (i+1 < argc) ) {
+				config.lightPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+			}
+			else if( (arg == "--discovery-address") && (i+1 < argc) ) {
+				config.discoveryAddress = boost::asio::ip::address::from_string(argv[++i]);
+			}
+			else if( (arg == "--light-shards") && (i+1 < argc) ) {
+				config.lightShards = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--state-file") && (i+1 < argc) ) {
+				config.stateFile = argv[++i];
+			}
+			else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] main: " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	AlexaHub hub{config};
+
+	if(!groupsFile.empty()) {
+		try {
+			hub.loadGroups(groupsFile);
+		}
+		catch(const std::exception& e) {
+			LOG_ERROR(e.what());
+			return 1;
+		}
+	}
 
 	hub.run();
 
+	if(!traceFile.empty()) {
+		try {
+			Trace::writeChrome(traceFile);
+			LOG_INFO("main: Wrote traces to " << traceFile);
+		}
+		catch(const std::exception& e) {
+			LOG_ERROR(e.what());
+		}
+	}
+
+	if(Probe::isCompiled()) {
+		Probe::dump(std::cerr);
+	}
+
 	return 0;
 }
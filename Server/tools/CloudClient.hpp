@@ -0,0 +1,151 @@
+#pragma once
+
+//Minimal stand-in for the Alexa Lambda: sends directives to CloudServer
+//terminated by \r\n\r\n, and reads the responses, which AlexaHub writes
+//as one line of JSON each. Also builds the v2 directives the tools send.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "json/json.h"
+
+class CloudClient {
+public:
+	CloudClient(const std::string& address, uint16_t port) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(fd < 0) {
+			throw std::runtime_error(std::string("CloudClient: socket: ") + strerror(errno));
+		}
+
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		sockaddr_in server{};
+		server.sin_family = AF_INET;
+		server.sin_port = htons(port);
+
+		if( (inet_pton(AF_INET, address.c_str(), &server.sin_addr) != 1)
+			|| (connect(fd, reinterpret_cast<sockaddr*>(&server), sizeof(server)) < 0) ) {
+			auto error = std::string("CloudClient: connect to ") + address + ":"
+				+ std::to_string(port) + ": " + strerror(errno);
+			close(fd);
+
+			throw std::runtime_error(error);
+		}
+	}
+
+	~CloudClient() {
+		close(fd);
+	}
+
+	CloudClient(const CloudClient&) = delete;
+	CloudClient& operator=(const CloudClient&) = delete;
+
+	int getFd() const {
+		return fd;
+	}
+
+	//False if the connection failed
+	bool send(const std::string& directive) {
+		auto framed = directive + "\r\n\r\n";
+
+		for(size_t sent = 0; sent < framed.size(); ) {
+			auto n = ::send(fd, framed.data() + sent, framed.size() - sent, MSG_NOSIGNAL);
+			if(n <= 0) {
+				return false;
+			}
+
+			sent += n;
+		}
+
+		return true;
+	}
+
+	//Blocks for the next response, false once the hub closed the connection
+	bool receive(std::string& response) {
+		for(;;) {
+			auto end = buffer.find('\n');
+			if(end != std::string::npos) {
+				response = buffer.substr(0, end);
+				buffer.erase(0, end + 1);
+
+				return true;
+			}
+
+			char chunk[4096];
+			auto n = recv(fd, chunk, sizeof(chunk), 0);
+			if(n <= 0) {
+				return false;
+			}
+
+			buffer.append(chunk, n);
+		}
+	}
+
+	//Appliances the hub reports whose id starts with prefix, -1 on failure
+	long countAppliances(const std::string& prefix) {
+		std::string response;
+		if(!send(directive("DiscoverAppliancesRequest", "")) || !receive(response)) {
+			return -1;
+		}
+
+		Json::Value root;
+		Json::Reader reader;
+		if(!reader.parse(response, root)) {
+			return -1;
+		}
+
+		long count = 0;
+		for(const auto& appliance : root["payload"]["discoveredAppliances"]) {
+			if(appliance["applianceId"].asString().compare(0, prefix.size(), prefix) == 0) {
+				++count;
+			}
+		}
+
+		return count;
+	}
+
+	static std::string directive(const std::string& name, const std::string& applianceId,
+		const Json::Value& payload = Json::objectValue) {
+		Json::Value root;
+
+		bool discovery = (name == "DiscoverAppliancesRequest");
+
+		root["header"]["namespace"] = discovery ? "Alexa.ConnectedHome.Discovery"
+			: "Alexa.ConnectedHome.Control";
+		root["header"]["name"] = name;
+		root["header"]["payloadVersion"] = "2";
+		root["header"]["messageId"] = "00000000-0000-0000-0000-000000000000";
+		root["payload"] = payload;
+		root["payload"]["accessToken"] = "token";
+
+		if(!discovery) {
+			root["payload"]["appliance"]["applianceId"] = applianceId;
+			root["payload"]["appliance"]["additionalApplianceDetails"] = Json::objectValue;
+		}
+
+		return Json::FastWriter().write(root);
+	}
+
+	static std::string setColor(const std::string& applianceId, double hue, double saturation,
+		double brightness) {
+		Json::Value payload;
+		payload["color"]["hue"] = hue;
+		payload["color"]["saturation"] = saturation;
+		payload["color"]["brightness"] = brightness;
+
+		return directive("SetColorRequest", applianceId, payload);
+	}
+
+private:
+	int fd;
+	std::string buffer;
+};
@@ -0,0 +1,305 @@
+//End-to-end latency of the real hub: TCP directive in, UDP frame out
+//Usage: LatencyHarness [options], see printUsage()
+//
+//Starts AlexaHub on free ports with discovery pointed at loopback, serves
+//its nodes with SimulatedNodes and connects as the Lambda would. For each
+//rate, SetColor directives are sent open loop for a fixed time and the
+//latency from each directive's scheduled send time to its UpdateColor
+//arriving is recorded. The JSON report goes to stdout.
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "CloudClient.hpp"
+#include "SimulatedNodes.hpp"
+
+#include "Color.hpp"
+#include "Metrics.hpp"
+
+static const uint16_t HUES[] = {0, 120, 240};
+
+static void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--hub <path>\tHub binary (./AlexaHub)\n"
+		<< "\t--hub-arg <arg>\tExtra argument for the hub, repeatable\n"
+		<< "\t--rates <r1,r2,...>\tDirectives per second to step through (10,100,500,1000,2000)\n"
+		<< "\t--duration <s>\tSeconds per rate (3)\n"
+		<< "\t--nodes <n>\tSimulated nodes (1)\n"
+		<< "\t--lights <n>\tLights per node (1)\n"
+		<< "\t--leds <n>\tLEDs per light (30)\n";
+}
+
+//Binds an ephemeral TCP port and releases it for the hub to take
+static uint16_t freeTcpPort() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	sockaddr_in local{};
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(local);
+
+	bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local));
+	getsockname(fd, reinterpret_cast<sockaddr*>(&local), &length);
+	close(fd);
+
+	return ntohs(local.sin_port);
+}
+
+static pid_t startHub(const std::string& path, std::vector<std::string> args) {
+	args.insert(args.begin(), path);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		std::vector<char*> argv;
+		for(auto& arg : args) {
+			argv.push_back(&arg[0]);
+		}
+		argv.push_back(nullptr);
+
+		execv(path.c_str(), argv.data());
+		perror("execv");
+		_exit(127);
+	}
+	else if(pid < 0) {
+		throw std::runtime_error(std::string("fork: ") + strerror(errno));
+	}
+
+	return pid;
+}
+
+static std::unique_ptr<CloudClient> connectHub(uint16_t port, pid_t hub) {
+	for(int attempt = 0; attempt < 100; ++attempt) {
+		int status;
+		if(waitpid(hub, &status, WNOHANG) == hub) {
+			throw std::runtime_error("Hub exited during startup");
+		}
+
+		try {
+			return std::make_unique<CloudClient>("127.0.0.1", port);
+		}
+		catch(const std::exception&) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	}
+
+	throw std::runtime_error("Hub did not accept connections on port " + std::to_string(port));
+}
+
+int main(int argc, char* argv[]) {
+	std::string hubPath = "./AlexaHub";
+	std::vector<std::string> hubArgs;
+	std::vector<double> rates{10, 100, 500, 1000, 2000};
+	double duration = 3;
+
+	SimulatedNodes::Config config;
+	config.port = 0;
+
+	try {
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+			bool hasValue = (i+1 < argc);
+
+			if( (arg == "--hub") && hasValue ) {
+				hubPath = argv[++i];
+			}
+			else if( (arg == "--hub-arg") && hasValue ) {
+				hubArgs.push_back(argv[++i]);
+			}
+			else if( (arg == "--rates") && hasValue ) {
+				rates.clear();
+
+				std::istringstream list(argv[++i]);
+				std::string rate;
+				while(std::getline(list, rate, ',')) {
+					rates.push_back(std::stod(rate));
+				}
+			}
+			else if( (arg == "--duration") && hasValue ) {
+				duration = std::stod(argv[++i]);
+			}
+			else if( (arg == "--nodes") && hasValue ) {
+				config.nodes = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--lights") && hasValue ) {
+				config.lightsPerNode = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--leds") && hasValue ) {
+				config.leds = std::stoul(argv[++i]);
+			}
+			else {
+				throw std::runtime_error("Unknown option " + arg);
+			}
+		}
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	pid_t hub = -1;
+
+	try {
+		SimulatedNodes nodes{config};
+		auto lights = nodes.getLightCount();
+
+		//Directives in flight per light, oldest first. A frame answers the
+		//oldest one with its hue, anything older was dropped or deduplicated.
+		struct Directive {
+			uint64_t ns;
+			uint8_t hue;
+		};
+
+		std::mutex awaitingMutex;
+		std::vector<std::deque<Directive>> awaiting(lights);
+		std::unique_ptr<Metrics::Histogram> latency;
+
+		nodes.setFrameHandler([&](const SimulatedNodes::Frame& frame) {
+			std::lock_guard<std::mutex> awaitingLock(awaitingMutex);
+			auto& queue = awaiting[frame.node*config.lightsPerNode + frame.light];
+
+			auto match = std::find_if(queue.begin(), queue.end(), [&frame](const Directive& directive) {
+				return directive.hue == frame.hue;
+			});
+
+			if(match != queue.end()) {
+				latency->record(frame.ns - match->ns);
+				queue.erase(queue.begin(), match + 1);
+			}
+		});
+
+		std::thread simulator([&nodes]() { nodes.run(); });
+
+		auto cloudPort = freeTcpPort();
+		hubArgs.insert(hubArgs.end(), {"--cloud-port", std::to_string(cloudPort),
+			"--light-port", std::to_string(nodes.getPort()), "--discovery-address", "127.0.0.1",
+			"--metrics-port", "0", "--log-level", "warning"});
+
+		hub = startHub(hubPath, hubArgs);
+
+		{
+			auto poller = connectHub(cloudPort, hub);
+
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+			while(poller->countAppliances("sim-") != static_cast<long>(lights)) {
+				if(std::chrono::steady_clock::now() > deadline) {
+					throw std::runtime_error("Hub did not discover every simulated light");
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+		}
+
+		std::cerr << "Hub discovered " << lights << " lights" << std::endl;
+
+		auto client = connectHub(cloudPort, hub);
+		std::thread reader([&client]() {
+			std::string response;
+			while(client->receive(response)) {
+			}
+		});
+
+		Json::Value report;
+		report["nodes"] = static_cast<Json::UInt64>(config.nodes);
+		report["lights"] = static_cast<Json::UInt64>(lights);
+		report["leds"] = config.leds;
+		report["rates"] = Json::arrayValue;
+
+		uint64_t n = 0;
+		for(auto rate : rates) {
+			{
+				std::lock_guard<std::mutex> awaitingLock(awaitingMutex);
+				latency = std::make_unique<Metrics::Histogram>();
+
+				for(auto& queue : awaiting) {
+					queue.clear();
+				}
+			}
+
+			auto period = std::chrono::nanoseconds(static_cast<int64_t>(1e9/rate));
+			auto start = std::chrono::steady_clock::now();
+			auto next = start;
+			uint64_t sent = 0;
+			bool connected = true;
+
+			while(connected && (next - start < std::chrono::duration<double>(duration))) {
+				std::this_thread::sleep_until(next);
+
+				//Each light cycles red, green, blue so consecutive frames always
+				//differ and the hub never skips one as unchanged
+				auto light = n % lights;
+				auto hue = HUES[(n/lights) % 3];
+				auto msg = CloudClient::setColor(SimulatedNodes::lightId(light/config.lightsPerNode,
+					light%config.lightsPerNode), hue, 1., 1.);
+				++n;
+
+				{
+					std::lock_guard<std::mutex> awaitingLock(awaitingMutex);
+					awaiting[light].push_back({static_cast<uint64_t>(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count()),
+						Color::HSV(hue*255/360, 255, 255).getHue()});
+				}
+
+				connected = client->send(msg);
+				++sent;
+				next += period;
+			}
+
+			//Let the tail of the run arrive
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+			std::lock_guard<std::mutex> awaitingLock(awaitingMutex);
+
+			Json::Value result;
+			result["rate"] = rate;
+			result["sent"] = static_cast<Json::UInt64>(sent);
+			result["received"] = static_cast<Json::UInt64>(latency->count());
+			result["lost"] = static_cast<Json::UInt64>(sent - latency->count());
+			result["p50_ms"] = latency->percentile(0.5)/1e6;
+			result["p99_ms"] = latency->percentile(0.99)/1e6;
+			result["p999_ms"] = latency->percentile(0.999)/1e6;
+			result["max_ms"] = latency->max()/1e6;
+			report["rates"].append(result);
+
+			std::cerr << rate << "/s: p50 " << result["p50_ms"].asDouble() << " ms, p99 "
+				<< result["p99_ms"].asDouble() << " ms, p999 " << result["p999_ms"].asDouble()
+				<< " ms, lost " << result["lost"].asUInt64() << std::endl;
+
+			if(!connected) {
+				std::cerr << "[Error] Hub closed the connection" << std::endl;
+				break;
+			}
+		}
+
+		shutdown(client->getFd(), SHUT_RDWR);
+		reader.join();
+
+		kill(hub, SIGINT);
+		waitpid(hub, nullptr, 0);
+
+		nodes.stop();
+		simulator.join();
+
+		std::cout << Json::StyledWriter().write(report);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+
+		if(hub > 0) {
+			kill(hub, SIGINT);
+			waitpid(hub, nullptr, 0);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
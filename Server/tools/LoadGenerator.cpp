@@ -0,0 +1,633 @@
+//Open-loop load generator for the cloud port
+//Usage: LoadGenerator [options], see printUsage()
+//
+//Opens many connections to CloudServer and sends a weighted mix of
+//directives at a fixed total rate, spread round robin over the
+//connections. Each directive is due at a time fixed in advance and its
+//latency is measured from then, not from when it was actually written, so
+//a hub that falls behind shows up in the percentiles instead of slowing
+//the generator down. Responses are matched in order per connection.
+//
+//Targets are taken from the hub's own DiscoverAppliancesRequest answer,
+//so run it against a hub that already knows its lights (see NodeSimulator).
+//The JSON report goes to stdout.
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <deque>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "CloudClient.hpp"
+
+#include "Metrics.hpp"
+
+static void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--cloud <ip:port>\tHub cloud port (127.0.0.1:9160)\n"
+		<< "\t--connections <n>\tConcurrent connections (1000)\n"
+		<< "\t--rate <n>\tDirectives per second over all connections (1000)\n"
+		<< "\t--duration <s>\tSeconds of load (10)\n"
+		<< "\t--mix <name=weight,...>\tOf color, percentage, on, off, discover\n"
+		<< "\t\t\t(color=70,percentage=10,on=10,off=5,discover=5)\n"
+		<< "\t--appliance-prefix <prefix>\tOnly target appliances whose id starts with it\n"
+		<< "\t--threads <n>\tSending threads, each owns a share of connections and rate (1)\n"
+		<< "\t--drain <s>\tWait this long for outstanding responses after the run (2)\n"
+		<< "\t--seed <n>\n";
+}
+
+static uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Prebuilt directives, picked by weight
+class Mix {
+public:
+	Mix(const std::string& spec, const std::vector<std::string>& appliances) {
+		std::istringstream list(spec);
+		std::string entry;
+
+		while(std::getline(list, entry, ',')) {
+			auto equals = entry.find('=');
+			auto name = entry.substr(0, equals);
+			double weight = (equals == std::string::npos) ? 1. : std::stod(entry.substr(equals + 1));
+
+			std::vector<std::string> messages;
+
+			if(name == "discover") {
+				messages.push_back(CloudClient::directive("DiscoverAppliancesRequest", ""));
+			}
+			else {
+				if(appliances.empty()) {
+					throw std::runtime_error("No appliances to send " + name + " to");
+				}
+
+				//Several variants per appliance, so repeated directives to one
+				//appliance change its state instead of being deduplicated
+				for(size_t i = 0; i < appliances.size()*VARIANTS; ++i) {
+					messages.push_back(build(name, appliances[i/VARIANTS], i));
+				}
+			}
+
+			directives.push_back(std::move(messages));
+			weights.push_back(weight);
+		}
+
+		if(directives.empty()) {
+			throw std::runtime_error("Empty directive mix");
+		}
+
+		kind = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+	}
+
+	template<typename Rng>
+	const std::string& pick(Rng& rng) {
+		const auto& messages = directives[kind(rng)];
+
+		return messages[std::uniform_int_distribution<size_t>(0, messages.size() - 1)(rng)];
+	}
+
+private:
+	static const size_t VARIANTS = 12;
+
+	static std::string build(const std::string& name, const std::string& id, size_t i) {
+		if(name == "color") {
+			return CloudClient::setColor(id, (i*30) % 360, 1., 1.);
+		}
+		else if(name == "percentage") {
+			Json::Value payload;
+			payload["percentageState"]["value"] = static_cast<double>((i*8) % 101);
+
+			return CloudClient::directive("SetPercentageRequest", id, payload);
+		}
+		else if(name == "on") {
+			return CloudClient::directive("TurnOnRequest", id);
+		}
+		else if(name == "off") {
+			return CloudClient::directive("TurnOffRequest", id);
+		}
+
+		throw std::runtime_error("Unknown directive " + name);
+	}
+
+	std::vector<std::vector<std::string>> directives;
+	std::vector<double> weights;
+	std::discrete_distribution<size_t> kind;
+};
+
+struct Results {
+	Results()
+		:	established{0}
+		,	connectFailed{0}
+		,	closedByPeer{0}
+		,	sent{0}
+		,	responses{0}
+		,	unexpected{0}
+		,	failed{0}
+		,	unanswered{0}
+		,	unsendable{0} {
+	}
+
+	Metrics::Histogram latency, sendLag;
+
+	std::atomic<uint64_t> established, connectFailed, closedByPeer;
+	std::atomic<uint64_t> sent, responses, unexpected, failed, unanswered, unsendable;
+};
+
+//One thread's share of the connections, driven by epoll
+class Worker {
+public:
+	Worker(const sockaddr_in& _server, size_t connectionCount, double rate, const Mix& _mix,
+		Results& _results, unsigned seed)
+		:	server(_server)
+		,	connections(connectionCount)
+		,	period(static_cast<uint64_t>(1e9/rate))
+		,	mix(_mix)
+		,	results(_results)
+		,	rng{seed} {
+
+		epoll = epoll_create1(0);
+		if(epoll < 0) {
+			throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+		}
+	}
+
+	~Worker() {
+		for(auto& connection : connections) {
+			if(connection.fd >= 0) {
+				::close(connection.fd);
+			}
+		}
+
+		::close(epoll);
+	}
+
+	//Opens every connection and waits until each has succeeded or failed
+	void connectAll(uint64_t timeout) {
+		auto start = now();
+
+		for(size_t i = 0; i < connections.size(); ++i) {
+			auto& connection = connections[i];
+
+			connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if(connection.fd < 0) {
+				++results.connectFailed;
+				continue;
+			}
+
+			int on = 1;
+			setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			if( (::connect(connection.fd, reinterpret_cast<const sockaddr*>(&server), sizeof(server)) < 0)
+				&& (errno != EINPROGRESS) ) {
+				closeConnection(connection, false);
+				++results.connectFailed;
+				continue;
+			}
+
+			epoll_event event{};
+			event.events = EPOLLIN | EPOLLOUT;
+			event.data.u64 = i;
+			epoll_ctl(epoll, EPOLL_CTL_ADD, connection.fd, &event);
+
+			++pendingConnects;
+		}
+
+		while( (pendingConnects > 0) && (now() - start < timeout) ) {
+			poll(10);
+		}
+
+		for(auto& connection : connections) {
+			if( (connection.fd >= 0) && !connection.connected ) {
+				closeConnection(connection, false);
+				++results.connectFailed;
+			}
+		}
+
+		pendingConnects = 0;
+	}
+
+	//Sends on schedule from start until end, then waits for responses until drainEnd
+	void run(uint64_t start, uint64_t end, uint64_t drainEnd) {
+		uint64_t next = start;
+		size_t turn = 0;
+
+		for(;;) {
+			auto t = now();
+
+			if(next < end) {
+				//Catch up on every directive that is due, however late
+				while( (next <= t) && (next < end) ) {
+					send(next, turn);
+					next += period;
+				}
+
+				auto wait = (std::min(next, end) > t) ? (std::min(next, end) - t)/1000000 : 0;
+				poll(static_cast<int>(std::min<uint64_t>(wait, 10)));
+			}
+			else if( (t < drainEnd) && (inFlight() > 0) ) {
+				poll(10);
+			}
+			else {
+				break;
+			}
+		}
+
+		results.unanswered += inFlight();
+	}
+
+private:
+	struct Connection {
+		Connection()
+			:	fd{-1}
+			,	connected{false}
+			,	waitingWritable{false}
+			,	outOffset{0} {
+		}
+
+		int fd;
+		bool connected, waitingWritable;
+
+		std::string out, in;
+		size_t outOffset;
+
+		//Due times of the directives sent and not yet answered
+		std::deque<uint64_t> inFlight;
+	};
+
+	void send(uint64_t due, size_t& turn) {
+		//Round robin over the connections that are still open
+		for(size_t tries = 0; tries < connections.size(); ++tries) {
+			auto& connection = connections[turn];
+			turn = (turn + 1) % connections.size();
+
+			if(!connection.connected) {
+				continue;
+			}
+
+			connection.out += mix.pick(rng);
+			connection.out += "\r\n\r\n";
+			connection.inFlight.push_back(due);
+			++results.sent;
+
+			results.sendLag.record(now() - due);
+
+			flush(connection);
+			return;
+		}
+
+		++results.unsendable;
+	}
+
+	void flush(Connection& connection) {
+		while(connection.outOffset < connection.out.size()) {
+			auto n = ::send(connection.fd, connection.out.data() + connection.outOffset,
+				connection.out.size() - connection.outOffset, MSG_NOSIGNAL);
+
+			if(n < 0) {
+				if( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+					closeConnection(connection, true);
+				}
+				else if(!connection.waitingWritable) {
+					watch(connection, true);
+				}
+
+				return;
+			}
+
+			connection.outOffset += n;
+		}
+
+		connection.out.clear();
+		connection.outOffset = 0;
+
+		if(connection.waitingWritable) {
+			watch(connection, false);
+		}
+	}
+
+	//Only asks for EPOLLOUT while the hub is not taking our output
+	void watch(Connection& connection, bool writable) {
+		connection.waitingWritable = writable;
+
+		epoll_event event{};
+		event.events = EPOLLIN;
+		if(writable) {
+			event.events |= EPOLLOUT;
+		}
+		event.data.u64 = &connection - connections.data();
+		epoll_ctl(epoll, EPOLL_CTL_MOD, connection.fd, &event);
+	}
+
+	void receive(Connection& connection) {
+		char chunk[16384];
+
+		for(;;) {
+			auto n = recv(connection.fd, chunk, sizeof(chunk), 0);
+
+			if(n == 0) {
+				closeConnection(connection, true);
+				return;
+			}
+			else if(n < 0) {
+				if( (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+					closeConnection(connection, true);
+				}
+
+				return;
+			}
+
+			connection.in.append(chunk, n);
+
+			size_t begin = 0, end;
+			auto t = now();
+
+			while((end = connection.in.find('\n', begin)) != std::string::npos) {
+				if(!connection.inFlight.empty()) {
+					results.latency.record(t - connection.inFlight.front());
+					connection.inFlight.pop_front();
+				}
+
+				++results.responses;
+
+				//Every answer the hub gives names a Confirmation or Response
+				if( (connection.in.find("Confirmation", begin) >= end)
+					&& (connection.in.find("Response", begin) >= end) ) {
+					++results.unexpected;
+				}
+
+				begin = end + 1;
+			}
+
+			connection.in.erase(0, begin);
+		}
+	}
+
+	void poll(int timeoutMs) {
+		epoll_event events[256];
+		int count = epoll_wait(epoll, events, 256, timeoutMs);
+
+		for(int i = 0; i < count; ++i) {
+			auto& connection = connections[events[i].data.u64];
+
+			if(connection.fd < 0) {
+				continue;
+			}
+
+			if(!connection.connected) {
+				int error = 0;
+				socklen_t length = sizeof(error);
+				getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+				--pendingConnects;
+
+				if( (error != 0) || (events[i].events & (EPOLLERR | EPOLLHUP)) ) {
+					closeConnection(connection, false);
+					++results.connectFailed;
+					continue;
+				}
+
+				connection.connected = true;
+				++results.established;
+
+				watch(connection, false);
+				continue;
+			}
+
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				receive(connection);
+			}
+
+			if( (connection.fd >= 0) && (events[i].events & EPOLLOUT) ) {
+				flush(connection);
+			}
+		}
+
+	}
+
+	void closeConnection(Connection& connection, bool byPeer) {
+		if(byPeer) {
+			++results.closedByPeer;
+		}
+
+		results.failed += connection.inFlight.size();
+		connection.inFlight.clear();
+
+		::close(connection.fd);
+		connection.fd = -1;
+		connection.connected = false;
+	}
+
+	size_t inFlight() const {
+		size_t count = 0;
+		for(const auto& connection : connections) {
+			count += connection.inFlight.size();
+		}
+
+		return count;
+	}
+
+	sockaddr_in server;
+	std::vector<Connection> connections;
+	uint64_t period;
+
+	Mix mix;
+	Results& results;
+	std::mt19937 rng;
+
+	int epoll;
+	size_t pendingConnects = 0;
+};
+
+int main(int argc, char* argv[]) {
+	std::string cloudAddress = "127.0.0.1", mixSpec = "color=70,percentage=10,on=10,off=5,discover=5";
+	std::string prefix;
+	uint16_t cloudPort = 9160;
+	size_t connectionCount = 1000, threadCount = 1;
+	double rate = 1000, duration = 10, drain = 2;
+	unsigned seed = 1;
+
+	try {
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+			bool hasValue = (i+1 < argc);
+
+			if( (arg == "--cloud") && hasValue ) {
+				std::string endpoint{argv[++i]};
+				auto colon = endpoint.find(':');
+
+				cloudAddress = endpoint.substr(0, colon);
+				if(colon != std::string::npos) {
+					cloudPort = std::stoul(endpoint.substr(colon + 1));
+				}
+			}
+			else if( (arg == "--connections") && hasValue ) {
+				connectionCount = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--rate") && hasValue ) {
+				rate = std::stod(argv[++i]);
+			}
+			else if( (arg == "--duration") && hasValue ) {
+				duration = std::stod(argv[++i]);
+			}
+			else if( (arg == "--mix") && hasValue ) {
+				mixSpec = argv[++i];
+			}
+			else if( (arg == "--appliance-prefix") && hasValue ) {
+				prefix = argv[++i];
+			}
+			else if( (arg == "--threads") && hasValue ) {
+				threadCount = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--drain") && hasValue ) {
+				drain = std::stod(argv[++i]);
+			}
+			else if( (arg == "--seed") && hasValue ) {
+				seed = std::stoul(argv[++i]);
+			}
+			else {
+				throw std::runtime_error("Unknown option " + arg);
+			}
+		}
+
+		if( (threadCount < 1) || (threadCount > connectionCount) || (rate <= 0) ) {
+			throw std::runtime_error("Need rate > 0 and 1 to --connections threads");
+		}
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		//Thousands of sockets need more than the usual 1024 descriptors
+		rlimit files;
+		if( (getrlimit(RLIMIT_NOFILE, &files) == 0) && (files.rlim_cur < connectionCount + 64) ) {
+			files.rlim_cur = std::min<rlim_t>(files.rlim_max, connectionCount + 64);
+			setrlimit(RLIMIT_NOFILE, &files);
+		}
+
+		std::vector<std::string> appliances;
+		{
+			CloudClient client{cloudAddress, cloudPort};
+
+			std::string response;
+			Json::Value root;
+			if( !client.send(CloudClient::directive("DiscoverAppliancesRequest", ""))
+				|| !client.receive(response) || !Json::Reader().parse(response, root) ) {
+				throw std::runtime_error("Discovery request to the hub failed");
+			}
+
+			for(const auto& appliance : root["payload"]["discoveredAppliances"]) {
+				auto id = appliance["applianceId"].asString();
+
+				if(id.compare(0, prefix.size(), prefix) == 0) {
+					appliances.push_back(id);
+				}
+			}
+		}
+
+		Mix mix{mixSpec, appliances};
+
+		sockaddr_in server{};
+		server.sin_family = AF_INET;
+		server.sin_port = htons(cloudPort);
+		if(inet_pton(AF_INET, cloudAddress.c_str(), &server.sin_addr) != 1) {
+			throw std::runtime_error("Invalid address " + cloudAddress);
+		}
+
+		Results results;
+		std::vector<std::unique_ptr<Worker>> workers;
+
+		for(size_t i = 0; i < threadCount; ++i) {
+			auto share = connectionCount/threadCount + ((i < connectionCount%threadCount) ? 1 : 0);
+
+			workers.push_back(std::make_unique<Worker>(server, share, rate/threadCount, mix, results,
+				seed + i));
+		}
+
+		std::cerr << "Connecting " << connectionCount << " clients to " << cloudAddress << ":"
+			<< cloudPort << ", " << appliances.size() << " appliances" << std::endl;
+
+		auto connectStart = now();
+		{
+			std::vector<std::thread> threads;
+			for(auto& worker : workers) {
+				threads.emplace_back([&worker]() { worker->connectAll(5000000000ULL); });
+			}
+			for(auto& thread : threads) {
+				thread.join();
+			}
+		}
+		auto connectTime = now() - connectStart;
+
+		std::cerr << results.established << " connected, " << results.connectFailed
+			<< " failed, running " << rate << "/s for " << duration << " s" << std::endl;
+
+		auto start = now() + 10000000;
+		auto end = start + static_cast<uint64_t>(duration*1e9);
+		auto drainEnd = end + static_cast<uint64_t>(drain*1e9);
+		{
+			std::vector<std::thread> threads;
+			for(auto& worker : workers) {
+				threads.emplace_back([&worker, start, end, drainEnd]() { worker->run(start, end, drainEnd); });
+			}
+			for(auto& thread : threads) {
+				thread.join();
+			}
+		}
+
+		Json::Value report;
+		report["target_rate"] = rate;
+		report["duration"] = duration;
+		report["threads"] = static_cast<Json::UInt64>(threadCount);
+		report["mix"] = mixSpec;
+
+		auto& connections = report["connections"];
+		connections["requested"] = static_cast<Json::UInt64>(connectionCount);
+		connections["established"] = static_cast<Json::UInt64>(results.established.load());
+		connections["connect_failed"] = static_cast<Json::UInt64>(results.connectFailed.load());
+		connections["closed_by_peer"] = static_cast<Json::UInt64>(results.closedByPeer.load());
+		connections["connect_all_ms"] = connectTime/1e6;
+
+		auto& requests = report["requests"];
+		requests["sent"] = static_cast<Json::UInt64>(results.sent.load());
+		requests["responses"] = static_cast<Json::UInt64>(results.responses.load());
+		requests["unexpected_responses"] = static_cast<Json::UInt64>(results.unexpected.load());
+		requests["lost_to_closed_connection"] = static_cast<Json::UInt64>(results.failed.load());
+		requests["unanswered"] = static_cast<Json::UInt64>(results.unanswered.load());
+		requests["unsendable"] = static_cast<Json::UInt64>(results.unsendable.load());
+
+		auto scheduled = results.sent + results.unsendable;
+		auto errors = results.unexpected + results.failed + results.unanswered + results.unsendable;
+		report["error_rate"] = (scheduled == 0) ? 0. : static_cast<double>(errors)/scheduled;
+		report["throughput"] = results.responses/duration;
+
+		auto& ms = report["latency_ms"];
+		ms["p50"] = results.latency.percentile(0.5)/1e6;
+		ms["p90"] = results.latency.percentile(0.9)/1e6;
+		ms["p99"] = results.latency.percentile(0.99)/1e6;
+		ms["p999"] = results.latency.percentile(0.999)/1e6;
+		ms["max"] = results.latency.max()/1e6;
+
+		//How late the generator itself wrote directives, large values mean it
+		//was the bottleneck and needs more --threads
+		auto& lag = report["send_lag_ms"];
+		lag["p99"] = results.sendLag.percentile(0.99)/1e6;
+		lag["max"] = results.sendLag.max()/1e6;
+
+		std::cout << Json::StyledWriter().write(report);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+//Converts a binary log written with --log-binary back into text
+//Usage: LogDecode <file> [--level <level>]
+//Must run on a host with the same byte order as the hub
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+
+int main(int argc, char* argv[]) {
+	if( (argc != 2) && !((argc == 4) && (std::string{argv[2]} == "--level")) ) {
+		std::cerr << "Usage: " << argv[0] << " <file> [--level <level>]" << std::endl;
+		return 1;
+	}
+
+	auto minLevel = Log::Level::Debug;
+	if(argc == 4) {
+		try {
+			minLevel = Log::parseLevel(argv[3]);
+		}
+		catch(const std::exception& e) {
+			std::cerr << "[Error] " << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	auto file = fopen(argv[1], "rb");
+	if(file == nullptr) {
+		std::cerr << "[Error] Unable to open " << argv[1] << std::endl;
+		return 1;
+	}
+
+	char magic[sizeof(Log::BINARY_MAGIC)];
+	if( (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
+		|| (memcmp(magic, Log::BINARY_MAGIC, sizeof(magic)) != 0) ) {
+		std::cerr << "[Error] " << argv[1] << " is not a binary log" << std::endl;
+		fclose(file);
+		return 1;
+	}
+
+	std::vector<uint8_t> payload;
+	size_t count = 0;
+
+	for(;;) {
+		uint64_t timestamp;
+		uint32_t thread, length;
+		Log::Level level;
+		uint8_t flags;
+
+		if(fread(&timestamp, sizeof(timestamp), 1, file) != 1) {
+			break;
+		}
+
+		if( (fread(&thread, sizeof(thread), 1, file) != 1)
+			|| (fread(&level, sizeof(level), 1, file) != 1)
+			|| (fread(&flags, sizeof(flags), 1, file) != 1)
+			|| (fread(&length, sizeof(length), 1, file) != 1) ) {
+			std::cerr << "[Error] Truncated record header after " << count << " records" << std::endl;
+			break;
+		}
+
+		payload.resize(length);
+		if(fread(payload.data(), 1, length, file) != length) {
+			std::cerr << "[Error] Truncated record payload after " << count << " records" << std::endl;
+			break;
+		}
+
+		if(level >= minLevel) {
+			std::cout << Log::format(timestamp, level, thread, payload.data(), payload.size(), flags)
+				<< "\n";
+		}
+
+		++count;
+	}
+
+	fclose(file);
+
+	return 0;
+}
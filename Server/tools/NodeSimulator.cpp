@@ -0,0 +1,278 @@
+//Simulates a fleet of light nodes on loopback for load and scale testing
+//Usage: NodeSimulator [options], see printUsage()
+//
+//Run the hub with --discovery-address 127.0.0.1 so NodeInfo reaches the
+//simulator instead of the LAN. On exit a JSON report is written to stdout:
+//time to full discovery, frames received and, with --drive-rate, the
+//latency from a SetColor directive being sent to its frame arriving.
+//Full discovery is confirmed by polling the hub's cloud port with
+//DiscoverAppliancesRequest until it lists every simulated light.
+
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include "CloudClient.hpp"
+#include "SimulatedNodes.hpp"
+
+#include "Metrics.hpp"
+
+static std::atomic<bool> interrupted{false};
+
+static void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--port <port>\tUDP port the hub sends to (5492)\n"
+		<< "\t--first-address <ip>\tAddress of node 0, node i uses the i-th next (127.1.0.1)\n"
+		<< "\t--nodes <n>\t(1000)\n"
+		<< "\t--lights <n>\tLights per node (1)\n"
+		<< "\t--leds <n>\tLEDs per light (30)\n"
+		<< "\t--jitter-ms <ms>\tRandom delay added to every response (0)\n"
+		<< "\t--duration <s>\tStop after this long, otherwise on SIGINT\n"
+		<< "\t--record <file>\tWrite every received frame as CSV\n"
+		<< "\t--drive-rate <n>\tOnce discovered, send n SetColor directives per second\n"
+		<< "\t--cloud <ip:port>\tHub cloud port, polled for discovery and driven (127.0.0.1:9160)\n"
+		<< "\t--no-poll\tDo not connect to the cloud port to confirm discovery\n"
+		<< "\t--legacy\tAnswer NodeInfo without a configuration hash\n"
+		<< "\t--seed <n>\n";
+}
+
+int main(int argc, char* argv[]) {
+	SimulatedNodes::Config config;
+	config.nodes = 1000;
+
+	double duration = 0, driveRate = 0;
+	std::string recordFile, cloudAddress = "127.0.0.1";
+	uint16_t cloudPort = 9160;
+	bool poll = true;
+
+	try {
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+			bool hasValue = (i+1 < argc);
+
+			if( (arg == "--port") && hasValue ) {
+				config.port = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--first-address") && hasValue ) {
+				in_addr address;
+				if(inet_pton(AF_INET, argv[++i], &address) != 1) {
+					throw std::runtime_error(std::string("Invalid address ") + argv[i]);
+				}
+				config.firstAddress = ntohl(address.s_addr);
+			}
+			else if( (arg == "--nodes") && hasValue ) {
+				config.nodes = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--lights") && hasValue ) {
+				config.lightsPerNode = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--leds") && hasValue ) {
+				config.leds = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--jitter-ms") && hasValue ) {
+				config.jitter = std::chrono::microseconds(
+					static_cast<int64_t>(1000*std::stod(argv[++i])));
+			}
+			else if( (arg == "--duration") && hasValue ) {
+				duration = std::stod(argv[++i]);
+			}
+			else if( (arg == "--record") && hasValue ) {
+				recordFile = argv[++i];
+				config.recordFrames = true;
+			}
+			else if( (arg == "--drive-rate") && hasValue ) {
+				driveRate = std::stod(argv[++i]);
+			}
+			else if( (arg == "--cloud") && hasValue ) {
+				std::string endpoint{argv[++i]};
+				auto colon = endpoint.find(':');
+
+				cloudAddress = endpoint.substr(0, colon);
+				if(colon != std::string::npos) {
+					cloudPort = std::stoul(endpoint.substr(colon + 1));
+				}
+			}
+			else if(arg == "--no-poll") {
+				poll = false;
+			}
+			else if(arg == "--legacy") {
+				config.legacy = true;
+			}
+			else if( (arg == "--seed") && hasValue ) {
+				config.seed = std::stoul(argv[++i]);
+			}
+			else {
+				throw std::runtime_error("Unknown option " + arg);
+			}
+		}
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		SimulatedNodes nodes{config};
+		auto lights = nodes.getLightCount();
+
+		//Send time of the directive each light is waiting on, 0 if none
+		std::unique_ptr<std::atomic<uint64_t>[]> awaiting{new std::atomic<uint64_t>[lights]};
+		for(size_t i = 0; i < lights; ++i) {
+			awaiting[i] = 0;
+		}
+
+		Metrics::Histogram latency;
+		std::atomic<uint64_t> directivesSent{0};
+
+		nodes.setFrameHandler([&](const SimulatedNodes::Frame& frame) {
+			auto sent = awaiting[frame.node*config.lightsPerNode + frame.light].exchange(0);
+
+			if(sent != 0) {
+				latency.record(frame.ns - sent);
+			}
+		});
+
+		std::ofstream record;
+		if(!recordFile.empty()) {
+			record.open(recordFile);
+			record << "ns,node,light,bytes\n";
+		}
+
+		signal(SIGINT, [](int) { interrupted = true; });
+		signal(SIGTERM, [](int) { interrupted = true; });
+
+		std::cerr << "Simulating " << config.nodes << " nodes with " << lights << " lights on port "
+			<< config.port << std::endl;
+
+		std::thread simulator([&nodes]() { nodes.run(); });
+
+		//Drives SetColor at a fixed rate once discovery has finished,
+		//scheduled open loop so a slow hub cannot slow the sender down
+		std::thread driver;
+		std::unique_ptr<CloudClient> client;
+		uint64_t discoveryTime = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		auto elapsed = [&start]() {
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		};
+		auto nextPoll = start;
+
+		while(!interrupted && ((duration == 0) || (elapsed() < duration))) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			if( poll && (discoveryTime == 0) && (nodes.getFirstNodeInfo() != 0)
+				&& (std::chrono::steady_clock::now() >= nextPoll) ) {
+				nextPoll = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+
+				try {
+					CloudClient poller{cloudAddress, cloudPort};
+
+					if(poller.countAppliances("sim-") == static_cast<long>(lights)) {
+						discoveryTime = SimulatedNodes::now() - nodes.getFirstNodeInfo();
+
+						std::cerr << "Hub discovered all lights after " << discoveryTime/1e6 << " ms"
+							<< std::endl;
+					}
+				}
+				catch(const std::exception& e) {
+					std::cerr << "[Error] " << e.what() << ", not polling for discovery" << std::endl;
+					poll = false;
+				}
+			}
+
+			bool discovered = poll ? (discoveryTime != 0) : (nodes.getQueryTime() != 0);
+
+			if( (driveRate > 0) && !client && discovered ) {
+				client = std::make_unique<CloudClient>(cloudAddress, cloudPort);
+
+				driver = std::thread([&]() {
+					std::mt19937 rng{config.seed};
+					std::uniform_int_distribution<size_t> pick(0, lights - 1);
+					std::string response;
+
+					std::thread reader([&]() {
+						while(client->receive(response)) {
+						}
+					});
+
+					auto period = std::chrono::nanoseconds(static_cast<int64_t>(1e9/driveRate));
+					auto next = std::chrono::steady_clock::now();
+
+					for(uint64_t n = 0; !interrupted; ++n) {
+						std::this_thread::sleep_until(next);
+						next += period;
+
+						auto light = pick(rng);
+						auto msg = CloudClient::setColor(SimulatedNodes::lightId(
+							light/config.lightsPerNode, light%config.lightsPerNode), n % 360, 1., 1.);
+
+						awaiting[light] = SimulatedNodes::now();
+						if(!client->send(msg)) {
+							break;
+						}
+						++directivesSent;
+					}
+
+					shutdown(client->getFd(), SHUT_RDWR);
+					reader.join();
+				});
+			}
+
+			if(record.is_open()) {
+				for(const auto& frame : nodes.takeFrames()) {
+					record << frame.ns << "," << frame.node << "," << static_cast<int>(frame.light)
+						<< "," << frame.bytes << "\n";
+				}
+			}
+		}
+
+		interrupted = true;
+		if(driver.joinable()) {
+			driver.join();
+		}
+
+		nodes.stop();
+		simulator.join();
+
+		double seconds = elapsed();
+
+		Json::Value report;
+		report["nodes"] = static_cast<Json::UInt64>(config.nodes);
+		report["lights"] = static_cast<Json::UInt64>(lights);
+		report["lights_queried"] = static_cast<Json::UInt64>(nodes.getQueriedLights());
+		report["light_info_requests"] = static_cast<Json::UInt64>(nodes.getLightInfoRequests());
+		report["all_lights_queried_ms"] = (nodes.getQueryTime() == 0) ? Json::Value()
+			: Json::Value(nodes.getQueryTime()/1e6);
+		report["time_to_full_discovery_ms"] = (discoveryTime == 0) ? Json::Value()
+			: Json::Value(discoveryTime/1e6);
+		report["seconds"] = seconds;
+		report["frames_received"] = static_cast<Json::UInt64>(nodes.getFramesReceived());
+		report["frames_per_second"] = nodes.getFramesReceived()/seconds;
+
+		if(driveRate > 0) {
+			auto& drive = report["drive"];
+			drive["rate"] = driveRate;
+			drive["directives_sent"] = static_cast<Json::UInt64>(directivesSent.load());
+			drive["frames_matched"] = static_cast<Json::UInt64>(latency.count());
+
+			auto& ms = drive["latency_ms"];
+			ms["p50"] = latency.percentile(0.5)/1e6;
+			ms["p99"] = latency.percentile(0.99)/1e6;
+			ms["p999"] = latency.percentile(0.999)/1e6;
+			ms["max"] = latency.max()/1e6;
+		}
+
+		std::cout << Json::StyledWriter().write(report);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
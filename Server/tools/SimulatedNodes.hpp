@@ -0,0 +1,396 @@
+#pragma once
+
+//Emulates many light nodes on loopback, speaking the Packet protocol
+//Node i owns the address firstAddress + i (Linux routes all of 127.0.0.0/8
+//to the loopback interface), so LightHub sees each one as a separate node.
+//A single UDP socket bound to the wildcard address serves every node:
+//IP_PKTINFO tells which address a datagram was sent to and picks the
+//source address of the reply. NodeInfo sent to any address that is not a
+//node (e.g. 127.0.0.1 with --discovery-address 127.0.0.1) is answered by
+//every node, like a broadcast.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Packet.hpp"
+
+class SimulatedNodes {
+public:
+	struct Config {
+		uint16_t port = 5492;
+		uint32_t firstAddress = 0x7F010001; //127.1.0.1
+		size_t nodes = 1;
+		size_t lightsPerNode = 1;
+		uint16_t leds = 30;
+
+		//Every response is delayed by a uniform random time up to this
+		std::chrono::microseconds jitter{0};
+		unsigned seed = 1;
+
+		//Answer NodeInfo with the original NodeInfoResponse, without a
+		//configuration hash or boot id
+		bool legacy = false;
+
+		//Keep every received frame for takeFrames(), which must then be
+		//called regularly
+		bool recordFrames = false;
+	};
+
+	struct Frame {
+		uint64_t ns;	//steady_clock time of arrival
+		uint32_t node;
+		uint8_t light;
+		uint32_t bytes;
+		uint8_t hue;	//of the first LED, 0 if the frame has none
+	};
+
+	using FrameHandler = std::function<void(const Frame&)>;
+
+	SimulatedNodes(const Config& _config)
+		:	config(_config)
+		,	running{false}
+		,	queried(config.nodes*config.lightsPerNode, false)
+		,	queriedCount{0}
+		,	lightInfoCount{0}
+		,	firstNodeInfo{0}
+		,	queryTime{0}
+		,	frameCount{0}
+		,	rng{config.seed}
+		,	bootID{std::random_device{}()} {
+
+		if( (config.lightsPerNode < 1) || (config.lightsPerNode > 255) ) {
+			throw std::runtime_error("SimulatedNodes: 1 to 255 lights per node are supported");
+		}
+
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(fd < 0) {
+			throw std::runtime_error(std::string("SimulatedNodes: socket: ") + strerror(errno));
+		}
+
+		int on = 1, buffer = 4 << 20;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(config.port);
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+		if(bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0) {
+			close(fd);
+			throw std::runtime_error("SimulatedNodes: bind to port " + std::to_string(config.port)
+				+ ": " + strerror(errno));
+		}
+	}
+
+	~SimulatedNodes() {
+		close(fd);
+	}
+
+	static std::string nodeName(size_t node) {
+		return "sim-" + std::to_string(node);
+	}
+
+	static std::string lightName(size_t light) {
+		return "light-" + std::to_string(light);
+	}
+
+	//The appliance id AlexaHub gives the light
+	static std::string lightId(size_t node, size_t light) {
+		return nodeName(node) + ":" + lightName(light);
+	}
+
+	const Config& getConfig() const {
+		return config;
+	}
+
+	//The bound port, useful with Config::port 0
+	uint16_t getPort() const {
+		sockaddr_in local{};
+		socklen_t length = sizeof(local);
+		getsockname(fd, reinterpret_cast<sockaddr*>(&local), &length);
+
+		return ntohs(local.sin_port);
+	}
+
+	size_t getLightCount() const {
+		return queried.size();
+	}
+
+	//Called on the simulator thread for every UpdateColor
+	void setFrameHandler(const FrameHandler& handler) {
+		frameHandler = handler;
+	}
+
+	//Serves requests until stop() is called
+	void run() {
+		running = true;
+
+		std::vector<uint8_t> buffer(65536);
+		char control[CMSG_SPACE(sizeof(in_pktinfo))];
+
+		while(running) {
+			auto timeout = 50;
+			if(!pending.empty()) {
+				auto wait = (static_cast<int64_t>(pending.top().due) - static_cast<int64_t>(now()))/1000000;
+				timeout = std::max<int64_t>(0, std::min<int64_t>(timeout, wait));
+			}
+
+			pollfd pfd{fd, POLLIN, 0};
+			if(poll(&pfd, 1, timeout) > 0) {
+				//Drain everything that is ready before handling timers
+				for(;;) {
+					sockaddr_in from{};
+					iovec iov{buffer.data(), buffer.size()};
+					msghdr msg{};
+					msg.msg_name = &from;
+					msg.msg_namelen = sizeof(from);
+					msg.msg_iov = &iov;
+					msg.msg_iovlen = 1;
+					msg.msg_control = control;
+					msg.msg_controllen = sizeof(control);
+
+					auto size = recvmsg(fd, &msg, MSG_DONTWAIT);
+					if(size < 0) {
+						break;
+					}
+
+					uint32_t destination = 0;
+					for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+						if( (cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_PKTINFO) ) {
+							in_pktinfo info;
+							memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+							destination = ntohl(info.ipi_addr.s_addr);
+						}
+					}
+
+					handle(destination, from, buffer.data(), size);
+				}
+			}
+
+			auto t = now();
+			while(!pending.empty() && (pending.top().due <= t)) {
+				const auto& response = pending.top();
+				send(response.source, response.to, response.datagram);
+				pending.pop();
+			}
+		}
+	}
+
+	void stop() {
+		running = false;
+	}
+
+	size_t getQueriedLights() const {
+		return queriedCount;
+	}
+
+	//LightInfo requests received, including repeats
+	uint64_t getLightInfoRequests() const {
+		return lightInfoCount;
+	}
+
+	//steady_clock time of the first NodeInfo, 0 before it
+	uint64_t getFirstNodeInfo() const {
+		return firstNodeInfo;
+	}
+
+	//Nanoseconds from the first NodeInfo until every light had been asked
+	//for its info, 0 before that. Answers may still be lost on the way back.
+	uint64_t getQueryTime() const {
+		return queryTime;
+	}
+
+	uint64_t getFramesReceived() const {
+		return frameCount;
+	}
+
+	//Frames recorded since the last call, with Config::recordFrames
+	std::vector<Frame> takeFrames() {
+		std::lock_guard<std::mutex> framesLock(framesMutex);
+
+		std::vector<Frame> taken;
+		taken.swap(frames);
+
+		return taken;
+	}
+
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+private:
+	struct Response {
+		uint64_t due;
+		uint32_t source;
+		sockaddr_in to;
+		std::vector<uint8_t> datagram;
+
+		bool operator>(const Response& rhs) const {
+			return due > rhs.due;
+		}
+	};
+
+	//FNV-1a over every light's LED count and name, the same for all nodes
+	uint32_t configHash() const {
+		uint32_t hash = 2166136261u;
+		auto add = [&hash](uint8_t byte) {
+			hash = (hash ^ byte) * 16777619u;
+		};
+
+		for(size_t light = 0; light < config.lightsPerNode; ++light) {
+			add(config.leds >> 8);
+			add(config.leds & 0xFF);
+
+			for(auto c : lightName(light)) {
+				add(c);
+			}
+		}
+
+		return hash;
+	}
+
+	void handle(uint32_t destination, const sockaddr_in& from, const uint8_t* data, size_t size) {
+		auto t = now();
+
+		if(size < 2) {
+			return;
+		}
+
+		uint8_t lightID = data[0];
+		auto id = static_cast<Packet::ID>(data[1]);
+
+		size_t node = destination - config.firstAddress;
+		bool isNode = (destination >= config.firstAddress) && (node < config.nodes);
+
+		switch(id) {
+			case Packet::ID::NodeInfo: {
+				uint64_t none = 0;
+				firstNodeInfo.compare_exchange_strong(none, t);
+
+				size_t first = isNode ? node : 0, last = isNode ? node + 1 : config.nodes;
+
+				for(size_t n = first; n < last; ++n) {
+					respond(config.firstAddress + n, from, config.legacy
+						? Packet::NodeInfoResponse(config.lightsPerNode, nodeName(n)).asDatagram()
+						: Packet::NodeInfoResponseV3(config.lightsPerNode, configHash(), bootID,
+							nodeName(n)).asDatagram(), t);
+				}
+			}
+			break;
+
+			case Packet::ID::LightInfo:
+				++lightInfoCount;
+
+				if(isNode && (lightID < config.lightsPerNode)) {
+					respond(destination, from, Packet::LightInfoResponse(lightID, config.leds,
+						lightName(lightID)).asDatagram(), t);
+
+					auto index = node*config.lightsPerNode + lightID;
+					if(!queried[index]) {
+						queried[index] = true;
+
+						if(++queriedCount == queried.size()) {
+							queryTime = t - firstNodeInfo;
+						}
+					}
+				}
+			break;
+
+			case Packet::ID::UpdateColor:
+				if(isNode) {
+					Frame frame{t, static_cast<uint32_t>(node), lightID, static_cast<uint32_t>(size),
+						(size > 3) ? data[3] : uint8_t(0)};
+
+					++frameCount;
+					if(frameHandler) {
+						frameHandler(frame);
+					}
+
+					if(config.recordFrames) {
+						std::lock_guard<std::mutex> framesLock(framesMutex);
+						frames.push_back(frame);
+					}
+				}
+			break;
+
+			default:
+			break;
+		}
+	}
+
+	void respond(uint32_t source, const sockaddr_in& to, std::vector<uint8_t>&& datagram,
+		uint64_t t) {
+		if(config.jitter.count() == 0) {
+			send(source, to, datagram);
+		}
+		else {
+			std::uniform_int_distribution<uint64_t> delay(0,
+				std::chrono::duration_cast<std::chrono::nanoseconds>(config.jitter).count());
+
+			pending.push({t + delay(rng), source, to, std::move(datagram)});
+		}
+	}
+
+	void send(uint32_t source, const sockaddr_in& to, const std::vector<uint8_t>& datagram) {
+		char control[CMSG_SPACE(sizeof(in_pktinfo))]{};
+		iovec iov{const_cast<uint8_t*>(datagram.data()), datagram.size()};
+
+		msghdr msg{};
+		msg.msg_name = const_cast<sockaddr_in*>(&to);
+		msg.msg_namelen = sizeof(to);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+
+		in_pktinfo info{};
+		info.ipi_spec_dst.s_addr = htonl(source);
+		memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+
+		sendmsg(fd, &msg, 0);
+	}
+
+	Config config;
+	int fd;
+	std::atomic<bool> running;
+
+	FrameHandler frameHandler;
+
+	//Owned by the simulator thread
+	std::vector<bool> queried;
+	std::priority_queue<Response, std::vector<Response>, std::greater<Response>> pending;
+
+	std::atomic<size_t> queriedCount;
+	std::atomic<uint64_t> lightInfoCount, firstNodeInfo, queryTime, frameCount;
+
+	std::mutex framesMutex;
+	std::vector<Frame> frames;
+
+	std::mt19937_64 rng;
+
+	//Differs from run to run, like a node's after a reboot
+	uint32_t bootID;
+};
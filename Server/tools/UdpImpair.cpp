@@ -0,0 +1,473 @@
+//UDP impairment proxy between LightHub and light nodes
+//Usage: UdpImpair [options], see printUsage()
+//
+//Listens on the port the hub sends to and forwards every datagram to the
+//same address on the node port, then returns the replies to the hub from
+//the node's own address. IP_PKTINFO keeps the per-node addresses intact in
+//both directions, so the hub still tells SimulatedNodes' 127.1.x.y nodes
+//apart. Each direction can drop, delay, jitter, duplicate and reorder
+//datagrams, and pass them through a rate-limited bottleneck queue.
+//
+//	NodeSimulator --port 5493 --no-poll &
+//	UdpImpair --hub-port 5492 --node-port 5493 --loss 0.05 --to-nodes --rate-kbps 2000 &
+//	AlexaHub --discovery-address 127.0.0.1
+//
+//Per-direction counters are written as JSON to stdout on exit.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+#include "Packet.hpp"
+
+static std::atomic<bool> interrupted{false};
+
+static void printUsage(const char* name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+		<< "\t--hub-port <port>\tPort the hub sends to, the hub's --light-port (5492)\n"
+		<< "\t--node-port <port>\tPort the nodes listen on (5493)\n"
+		<< "\t--duration <s>\tStop after this long, otherwise on SIGINT\n"
+		<< "\t--seed <n>\n"
+		<< "Impairments apply to both directions until --to-nodes or --to-hub selects one:\n"
+		<< "\t--loss <p>\tDrop probability\n"
+		<< "\t--burst <n>\tMean length of loss bursts, 1 drops independently (1)\n"
+		<< "\t--delay-ms <ms>\tFixed one-way delay\n"
+		<< "\t--jitter-ms <ms>\tUniform random delay added on top\n"
+		<< "\t--duplicate <p>\tProbability of sending a datagram twice\n"
+		<< "\t--reorder <p>\tProbability of holding a datagram back by --reorder-gap-ms\n"
+		<< "\t--reorder-gap-ms <ms>\t(5)\n"
+		<< "\t--rate-kbps <n>\tBottleneck bandwidth, 0 for none\n"
+		<< "\t--queue-ms <ms>\tDrop at the bottleneck once this much is queued (100)\n";
+}
+
+static uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Impairment {
+	double loss = 0;
+	double burst = 1;
+	double delayMs = 0;
+	double jitterMs = 0;
+	double duplicate = 0;
+	double reorder = 0;
+	double reorderGapMs = 5;
+	double rateKbps = 0;
+	double queueMs = 100;
+};
+
+//One direction of the link: decides the fate of every datagram
+class Path {
+public:
+	Path(const std::string& _name)
+		:	name(_name)
+		,	inLossBurst{false}
+		,	linkFree{0}
+		,	received{0}
+		,	forwarded{0}
+		,	lost{0}
+		,	queueDropped{0}
+		,	duplicated{0}
+		,	reordered{0}
+		,	bytes{0} {
+	}
+
+	Impairment impairment;
+
+	//Departure times for the datagram, empty if it is dropped
+	template<typename Rng>
+	std::vector<uint64_t> schedule(size_t size, uint64_t t, Rng& rng) {
+		std::uniform_real_distribution<double> uniform(0., 1.);
+		std::vector<uint64_t> departures;
+
+		++received;
+
+		//Gilbert model: the loss state is entered with a probability chosen
+		//so the long-run loss rate stays at impairment.loss
+		const auto& p = impairment;
+		if(p.loss > 0) {
+			double leave = 1./std::max(1., p.burst);
+			double enter = std::min(1., p.loss*leave/std::max(1e-9, 1. - p.loss));
+
+			inLossBurst = inLossBurst ? (uniform(rng) >= leave) : (uniform(rng) < enter);
+
+			if(inLossBurst) {
+				++lost;
+				return departures;
+			}
+		}
+
+		size_t copies = (uniform(rng) < p.duplicate) ? 2 : 1;
+		if(copies > 1) {
+			++duplicated;
+		}
+
+		for(size_t copy = 0; copy < copies; ++copy) {
+			double delay = p.delayMs + p.jitterMs*uniform(rng);
+			if(uniform(rng) < p.reorder) {
+				delay += p.reorderGapMs;
+				++reordered;
+			}
+
+			auto due = t + static_cast<uint64_t>(delay*1e6);
+
+			//Bottleneck: datagrams leave one after another at the link rate
+			if(p.rateKbps > 0) {
+				auto start = std::max(due, linkFree);
+				if(start - due > static_cast<uint64_t>(p.queueMs*1e6)) {
+					++queueDropped;
+					continue;
+				}
+
+				linkFree = start + static_cast<uint64_t>(size*8*1e6/p.rateKbps);
+				due = linkFree;
+			}
+
+			departures.push_back(due);
+			++forwarded;
+			bytes += size;
+		}
+
+		return departures;
+	}
+
+	Json::Value report() const {
+		Json::Value path;
+		path["received"] = static_cast<Json::UInt64>(received);
+		path["forwarded"] = static_cast<Json::UInt64>(forwarded);
+		path["lost"] = static_cast<Json::UInt64>(lost);
+		path["queue_dropped"] = static_cast<Json::UInt64>(queueDropped);
+		path["duplicated"] = static_cast<Json::UInt64>(duplicated);
+		path["reordered"] = static_cast<Json::UInt64>(reordered);
+		path["bytes_forwarded"] = static_cast<Json::UInt64>(bytes);
+
+		return path;
+	}
+
+	const std::string name;
+
+private:
+	bool inLossBurst;
+	uint64_t linkFree;
+
+	uint64_t received, forwarded, lost, queueDropped, duplicated, reordered, bytes;
+};
+
+class Proxy {
+public:
+	Proxy(uint16_t hubPort, uint16_t _nodePort, unsigned seed)
+		:	toNodes("to_nodes")
+		,	toHub("to_hub")
+		,	nodePort(_nodePort)
+		,	hubKnown{false}
+		,	sequence{0}
+		,	rng{seed} {
+
+		hubSide = open(hubPort);
+		nodeSide = open(0);
+	}
+
+	~Proxy() {
+		close(hubSide);
+		close(nodeSide);
+	}
+
+	void run(double duration) {
+		std::vector<uint8_t> buffer(65536);
+		auto end = (duration > 0) ? now() + static_cast<uint64_t>(duration*1e9) : UINT64_MAX;
+
+		while(!interrupted && (now() < end)) {
+			int timeout = 50;
+			if(!pending.empty()) {
+				auto t = now();
+				auto due = pending.top().due;
+				timeout = (due > t) ? std::min<int>(timeout, (due - t)/1000000) : 0;
+			}
+
+			pollfd fds[] = {{hubSide, POLLIN, 0}, {nodeSide, POLLIN, 0}};
+			if(poll(fds, 2, timeout) > 0) {
+				for(auto& fd : fds) {
+					if(fd.revents & POLLIN) {
+						drain(fd.fd, buffer);
+					}
+				}
+			}
+
+			auto t = now();
+			while(!pending.empty() && (pending.top().due <= t)) {
+				const auto& datagram = pending.top();
+				send(datagram.fd, datagram.source, datagram.to, datagram.data);
+				pending.pop();
+			}
+		}
+	}
+
+	Path toNodes, toHub;
+
+private:
+	struct Datagram {
+		uint64_t due, sequence;
+		int fd;
+		uint32_t source;	//host order, 0 lets the kernel choose
+		sockaddr_in to;
+		std::vector<uint8_t> data;
+
+		//Earliest first, in arrival order when equal
+		bool operator>(const Datagram& rhs) const {
+			return (due != rhs.due) ? (due > rhs.due) : (sequence > rhs.sequence);
+		}
+	};
+
+	static int open(uint16_t port) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(fd < 0) {
+			throw std::runtime_error(std::string("UdpImpair: socket: ") + strerror(errno));
+		}
+
+		int on = 1, buffer = 4 << 20;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(port);
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+		if(bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0) {
+			close(fd);
+			throw std::runtime_error("UdpImpair: bind to port " + std::to_string(port) + ": "
+				+ strerror(errno));
+		}
+
+		return fd;
+	}
+
+	static bool isQuery(uint8_t id) {
+		return (id == static_cast<uint8_t>(Packet::ID::NodeInfo))
+			|| (id == static_cast<uint8_t>(Packet::ID::LightInfo));
+	}
+
+	void drain(int fd, std::vector<uint8_t>& buffer) {
+		char control[CMSG_SPACE(sizeof(in_pktinfo))];
+
+		for(;;) {
+			sockaddr_in from{};
+			iovec iov{buffer.data(), buffer.size()};
+			msghdr msg{};
+			msg.msg_name = &from;
+			msg.msg_namelen = sizeof(from);
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			auto size = recvmsg(fd, &msg, MSG_DONTWAIT);
+			if(size < 0) {
+				return;
+			}
+
+			uint32_t destination = 0;
+			for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if( (cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_PKTINFO) ) {
+					in_pktinfo info;
+					memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+					destination = ntohl(info.ipi_addr.s_addr);
+				}
+			}
+
+			auto t = now();
+
+			if(fd == hubSide) {
+				//Hub to node: same address, node port. Frames may come from
+				//per-node sockets, replies belong to the socket that queried.
+				if( (size >= 2) && (isQuery(buffer[1])) ) {
+					hub = from;
+					hubKnown = true;
+				}
+
+				sockaddr_in to{};
+				to.sin_family = AF_INET;
+				to.sin_port = htons(nodePort);
+				to.sin_addr.s_addr = htonl(destination);
+
+				enqueue(toNodes, nodeSide, 0, to, buffer.data(), size, t);
+			}
+			else if(hubKnown) {
+				//Node to hub: sent from the node's address on the hub-facing port
+				enqueue(toHub, hubSide, ntohl(from.sin_addr.s_addr), hub, buffer.data(), size, t);
+			}
+		}
+	}
+
+	void enqueue(Path& path, int fd, uint32_t source, const sockaddr_in& to, const uint8_t* data,
+		size_t size, uint64_t t) {
+		for(auto due : path.schedule(size, t, rng)) {
+			pending.push({due, sequence++, fd, source, to, std::vector<uint8_t>(data, data + size)});
+		}
+	}
+
+	static void send(int fd, uint32_t source, const sockaddr_in& to, const std::vector<uint8_t>& data) {
+		char control[CMSG_SPACE(sizeof(in_pktinfo))]{};
+		iovec iov{const_cast<uint8_t*>(data.data()), data.size()};
+
+		msghdr msg{};
+		msg.msg_name = const_cast<sockaddr_in*>(&to);
+		msg.msg_namelen = sizeof(to);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if(source != 0) {
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			auto cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = IPPROTO_IP;
+			cmsg->cmsg_type = IP_PKTINFO;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+
+			in_pktinfo info{};
+			info.ipi_spec_dst.s_addr = htonl(source);
+			memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+		}
+
+		sendmsg(fd, &msg, 0);
+	}
+
+	uint16_t nodePort;
+	int hubSide, nodeSide;
+
+	sockaddr_in hub;
+	bool hubKnown;
+
+	std::priority_queue<Datagram, std::vector<Datagram>, std::greater<Datagram>> pending;
+	uint64_t sequence;
+
+	std::mt19937_64 rng;
+};
+
+int main(int argc, char* argv[]) {
+	uint16_t hubPort = 5492, nodePort = 5493;
+	double duration = 0;
+	unsigned seed = 1;
+
+	Impairment toNodes, toHub;
+	bool applyToNodes = true, applyToHub = true;
+
+	try {
+		for(int i = 1; i < argc; ++i) {
+			std::string arg{argv[i]};
+			bool hasValue = (i+1 < argc);
+
+			//Sets the impairment field on the selected directions
+			auto set = [&](double Impairment::*field) {
+				double value = std::stod(argv[++i]);
+
+				if(applyToNodes) {
+					toNodes.*field = value;
+				}
+				if(applyToHub) {
+					toHub.*field = value;
+				}
+			};
+
+			if( (arg == "--hub-port") && hasValue ) {
+				hubPort = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--node-port") && hasValue ) {
+				nodePort = std::stoul(argv[++i]);
+			}
+			else if( (arg == "--duration") && hasValue ) {
+				duration = std::stod(argv[++i]);
+			}
+			else if( (arg == "--seed") && hasValue ) {
+				seed = std::stoul(argv[++i]);
+			}
+			else if(arg == "--to-nodes") {
+				applyToNodes = true;
+				applyToHub = false;
+			}
+			else if(arg == "--to-hub") {
+				applyToNodes = false;
+				applyToHub = true;
+			}
+			else if( (arg == "--loss") && hasValue ) {
+				set(&Impairment::loss);
+			}
+			else if( (arg == "--burst") && hasValue ) {
+				set(&Impairment::burst);
+			}
+			else if( (arg == "--delay-ms") && hasValue ) {
+				set(&Impairment::delayMs);
+			}
+			else if( (arg == "--jitter-ms") && hasValue ) {
+				set(&Impairment::jitterMs);
+			}
+			else if( (arg == "--duplicate") && hasValue ) {
+				set(&Impairment::duplicate);
+			}
+			else if( (arg == "--reorder") && hasValue ) {
+				set(&Impairment::reorder);
+			}
+			else if( (arg == "--reorder-gap-ms") && hasValue ) {
+				set(&Impairment::reorderGapMs);
+			}
+			else if( (arg == "--rate-kbps") && hasValue ) {
+				set(&Impairment::rateKbps);
+			}
+			else if( (arg == "--queue-ms") && hasValue ) {
+				set(&Impairment::queueMs);
+			}
+			else {
+				throw std::runtime_error("Unknown option " + arg);
+			}
+		}
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		Proxy proxy{hubPort, nodePort, seed};
+		proxy.toNodes.impairment = toNodes;
+		proxy.toHub.impairment = toHub;
+
+		signal(SIGINT, [](int) { interrupted = true; });
+		signal(SIGTERM, [](int) { interrupted = true; });
+
+		std::cerr << "Forwarding hub port " << hubPort << " to node port " << nodePort << std::endl;
+
+		proxy.run(duration);
+
+		Json::Value report;
+		report[proxy.toNodes.name] = proxy.toNodes.report();
+		report[proxy.toHub.name] = proxy.toHub.report();
+
+		std::cout << Json::StyledWriter().write(report);
+	}
+	catch(const std::exception& e) {
+		std::cerr << "[Error] " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}